@@ -0,0 +1,167 @@
+#ifndef BINARY_FRAME_H
+#define BINARY_FRAME_H
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <endian.h>
+#include "message.h"
+
+// The binary protocol, which a client selects by appending ":binary"
+// to its login request ("slogin:alice:binary"). The server replies to
+// the login with a text line, as always; every message after that, in
+// both directions, is a binary frame instead of a "tag:data" line.
+//
+// A frame is a fixed-size header followed by the payload. The header
+// starts with the length of the payload, so a frame is found without
+// looking at its payload at all, and payloads may contain any byte
+// and be much longer than text messages. All fields are little-endian.
+//
+//   offset  size
+//        0     4  payload length
+//        4     1  tag
+//        5     1  name length: a delivery's payload starts with the
+//                 message's sequence number in the room (8 bytes),
+//                 then the sender's username, this many bytes, then
+//                 the text
+//        6     2  reserved, 0
+//        8     4  room id: in replies and deliveries, the room the
+//                 user (or the sender) is in, 0 if none
+//       12     4  user id: in replies, the user's own id (0 before
+//                 login), in deliveries the sender's id
+//       16        payload
+//
+// Clients send 0 in the name length and id fields.
+struct BinaryHeader {
+  static const size_t SIZE = 16;
+
+  // A frame, header included, is never longer than this, so it fits
+  // into a LineReader's buffer
+  static const size_t MAX_FRAME = 8192;
+  static const size_t MAX_PAYLOAD = MAX_FRAME - SIZE;
+
+  // frame_length's result for a header announcing too long a payload
+  static const size_t INVALID = size_t(-1);
+
+  // Length of the sequence number a delivery's payload starts with
+  static const size_t SEQ_SIZE = 8;
+
+  uint32_t length = 0;
+  Tag tag = TAG_UNKNOWN;
+  uint8_t name_len = 0;
+  uint32_t room_id = 0;
+  uint32_t user_id = 0;
+
+  BinaryHeader() { }
+
+  BinaryHeader(Tag tag, size_t length, uint32_t room_id = 0, uint32_t user_id = 0)
+    : length(uint32_t(length)), tag(tag), room_id(room_id), user_id(user_id) { }
+
+  // Encode the header into SIZE bytes at out
+  void encode(char *out) const {
+    uint32_t le_length = htole32(length);
+    uint32_t le_room_id = htole32(room_id);
+    uint32_t le_user_id = htole32(user_id);
+    memcpy(out, &le_length, 4);
+    out[4] = char(tag);
+    out[5] = char(name_len);
+    out[6] = out[7] = 0;
+    memcpy(out + 8, &le_room_id, 4);
+    memcpy(out + 12, &le_user_id, 4);
+  }
+
+  // Decode the SIZE bytes of a header at in. Tags this server
+  // doesn't know are decoded as TAG_UNKNOWN.
+  void decode(const char *in) {
+    memcpy(&length, in, 4);
+    length = le32toh(length);
+    tag = uint8_t(in[4]) < NUM_TAGS ? Tag(uint8_t(in[4])) : TAG_UNKNOWN;
+    name_len = uint8_t(in[5]);
+    memcpy(&room_id, in + 8, 4);
+    room_id = le32toh(room_id);
+    memcpy(&user_id, in + 12, 4);
+    user_id = le32toh(user_id);
+  }
+
+  // Returns the length of the frame at the start of buf (header
+  // included), 0 if buf doesn't hold all of it yet, or INVALID
+  static size_t frame_length(const char *buf, size_t avail) {
+    if (avail < SIZE) {
+      return 0;
+    }
+    uint32_t length;
+    memcpy(&length, buf, 4);
+    length = le32toh(length);
+    if (length > MAX_PAYLOAD) {
+      return INVALID;
+    }
+    return avail < SIZE + length ? 0 : SIZE + length;
+  }
+
+  // Parse a complete frame in place: view's data points to the payload
+  static void parse(const char *frame, MessageView &view) {
+    BinaryHeader header;
+    header.decode(frame);
+    view.set(header.tag, frame + SIZE, header.length);
+  }
+
+  // Append a frame with the specified header and payload to out
+  static void append(std::string &out, const BinaryHeader &header, const char *payload) {
+    size_t pos = out.size();
+    out.resize(pos + SIZE + header.length);
+    header.encode(&out[pos]);
+    memcpy(&out[pos + SIZE], payload, header.length);
+  }
+};
+
+// The payload of a sendbatch request: a sequence of messages, each a
+// 16 bit little-endian length followed by that many bytes of text.
+// Batches are only accepted from clients using the binary protocol,
+// as the lengths may be any bytes.
+struct Batch {
+  static const size_t MAX_MESSAGES = 512;
+
+  // One message of a batch, pointing into the payload
+  struct Entry {
+    const char *text;
+    size_t len;
+  };
+
+  // Append a message to a batch payload; returns false if it doesn't
+  // fit into a frame anymore
+  static bool append(std::string &payload, const char *text, size_t len) {
+    if (payload.length() + 2 + len > BinaryHeader::MAX_PAYLOAD) {
+      return false;
+    }
+    uint16_t le_len = htole16(uint16_t(len));
+    payload.append(reinterpret_cast<const char *>(&le_len), 2);
+    payload.append(text, len);
+    return true;
+  }
+
+  // Split a batch payload into at most MAX_MESSAGES entries; returns
+  // their number, or 0 if the payload is malformed or holds too many
+  static size_t split(const char *payload, size_t len, Entry *entries) {
+    size_t count = 0;
+    size_t pos = 0;
+    while (pos < len) {
+      uint16_t text_len;
+      if (len - pos < 2 || count == MAX_MESSAGES) {
+        return 0;
+      }
+      memcpy(&text_len, payload + pos, 2);
+      text_len = le16toh(text_len);
+      pos += 2;
+      if (len - pos < text_len) {
+        return 0;
+      }
+      entries[count].text = payload + pos;
+      entries[count].len = text_len;
+      count++;
+      pos += text_len;
+    }
+    return count;
+  }
+};
+
+#endif // BINARY_FRAME_H
@@ -0,0 +1,251 @@
+#include <new>
+#include <atomic>
+#include <pthread.h>
+#include "guard.h"
+#include "block_pool.h"
+
+namespace {
+
+// Block sizes of the size classes; all are multiples of 16, so every
+// block is aligned like memory from operator new
+const size_t CLASS_SIZES[] = { 16, 32, 64, 128, 192, BlockPool::MAX_BLOCK_SIZE };
+const unsigned NUM_CLASSES = sizeof(CLASS_SIZES) / sizeof(CLASS_SIZES[0]);
+
+// Free blocks of one class a thread may cache before it hands
+// TRANSFER_BATCH of them back to the central free list
+const unsigned CACHE_LIMIT = 512;
+
+// Blocks moved between a thread's cache and the central free list at once
+const unsigned TRANSFER_BATCH = 128;
+
+// Memory is taken from the system in slabs of this size
+const size_t SLAB_SIZE = 64 * 1024;
+
+// A thread reports its statistics at least every this many allocations
+const unsigned long STATS_INTERVAL = 4096;
+
+// A free block, linked into a free list
+struct FreeBlock {
+  FreeBlock *next;
+};
+
+// The blocks of one size class shared by all threads
+struct Central {
+  pthread_mutex_t lock;
+  FreeBlock *free;
+  size_t num_free;
+  char *slab;       // unused part of the current slab
+  size_t slab_left;
+  std::atomic<unsigned long> allocs;
+  std::atomic<unsigned long> hits;
+  std::atomic<size_t> resident;
+};
+
+// Returns the central free lists, which are never destroyed, so that
+// threads exiting after main can still release their blocks
+Central *get_central() {
+  static Central *central = [] {
+    Central *c = new Central[NUM_CLASSES];
+    for (unsigned i = 0; i < NUM_CLASSES; i++) {
+      pthread_mutex_init(&c[i].lock, nullptr);
+      c[i].free = nullptr;
+      c[i].num_free = 0;
+      c[i].slab = nullptr;
+      c[i].slab_left = 0;
+      c[i].allocs = 0;
+      c[i].hits = 0;
+      c[i].resident = 0;
+    }
+    return c;
+  }();
+  return central;
+}
+
+// A thread's cache of free blocks, with the statistics it hasn't
+// reported yet
+struct ThreadCache {
+  FreeBlock *free[NUM_CLASSES];
+  unsigned num_free[NUM_CLASSES];
+  unsigned long allocs[NUM_CLASSES];
+  unsigned long hits[NUM_CLASSES];
+  bool destroyed;
+
+  ~ThreadCache();
+};
+
+thread_local ThreadCache t_cache;
+
+/**
+ * Returns the size class of blocks of the specified size.
+ */
+unsigned class_of(size_t size) {
+  unsigned c = 0;
+  while (CLASS_SIZES[c] < size) {
+    c++;
+  }
+  return c;
+}
+
+/**
+ * Adds a thread's statistics of a size class to the central ones.
+ */
+void report(ThreadCache &cache, unsigned c) {
+  Central &central = get_central()[c];
+  central.allocs.fetch_add(cache.allocs[c], std::memory_order_relaxed);
+  central.hits.fetch_add(cache.hits[c], std::memory_order_relaxed);
+  cache.allocs[c] = 0;
+  cache.hits[c] = 0;
+}
+
+/**
+ * Moves up to count blocks from a thread's cache to the central
+ * free list of their class.
+ */
+void give_back(ThreadCache &cache, unsigned c, unsigned count) {
+  FreeBlock *first = cache.free[c];
+  if (first == nullptr) {
+    return;
+  }
+
+  // unlink count blocks from the front of the thread's list
+  FreeBlock *last = first;
+  unsigned moved = 1;
+  while (moved < count && last->next != nullptr) {
+    last = last->next;
+    moved++;
+  }
+  cache.free[c] = last->next;
+  cache.num_free[c] -= moved;
+
+  Central &central = get_central()[c];
+  Guard guard(central.lock);
+  last->next = central.free;
+  central.free = first;
+  central.num_free += moved;
+}
+
+/**
+ * Fills a thread's empty cache with a batch of blocks, from the
+ * central free list if it has any, or else from a slab.
+ */
+void refill(ThreadCache &cache, unsigned c) {
+  Central &central = get_central()[c];
+  size_t block_size = CLASS_SIZES[c];
+  Guard guard(central.lock);
+
+  unsigned taken = 0;
+  while (taken < TRANSFER_BATCH && central.free != nullptr) {
+    FreeBlock *block = central.free;
+    central.free = block->next;
+    block->next = cache.free[c];
+    cache.free[c] = block;
+    taken++;
+  }
+  central.num_free -= taken;
+
+  while (taken < TRANSFER_BATCH) {
+    if (central.slab_left < block_size) {
+      // what is left of the old slab is too small for a block
+      central.slab = static_cast<char *>(::operator new(SLAB_SIZE));
+      central.slab_left = SLAB_SIZE;
+      central.resident.fetch_add(SLAB_SIZE, std::memory_order_relaxed);
+    }
+    FreeBlock *block = reinterpret_cast<FreeBlock *>(central.slab);
+    central.slab += block_size;
+    central.slab_left -= block_size;
+    block->next = cache.free[c];
+    cache.free[c] = block;
+    taken++;
+  }
+  cache.num_free[c] += taken;
+}
+
+/**
+ * Destructor of a thread's cache: hands all its blocks back when
+ * the thread exits.
+ */
+ThreadCache::~ThreadCache() {
+  for (unsigned c = 0; c < NUM_CLASSES; c++) {
+    give_back(*this, c, num_free[c]);
+    report(*this, c);
+  }
+  // blocks released by destructors running after this one
+  // go straight to the central free lists
+  destroyed = true;
+}
+
+}
+
+/**
+ * Allocates a block.
+ *
+ * @param size The size of the block in bytes.
+ * @return The block.
+ */
+void *BlockPool::allocate(size_t size) {
+  if (size > MAX_BLOCK_SIZE) {
+    return ::operator new(size);
+  }
+
+  unsigned c = class_of(size);
+  ThreadCache &cache = t_cache;
+  if (cache.free[c] != nullptr) {
+    cache.hits[c]++;
+  } else {
+    refill(cache, c);
+  }
+  if (++cache.allocs[c] % STATS_INTERVAL == 0) {
+    report(cache, c);
+  }
+
+  FreeBlock *block = cache.free[c];
+  cache.free[c] = block->next;
+  cache.num_free[c]--;
+  if (cache.destroyed) {
+    give_back(cache, c, cache.num_free[c]);
+    report(cache, c);
+  }
+  return block;
+}
+
+/**
+ * Releases a block.
+ *
+ * @param block The block.
+ * @param size The size the block was allocated with.
+ */
+void BlockPool::release(void *block, size_t size) {
+  if (size > MAX_BLOCK_SIZE) {
+    ::operator delete(block);
+    return;
+  }
+
+  unsigned c = class_of(size);
+  ThreadCache &cache = t_cache;
+  FreeBlock *free_block = static_cast<FreeBlock *>(block);
+  free_block->next = cache.free[c];
+  cache.free[c] = free_block;
+  cache.num_free[c]++;
+  if (cache.destroyed) {
+    give_back(cache, c, cache.num_free[c]);
+  } else if (cache.num_free[c] > CACHE_LIMIT) {
+    give_back(cache, c, TRANSFER_BATCH);
+  }
+}
+
+/**
+ * Returns the statistics of each size class.
+ */
+std::vector<BlockPool::ClassStats> BlockPool::get_stats() {
+  Central *central = get_central();
+  std::vector<ClassStats> stats(NUM_CLASSES);
+  for (unsigned c = 0; c < NUM_CLASSES; c++) {
+    stats[c].block_size = CLASS_SIZES[c];
+    stats[c].allocs = central[c].allocs.load(std::memory_order_relaxed);
+    stats[c].hits = central[c].hits.load(std::memory_order_relaxed);
+    stats[c].resident = central[c].resident.load(std::memory_order_relaxed);
+    Guard guard(central[c].lock);
+    stats[c].free = central[c].num_free * CLASS_SIZES[c];
+  }
+  return stats;
+}
@@ -0,0 +1,46 @@
+#ifndef BLOCK_POOL_H
+#define BLOCK_POOL_H
+
+#include <cstddef>
+#include <vector>
+
+// BlockPool allocates the small, short-lived blocks of memory every
+// delivery needs (Frames and message queue nodes) without going
+// through malloc each time.
+//
+// Sizes are rounded up to a few size classes. Each thread caches free
+// blocks of every class, so most allocations and releases touch no
+// shared state at all. A thread whose cache grows too large (because
+// it frees blocks other threads allocated, as receivers do) hands a
+// batch of blocks back to a central free list, which threads with an
+// empty cache take batches from; only when that is empty too is new
+// memory carved out of a slab. Memory is never returned to the system.
+class BlockPool {
+public:
+  // Larger blocks are allocated with operator new
+  static const size_t MAX_BLOCK_SIZE = 272;
+
+  // Returns a block of at least size bytes, aligned for any type
+  static void *allocate(size_t size);
+
+  // Releases a block returned by allocate(size)
+  static void release(void *block, size_t size);
+
+  // Statistics of one size class. Threads report their allocations
+  // periodically, so the counts lag a little behind.
+  struct ClassStats {
+    size_t block_size;
+    unsigned long allocs; // blocks allocated
+    unsigned long hits;   // allocations served by the thread's cache
+    size_t resident;      // bytes taken from the system
+    size_t free;          // bytes in the central free list
+  };
+
+  static std::vector<ClassStats> get_stats();
+
+private:
+  // only static members
+  BlockPool();
+};
+
+#endif // BLOCK_POOL_H
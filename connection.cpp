@@ -1,27 +1,33 @@
-#include <sstream>
 #include <cctype>
 #include <cassert>
+#include <cerrno>
+#include <climits>
+#include <sys/uio.h>
 #include "csapp.h"
 #include "message.h"
+#include "frame.h"
 #include "connection.h"
 
 Connection::Connection()
   : m_fd(-1)
-  , m_last_result(SUCCESS) {
+  , m_last_result(SUCCESS)
+  , m_binary(false) {
 }
 
-// Call rio_readinitb to initialize the rio_t object
+// Start reading lines from the socket
 Connection::Connection(int fd)
   : m_fd(fd)
-  , m_last_result(SUCCESS) {
-  Rio_readinitb(&m_fdbuf, fd);
+  , m_reader(fd)
+  , m_last_result(SUCCESS)
+  , m_binary(false) {
 }
 
 // Call open_clientfd to connect to the server
-// Call rio_readinitb to initialize the rio_t object
+// and start reading lines from the socket
 void Connection::connect(const std::string &hostname, int port) {
-  m_fd = Open_clientfd(const_cast<char *>(hostname.c_str()), std::to_string(port).c_str());
-  Rio_readinitb(&m_fdbuf, m_fd);
+  // a failure leaves the connection closed, rather than exiting
+  m_fd = open_clientfd(hostname.c_str(), std::to_string(port).c_str());
+  m_reader.reset(m_fd);
 }
 
 // Close the socket if it is open
@@ -49,6 +55,23 @@ void Connection::close() {
 // return true if successful, false if not
 // make sure that m_last_result is set appropriately
 bool Connection::send(const Message &msg) {
+  if (!m_binary) {
+    return send(InlineMessage(msg));
+  }
+
+  // binary frames may carry longer data than an InlineMessage holds
+  if (msg.data.length() > BinaryHeader::MAX_PAYLOAD) {
+    m_last_result = INVALID_MSG;
+    return false;
+  }
+  std::string frame;
+  BinaryHeader::append(frame, BinaryHeader(msg.tag, msg.data.length()), msg.data.data());
+  return send(frame.data(), frame.size());
+}
+
+// Send a message stored inline
+// return true if successful, false if not
+bool Connection::send(const InlineMessage &msg) {
   // Check if connection is open
   if (!is_open()) {
     m_last_result = EOF_OR_ERROR;
@@ -56,50 +79,178 @@ bool Connection::send(const Message &msg) {
   }
 
   // Check if the encoded message is not be more than MAX_LEN bytes.
-  if (msg.tag.length() + msg.data.length() + 1 > msg.MAX_LEN) {
+  if (!msg.is_valid()) {
     m_last_result = INVALID_MSG; // Invalid message length
     return false;
   }
 
-  const std::string send_msg = msg.tag + ":" + msg.data + "\n";
-  const char* send_msg_chr = send_msg.c_str();
+  char encoded[BinaryHeader::SIZE + InlineMessage::CAPACITY];
+  size_t len;
+  if (m_binary) {
+    BinaryHeader(msg.tag(), msg.data_length()).encode(encoded);
+    memcpy(encoded + BinaryHeader::SIZE, msg.data(), msg.data_length());
+    len = BinaryHeader::SIZE + msg.data_length();
+  } else {
+    len = msg.encode(encoded);
+  }
+  return send(encoded, len);
+}
+
+// Send bytes which are an encoded message (or several) already
+// return true if successful, false if not
+bool Connection::send(const char *data, size_t len) {
+  if (!is_open()) {
+    m_last_result = EOF_OR_ERROR;
+    return false;
+  }
+
+  if (rio_writen(m_fd, data, len) < 1) {
+    m_last_result = EOF_OR_ERROR;
+    return false;
+  }
+
+  m_last_result = SUCCESS;
+  return true;
+}
+
+// Send an already encoded message
+// return true if successful, false if not
+bool Connection::send(const Frame &frame) {
+  return send(frame.data(), frame.size());
+}
 
-  if (ssize_t bytes_written = rio_writen(m_fd, send_msg_chr, send_msg.length()) < 1) {
+// Send a batch of already encoded messages, gathering them
+// into as few writev calls as possible
+// return true if successful, false if not
+bool Connection::send(Frame *const *frames, size_t count) {
+  if (!is_open()) {
     m_last_result = EOF_OR_ERROR;
     return false;
   }
 
+  struct iovec iov[IOV_MAX];
+  size_t next = 0;
+  while (next < count) {
+    int iovcnt = 0;
+    while (next < count && iovcnt < IOV_MAX) {
+      iov[iovcnt].iov_base = const_cast<char *>(frames[next]->data());
+      iov[iovcnt].iov_len = frames[next]->size();
+      iovcnt++;
+      next++;
+    }
+
+    // writev may write only part of the batch, continue where it stopped
+    struct iovec *pos = iov;
+    while (iovcnt > 0) {
+      ssize_t n = writev(m_fd, pos, iovcnt);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        m_last_result = EOF_OR_ERROR;
+        return false;
+      }
+      while (iovcnt > 0 && size_t(n) >= pos->iov_len) {
+        n -= pos->iov_len;
+        pos++;
+        iovcnt--;
+      }
+      if (iovcnt > 0) {
+        pos->iov_base = static_cast<char *>(pos->iov_base) + n;
+        pos->iov_len -= n;
+      }
+    }
+  }
+
   m_last_result = SUCCESS;
   return true;
 }
 
+// Receive a message, storing its tag and data in msg
+// return true if successful, false if not
+// make sure that m_last_result is set appropriately
 bool Connection::receive(Message &msg) {
-  // TODO: receive a message, storing its tag and data in msg
-  // return true if successful, false if not
-  // make sure that m_last_result is set appropriately
+  MessageView view;
+  if (!receive(view)) {
+    return false;
+  }
+
+  // the view only lives until the next receive, msg is the caller's
+  msg.assign(view);
+  return true;
+}
+
+// Receive a message, copying its tag and data into msg
+// return true if successful, false if not
+bool Connection::receive(InlineMessage &msg) {
+  MessageView view;
+  if (!receive(view)) {
+    return false;
+  }
+
+  msg.set(view.tag_id(), view.data, view.data_len);
+  return true;
+}
 
+// Receive a message and parse it in place in the read buffer
+// return true if successful, false if not
+bool Connection::receive(MessageView &view) {
   // Check if connection is open
   if (!is_open()) {
     m_last_result = EOF_OR_ERROR;
     return false;
   }
 
-  char server_msg_buf[msg.MAX_LEN +1];
+  if (m_binary) {
+    return receive_frame(view);
+  }
 
-  if (ssize_t bytes_read = Rio_readlineb(&m_fdbuf, server_msg_buf, msg.MAX_LEN) < 1) {
+  // the line is parsed where it was read, in the reader's buffer
+  const char *line;
+  ssize_t len = m_reader.read_line(&line, Message::MAX_LEN);
+  if (len < 1) {
     m_last_result = EOF_OR_ERROR;
     return false;
   }
 
-  std::string msg_tag, msg_data;
+  view.parse(line, size_t(len));
 
-  std::istringstream iss(server_msg_buf);
-  std::getline(iss, msg_tag, ':');
-  std::getline(iss, msg_data);
+  m_last_result = SUCCESS;
+  return true;
+}
 
-  msg.tag = msg_tag;
-  msg.data = msg_data;
+// Receive a binary frame and parse it in place in the read buffer
+// return true if successful, false if not
+bool Connection::receive_frame(MessageView &view) {
+  const char *header;
+  if (m_reader.read_bytes(&header, BinaryHeader::SIZE) < 1) {
+    m_last_result = EOF_OR_ERROR;
+    return false;
+  }
+  m_last_header.decode(header);
+  if (m_last_header.length > BinaryHeader::MAX_PAYLOAD) {
+    m_last_result = INVALID_MSG;
+    return false;
+  }
+
+  // the next read may move the header, but not the payload
+  const char *payload = header + BinaryHeader::SIZE;
+  if (m_last_header.length > 0 && m_reader.read_bytes(&payload, m_last_header.length) < 1) {
+    m_last_result = EOF_OR_ERROR;
+    return false;
+  }
+  view.set(m_last_header.tag, payload, m_last_header.length);
 
   m_last_result = SUCCESS;
   return true;
 }
+
+// Check whether the next receive can return a message without reading
+bool Connection::has_buffered_message() const {
+  if (!m_binary) {
+    return m_reader.has_line(Message::MAX_LEN);
+  }
+  const char *data;
+  size_t avail = m_reader.peek(&data);
+  return BinaryHeader::frame_length(data, avail) != 0;
+}
@@ -2,7 +2,10 @@
 #define CONNECTION_H
 
 #include "csapp.h"
-struct Message;
+#include "message.h"
+#include "binary_frame.h"
+#include "line_reader.h"
+class Frame;
 
 class Connection {
 public:
@@ -31,6 +34,12 @@ public:
   void connect(const std::string &hostname, int port);
 
   bool is_open() const;
+  int get_fd() const { return m_fd; }
+
+  // Switch between the text protocol (the default) and the binary
+  // one, once the login reply was received (or sent)
+  void set_binary(bool binary) { m_binary = binary; }
+  bool is_binary() const { return m_binary; }
 
   void close();
 
@@ -39,7 +48,24 @@ public:
   // and if not, whether the reason was an I/O error or reaching EOF,
   // or whether the format of the received message was invalid
   bool send(const Message &msg);
+  bool send(const InlineMessage &msg);
+  bool send(const Frame &frame); // send an already encoded message
+  bool send(Frame *const *frames, size_t count); // send several with one writev
+  bool send(const char *data, size_t len); // send bytes encoded already
   bool receive(Message &msg);
+  bool receive(InlineMessage &msg);
+
+  // Receive a message without copying it: view points into the
+  // connection's read buffer, and is valid until the next receive
+  bool receive(MessageView &view);
+
+  // The header of the binary frame received last, which holds
+  // the ids and a delivery's name length
+  const BinaryHeader &get_last_header() const { return m_last_header; }
+
+  // Returns true if a message has been received already, so the
+  // next receive won't block
+  bool has_buffered_message() const;
 
   Result get_last_result() const { return m_last_result; }
 
@@ -48,11 +74,15 @@ private:
   Connection(const Connection &);
   Connection &operator=(const Connection &);
 
+  bool receive_frame(MessageView &view);
+
   // these are the recommended member variables for the
   // Connection class
   int m_fd;
-  rio_t m_fdbuf; // used to allow buffered input
+  LineReader m_reader; // used to allow buffered input
   Result m_last_result;
+  bool m_binary;
+  BinaryHeader m_last_header;
 };
 
 #endif // CONNECTION_H
@@ -0,0 +1,429 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "message.h"
+#include "frame.h"
+#include "user.h"
+#include "session.h"
+#include "guard.h"
+#include "event_loop.h"
+
+namespace {
+
+// Stop draining a receiver's queue once this much output is pending,
+// the rest is picked up once the socket becomes writable again
+const size_t OUTPUT_HIGH_WATER = 64 * 1024;
+
+// Maximum number of reads performed per readiness event, so a single
+// busy client can't starve the others
+const int MAX_READS_PER_EVENT = 16;
+
+const int MAX_EVENTS = 256;
+
+bool set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+}
+
+// Per-connection state
+struct EventLoop::Client {
+  int fd;
+  Session session;
+  std::string in;      // received bytes not yet parsed into requests
+  std::string out;     // encoded messages not yet written
+  size_t out_pos;      // how much of out has already been written
+  uint32_t events;     // the socket events currently requested
+  int queue_fd;        // receiver's queue eventfd, once watched
+  bool queue_backlog;  // deliver stopped before the queue was empty
+  bool hangup;         // the peer closed its end: close once output is sent
+  bool closed;         // waiting to be destroyed
+  Watch sock_watch;
+  Watch queue_watch;
+
+  Client(int fd, Server *server)
+    : fd(fd)
+    , session(server)
+    , out_pos(0)
+    , events(EPOLLIN | EPOLLRDHUP)
+    , queue_fd(-1)
+    , queue_backlog(false)
+    , hangup(false)
+    , closed(false) {
+    sock_watch.client = this;
+    sock_watch.is_queue = false;
+    queue_watch.client = this;
+    queue_watch.is_queue = true;
+  }
+
+  size_t pending_output() const { return out.size() - out_pos; }
+};
+
+/**
+ * Constructor for the EventLoop class.
+ *
+ * @param server The Server object managing the connections.
+ */
+EventLoop::EventLoop(Server *server)
+  : m_server(server)
+  , m_epfd(-1)
+  , m_wakefd(-1) {
+  pthread_mutex_init(&m_lock, nullptr);
+}
+
+/**
+ * Destructor for the EventLoop class.
+ */
+EventLoop::~EventLoop() {
+  if (m_wakefd >= 0) {
+    close(m_wakefd);
+  }
+  if (m_epfd >= 0) {
+    close(m_epfd);
+  }
+  pthread_mutex_destroy(&m_lock);
+}
+
+/**
+ * Creates the epoll instance and starts the loop thread.
+ *
+ * @return True if successful, false otherwise.
+ */
+bool EventLoop::start() {
+  m_epfd = epoll_create1(EPOLL_CLOEXEC);
+  m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_epfd < 0 || m_wakefd < 0) {
+    std::cerr << "Error: could not create event loop: " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr; // the wakeup eventfd is the only watch without a client
+  if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_wakefd, &ev) < 0) {
+    std::cerr << "Error: epoll_ctl: " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  if (pthread_create(&m_thread, nullptr, run, this) != 0) {
+    std::cerr << "Pthread Creation Error" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Hands over a newly accepted client socket to the loop thread.
+ *
+ * @param fd The client socket.
+ */
+void EventLoop::add_connection(int fd) {
+  {
+    Guard guard(m_lock);
+    m_pending.push_back(fd);
+  }
+  uint64_t one = 1;
+  ssize_t rc = write(m_wakefd, &one, sizeof(one));
+  (void) rc;
+}
+
+void *EventLoop::run(void *arg) {
+  static_cast<EventLoop *>(arg)->loop();
+  return nullptr;
+}
+
+/**
+ * Main loop: waits for readiness events and dispatches them.
+ */
+void EventLoop::loop() {
+  struct epoll_event events[MAX_EVENTS];
+
+  while (true) {
+    int n = epoll_wait(m_epfd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "Error: epoll_wait: " << strerror(errno) << std::endl;
+      return;
+    }
+
+    for (int i = 0; i < n; i++) {
+      Watch *watch = static_cast<Watch *>(events[i].data.ptr);
+      if (watch == nullptr) {
+        register_pending();
+      } else if (watch->client->closed) {
+        continue;
+      } else if (watch->is_queue) {
+        on_queue_event(watch->client);
+      } else {
+        on_socket_event(watch->client, events[i].events);
+      }
+    }
+
+    for (Client *client : m_closed) {
+      delete client; // destroying the session removes the user from its room
+    }
+    m_closed.clear();
+  }
+}
+
+/**
+ * Registers the connections handed over by add_connection with epoll.
+ */
+void EventLoop::register_pending() {
+  uint64_t count;
+  ssize_t rc = read(m_wakefd, &count, sizeof(count));
+  (void) rc;
+
+  std::vector<int> fds;
+  {
+    Guard guard(m_lock);
+    fds.swap(m_pending);
+  }
+
+  for (int fd : fds) {
+    if (!set_nonblocking(fd)) {
+      close(fd);
+      continue;
+    }
+    Client *client = new Client(fd, m_server);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = &client->sock_watch;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      std::cerr << "Error: epoll_ctl: " << strerror(errno) << std::endl;
+      close(fd);
+      delete client;
+    }
+  }
+}
+
+/**
+ * Handles readiness of a client socket.
+ */
+void EventLoop::on_socket_event(Client *client, uint32_t events) {
+  if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !client->hangup &&
+      !read_requests(client)) {
+    close_client(client);
+    return;
+  }
+
+  if (!client->hangup && client->session.get_state() == Session::RECEIVER && client->queue_fd < 0) {
+    watch_queue(client);
+  }
+
+  // once everything pending has been written, more deliveries can be
+  // taken off the receiver's queue
+  if ((events & EPOLLOUT) && flush(client)) {
+    deliver(client);
+  }
+
+  // the replies to the last requests of a client which closed its
+  // end are still sent before the client is closed
+  if (!flush(client)) {
+    close_client(client);
+    return;
+  }
+
+  bool ending = client->hangup || client->session.get_state() == Session::CLOSED;
+  if (ending && client->pending_output() == 0) {
+    close_client(client);
+  }
+}
+
+/**
+ * Handles a receiver's queue having new messages.
+ */
+void EventLoop::on_queue_event(Client *client) {
+  uint64_t count;
+  ssize_t rc = read(client->queue_fd, &count, sizeof(count));
+  (void) rc;
+
+  if (client->hangup) {
+    return; // only waiting for the output to drain
+  }
+  deliver(client);
+  if (!flush(client)) {
+    close_client(client);
+  }
+}
+
+/**
+ * Reads whatever the client has sent and processes every complete
+ * request. At EOF, the client is marked as hung up.
+ *
+ * @return False if the connection failed, true otherwise.
+ */
+bool EventLoop::read_requests(Client *client) {
+  bool open = true;
+  bool eof = false;
+  char buf[4096];
+
+  for (int i = 0; i < MAX_READS_PER_EVENT; i++) {
+    ssize_t n = read(client->fd, buf, sizeof(buf));
+    if (n > 0) {
+      client->in.append(buf, n);
+      if (static_cast<size_t>(n) < sizeof(buf)) {
+        break;
+      }
+    } else if (n == 0) {
+      eof = true;
+      break;
+    } else if (errno == EINTR) {
+      continue;
+    } else {
+      open = (errno == EAGAIN || errno == EWOULDBLOCK);
+      break;
+    }
+  }
+
+  size_t pos = 0;
+  while (client->session.get_state() != Session::CLOSED) {
+    MessageView request;
+    size_t len = client->session.next_request(client->in.data() + pos, client->in.size() - pos,
+                                              eof || !open, request);
+    if (len == 0) {
+      break;
+    }
+    process_request(client, request);
+    pos += len;
+  }
+
+  // requests of a pipelining sender are acknowledged once per read
+  InlineMessage ack;
+  if (client->session.take_ack(ack)) {
+    client->session.append_reply(ack, client->out);
+  }
+  client->in.erase(0, pos);
+
+  if (eof) {
+    client->hangup = true;
+    client->queue_backlog = false;
+  }
+  return open;
+}
+
+/**
+ * Passes one request to the client's session and queues its reply.
+ */
+void EventLoop::process_request(Client *client, const MessageView &request) {
+  InlineMessage reply;
+  if (client->session.handle(request, reply)) {
+    client->session.append_reply(reply, client->out);
+  }
+}
+
+/**
+ * Starts watching the queue of a receiver which has just joined a room.
+ */
+void EventLoop::watch_queue(Client *client) {
+  User *user = client->session.get_user();
+  user->mqueue.set_socket(client->fd);
+  int fd = user->mqueue.get_notify_fd();
+  if (fd < 0) {
+    return;
+  }
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = &client->queue_watch;
+  if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    std::cerr << "Error: epoll_ctl: " << strerror(errno) << std::endl;
+    return;
+  }
+  client->queue_fd = fd;
+
+  // messages enqueued before the eventfd existed didn't signal it
+  deliver(client);
+}
+
+/**
+ * Moves messages from a receiver's queue into its output buffer,
+ * until the queue is empty or enough output is pending.
+ */
+void EventLoop::deliver(Client *client) {
+  if (client->queue_fd < 0 || client->hangup) {
+    return;
+  }
+
+  User *user = client->session.get_user();
+  client->queue_backlog = true;
+  while (client->pending_output() < OUTPUT_HIGH_WATER) {
+    Frame *frame = user->mqueue.try_dequeue();
+    if (frame == nullptr) {
+      // have the next enqueue signal the eventfd, unless one raced us
+      if (user->mqueue.arm_notify()) {
+        client->queue_backlog = false;
+        break;
+      }
+      continue;
+    }
+    client->out.append(frame->data(), frame->size());
+    frame->unref();
+  }
+}
+
+/**
+ * Writes as much pending output as the socket accepts, and requests
+ * EPOLLOUT if some of it remains, or if deliveries are still queued
+ * (the queue's eventfd isn't signaled for those). Once the client hung
+ * up, only EPOLLOUT is requested.
+ *
+ * @return False if writing failed, true otherwise.
+ */
+bool EventLoop::flush(Client *client) {
+  while (client->pending_output() > 0) {
+    ssize_t n = write(client->fd, client->out.data() + client->out_pos, client->pending_output());
+    if (n > 0) {
+      client->out_pos += n;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else {
+      return false;
+    }
+  }
+
+  if (client->pending_output() == 0) {
+    client->out.clear();
+    client->out_pos = 0;
+  }
+
+  bool want_write = client->pending_output() > 0 || client->queue_backlog;
+  uint32_t events = (client->hangup ? 0 : EPOLLIN | EPOLLRDHUP) | (want_write ? EPOLLOUT : 0);
+  if (events != client->events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = &client->sock_watch;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_MOD, client->fd, &ev) < 0) {
+      return false;
+    }
+    client->events = events;
+  }
+  return true;
+}
+
+/**
+ * Closes a client connection and ends its session.
+ */
+void EventLoop::close_client(Client *client) {
+  epoll_ctl(m_epfd, EPOLL_CTL_DEL, client->fd, nullptr);
+  if (client->queue_fd >= 0) {
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, client->queue_fd, nullptr);
+  }
+  // leave the room before closing the socket, which
+  // a queue overflow may otherwise still shut down
+  client->session.close();
+  close(client->fd);
+  client->closed = true;
+  m_closed.push_back(client);
+}
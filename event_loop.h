@@ -0,0 +1,69 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <vector>
+#include <cstdint>
+#include <pthread.h>
+class Server;
+struct MessageView;
+
+// An EventLoop services many client connections from a single thread.
+// Client sockets are non-blocking and registered with epoll, along with
+// the eventfd of each receiver's message queue. Each connection is driven
+// by a small state machine: requests are parsed out of its input buffer
+// and handed to its Session, and replies and deliveries are appended to
+// its output buffer, which is written whenever the socket is writable.
+class EventLoop {
+public:
+  EventLoop(Server *server);
+  ~EventLoop();
+
+  // Create the epoll instance and start the loop thread
+  bool start();
+
+  // Hand over a newly accepted client socket to the loop.
+  // May be called from any thread.
+  void add_connection(int fd);
+
+private:
+  // prohibit value semantics
+  EventLoop(const EventLoop &);
+  EventLoop &operator=(const EventLoop &);
+
+  struct Client;
+
+  // epoll user data: identifies the connection and which of
+  // its file descriptors the event is for
+  struct Watch {
+    Client *client;
+    bool is_queue;
+  };
+
+  static void *run(void *arg);
+  void loop();
+
+  void register_pending();
+  void on_socket_event(Client *client, uint32_t events);
+  void on_queue_event(Client *client);
+
+  bool read_requests(Client *client);
+  void process_request(Client *client, const MessageView &request);
+  void watch_queue(Client *client);
+  void deliver(Client *client);
+  bool flush(Client *client);
+  void close_client(Client *client);
+
+  Server *m_server;
+  int m_epfd;
+  int m_wakefd; // eventfd used to signal newly added connections
+  pthread_t m_thread;
+
+  pthread_mutex_t m_lock; // protects m_pending
+  std::vector<int> m_pending;
+
+  // clients closed while handling the current batch of events,
+  // destroyed once the batch is done
+  std::vector<Client *> m_closed;
+};
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,214 @@
+#include <iostream>
+#include "guard.h"
+#include "fanout_pool.h"
+
+namespace {
+
+/**
+ * Returns the size class of a room with the specified number of members.
+ */
+unsigned size_class(size_t members) {
+  unsigned size_class = 0;
+  for (size_t limit = 10; members >= limit && size_class < FanoutPool::NUM_SIZE_CLASSES - 1; limit *= 10) {
+    size_class++;
+  }
+  return size_class;
+}
+
+/**
+ * Returns the histogram bucket of a latency: 0 if it is below
+ * 1 microsecond, i if it is below 2^i microseconds otherwise.
+ */
+unsigned bucket(uint64_t nanos) {
+  uint64_t micros = nanos / 1000;
+  if (micros == 0) {
+    return 0;
+  }
+  unsigned bucket = 64 - __builtin_clzll(micros);
+  return bucket < FanoutPool::NUM_BUCKETS ? bucket : FanoutPool::NUM_BUCKETS - 1;
+}
+
+/**
+ * Returns the upper bound (in microseconds) of the bucket holding
+ * the latency below which the specified share of the latencies lie.
+ */
+unsigned long percentile(const unsigned long *counts, unsigned long total, double share) {
+  unsigned long seen = 0;
+  for (unsigned i = 0; i < FanoutPool::NUM_BUCKETS; i++) {
+    seen += counts[i];
+    if (seen >= total * share) {
+      return 1UL << i;
+    }
+  }
+  return 1UL << (FanoutPool::NUM_BUCKETS - 1);
+}
+
+}
+
+/**
+ * Constructor for the FanoutPool class.
+ *
+ * @param threshold The number of members from which on rooms are
+ *                  delivered to in parallel, 0 for never.
+ * @param num_workers The number of worker threads (at least 1).
+ */
+FanoutPool::FanoutPool(size_t threshold, unsigned num_workers)
+  : m_threshold(threshold)
+  , m_num_workers(num_workers) {
+  for (SizeClass &size_class : m_classes) {
+    for (std::atomic<unsigned long> &count : size_class.buckets) {
+      count.store(0, std::memory_order_relaxed);
+    }
+    size_class.parallel.store(0, std::memory_order_relaxed);
+    size_class.max_nanos.store(0, std::memory_order_relaxed);
+  }
+}
+
+/**
+ * Destructor for the FanoutPool class.
+ * The workers run for the lifetime of the server, so there is
+ * nothing to stop.
+ */
+FanoutPool::~FanoutPool() {
+}
+
+/**
+ * Creates the worker threads, unless no room will be delivered
+ * to in parallel.
+ *
+ * @return True if successful, false otherwise.
+ */
+bool FanoutPool::start() {
+  if (m_threshold == 0) {
+    return true;
+  }
+  for (unsigned i = 0; i < m_num_workers; i++) {
+    Worker *worker = new Worker();
+    worker->pool = this;
+    worker->index = i;
+    pthread_mutex_init(&worker->lock, nullptr);
+    pthread_cond_init(&worker->cond, nullptr);
+    m_workers.push_back(worker);
+  }
+
+  for (Worker *worker : m_workers) {
+    if (pthread_create(&worker->thread, nullptr, run, worker) != 0) {
+      std::cerr << "Pthread Creation Error" << std::endl;
+      return false;
+    }
+    pthread_detach(worker->thread);
+  }
+  return true;
+}
+
+/**
+ * Runs a task on every worker, after the tasks dispatched before.
+ *
+ * @param fn The function to run; its second argument is the index
+ *           of the worker running it.
+ * @param arg The first argument passed to fn.
+ */
+void FanoutPool::dispatch(TaskFn fn, void *arg) {
+  Task task = { fn, arg };
+  for (Worker *worker : m_workers) {
+    bool was_idle;
+    {
+      Guard guard(worker->lock);
+      was_idle = worker->tasks.empty();
+      worker->tasks.push_back(task);
+    }
+    if (was_idle) {
+      pthread_cond_signal(&worker->cond);
+    }
+  }
+}
+
+/**
+ * Thread function of a worker.
+ *
+ * @param arg The Worker object.
+ * @return nullptr.
+ */
+void *FanoutPool::run(void *arg) {
+  Worker *self = static_cast<Worker *>(arg);
+  self->pool->work(self);
+  return nullptr;
+}
+
+/**
+ * Runs the worker's tasks in order, waiting for more when
+ * there are none.
+ *
+ * @param self The worker.
+ */
+void FanoutPool::work(Worker *self) {
+  while (true) {
+    Task task;
+    {
+      Guard guard(self->lock);
+      while (self->tasks.empty()) {
+        pthread_cond_wait(&self->cond, &self->lock);
+      }
+      task = self->tasks.front();
+      self->tasks.pop_front();
+    }
+    task.fn(task.arg, self->index);
+  }
+}
+
+/**
+ * Records how long a broadcast took to reach all members.
+ *
+ * @param members The number of members it was delivered to.
+ * @param nanos The time it took.
+ * @param parallel Whether it was delivered by the workers.
+ */
+void FanoutPool::record(size_t members, uint64_t nanos, bool parallel) {
+  if (members == 0) {
+    return;
+  }
+  SizeClass &stats = m_classes[size_class(members)];
+  stats.buckets[bucket(nanos)].fetch_add(1, std::memory_order_relaxed);
+  if (parallel) {
+    stats.parallel.fetch_add(1, std::memory_order_relaxed);
+  }
+  uint64_t max = stats.max_nanos.load(std::memory_order_relaxed);
+  while (nanos > max && !stats.max_nanos.compare_exchange_weak(max, nanos, std::memory_order_relaxed)) {
+  }
+}
+
+/**
+ * Prints, for every size class of rooms broadcast to since the
+ * previous report, how many broadcasts there were, and percentiles
+ * of how long they took to reach all members. The percentiles are
+ * the upper bounds of the histogram buckets they fall into.
+ *
+ * @param out The stream to print to.
+ */
+void FanoutPool::report(std::ostream &out) {
+  size_t low = 1;
+  for (unsigned i = 0; i < NUM_SIZE_CLASSES; i++, low *= 10) {
+    SizeClass &stats = m_classes[i];
+    unsigned long counts[NUM_BUCKETS];
+    unsigned long total = 0;
+    for (unsigned j = 0; j < NUM_BUCKETS; j++) {
+      counts[j] = stats.buckets[j].exchange(0, std::memory_order_relaxed);
+      total += counts[j];
+    }
+    unsigned long parallel = stats.parallel.exchange(0, std::memory_order_relaxed);
+    uint64_t max_nanos = stats.max_nanos.exchange(0, std::memory_order_relaxed);
+    if (total == 0) {
+      continue;
+    }
+
+    out << "stats: fanout: rooms of " << low;
+    if (i < NUM_SIZE_CLASSES - 1) {
+      out << "-" << low * 10 - 1;
+    } else {
+      out << "+";
+    }
+    out << " members: " << total << " broadcasts (" << parallel << " parallel), p50 <"
+        << percentile(counts, total, 0.5) << "us, p90 <" << percentile(counts, total, 0.9)
+        << "us, p99 <" << percentile(counts, total, 0.99) << "us, max " << max_nanos / 1000 << "us\n";
+  }
+}
@@ -0,0 +1,99 @@
+#ifndef FANOUT_POOL_H
+#define FANOUT_POOL_H
+
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <pthread.h>
+
+// The FanoutPool delivers the broadcasts of large rooms in parallel:
+// a room with at least the threshold number of members dispatches
+// each batch to every worker, and worker i enqueues it for the members
+// of partition i (see Room::fan_out), so the sender doesn't wait for
+// the whole member list to be walked.
+//
+// Every worker runs its tasks in the order they were dispatched, and
+// a member is always in the same partition, so the batches a room
+// dispatches in the order they were numbered reach each member in
+// that order.
+//
+// The pool also keeps a histogram of how long broadcasts took to
+// reach all members, parallel or not, for rooms of each size class.
+class FanoutPool {
+public:
+  typedef void (*TaskFn)(void *arg, unsigned partition);
+
+  // Rooms of at least threshold members (0: none) are delivered to
+  // by num_workers workers
+  FanoutPool(size_t threshold, unsigned num_workers);
+  ~FanoutPool();
+
+  // Start the worker threads, if any room will need them
+  bool start();
+
+  unsigned get_num_workers() const { return m_num_workers; }
+
+  // Whether any room is delivered to in parallel
+  bool has_workers() const { return m_threshold > 0; }
+
+  // Whether a broadcast to members members is delivered in parallel
+  bool is_parallel(size_t members) const { return m_threshold > 0 && members >= m_threshold; }
+
+  // Run fn(arg, i) on worker i, for every worker
+  void dispatch(TaskFn fn, void *arg);
+
+  // Record that a broadcast took nanos nanoseconds to reach members
+  // members, in parallel or not
+  void record(size_t members, uint64_t nanos, bool parallel);
+
+  // Print the latency percentiles of each size class recorded since
+  // the previous report, and reset them
+  void report(std::ostream &out);
+
+  // Rooms of 1-9 members, 10-99, ..., and 10000 or more
+  static const unsigned NUM_SIZE_CLASSES = 5;
+
+  // Latencies below 1 microsecond, below 2, 4, ..., 2^30
+  static const unsigned NUM_BUCKETS = 32;
+
+private:
+  // prohibit value semantics
+  FanoutPool(const FanoutPool &);
+  FanoutPool &operator=(const FanoutPool &);
+
+  struct Task {
+    TaskFn fn;
+    void *arg;
+  };
+
+  struct Worker {
+    FanoutPool *pool;
+    unsigned index;
+    pthread_t thread;
+    pthread_mutex_t lock; // protects tasks
+    pthread_cond_t cond;
+    std::deque<Task> tasks;
+  };
+
+  // padded so that no two size classes share a cache line, and rooms
+  // of different sizes don't slow each other down (the pool is
+  // allocated with plain new, so alignas wouldn't do)
+  struct SizeClass {
+    std::atomic<unsigned long> buckets[NUM_BUCKETS];
+    std::atomic<unsigned long> parallel;
+    std::atomic<uint64_t> max_nanos;
+    char padding[64];
+  };
+
+  static void *run(void *arg);
+  void work(Worker *self);
+
+  size_t m_threshold;
+  unsigned m_num_workers;
+  std::vector<Worker *> m_workers;
+  SizeClass m_classes[NUM_SIZE_CLASSES];
+};
+
+#endif // FANOUT_POOL_H
@@ -0,0 +1,206 @@
+#include <new>
+#include <cstring>
+#include "message.h"
+#include "binary_frame.h"
+#include "frame.h"
+#include "block_pool.h"
+
+/**
+ * Allocates a Frame with room for size encoded bytes.
+ */
+Frame *Frame::allocate(size_t size) {
+  void *mem = BlockPool::allocate(offsetof(Frame, m_data) + size);
+  return new (mem) Frame(size);
+}
+
+/**
+ * Drops a reference, freeing the Frame when it was the last one.
+ */
+void Frame::unref() {
+  if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    size_t size = offsetof(Frame, m_data) + m_size;
+    this->~Frame();
+    BlockPool::release(this, size);
+  }
+}
+
+/**
+ * Copies an already encoded message into a new Frame.
+ *
+ * @param data The encoded message.
+ * @param size The length of the encoded message.
+ * @return The Frame.
+ */
+Frame *Frame::copy(const char *data, size_t size) {
+  Frame *frame = allocate(size);
+  memcpy(frame->m_data, data, size);
+  return frame;
+}
+
+/**
+ * Encodes a message into a new Frame.
+ *
+ * @param tag The message tag.
+ * @param data The message data.
+ * @return The Frame, or nullptr if the message is too long.
+ */
+Frame *Frame::encode(Tag tag, const std::string &data) {
+  size_t size = tag_length(tag) + 1 + data.length() + 1;
+  if (size > Message::MAX_LEN) {
+    return nullptr;
+  }
+
+  Frame *frame = allocate(size);
+  char *p = frame->m_data;
+  memcpy(p, tag_name(tag), tag_length(tag));
+  p += tag_length(tag);
+  *p++ = ':';
+  memcpy(p, data.data(), data.length());
+  p += data.length();
+  *p = '\n';
+  return frame;
+}
+
+/**
+ * Encodes a message stored inline into a new Frame.
+ *
+ * @param msg The message.
+ * @return The Frame, or nullptr if the message is invalid.
+ */
+Frame *Frame::encode(const InlineMessage &msg) {
+  if (!msg.is_valid()) {
+    return nullptr;
+  }
+
+  Frame *frame = allocate(msg.encoded_length());
+  msg.encode(frame->m_data);
+  return frame;
+}
+
+namespace {
+
+/**
+ * Formats a sequence number in decimal.
+ *
+ * @param seq The sequence number.
+ * @param buf Room for 20 digits; they are stored at its end.
+ * @return The first digit.
+ */
+char *format_seq(uint64_t seq, char (&buf)[20]) {
+  char *p = buf + sizeof(buf);
+  do {
+    *--p = char('0' + seq % 10);
+    seq /= 10;
+  } while (seq != 0);
+  return p;
+}
+
+}
+
+/**
+ * Encodes a delivery message into a new Frame, without building
+ * the "room:sender:text" data string first.
+ *
+ * @param room_name The room the message was sent to.
+ * @param sender_username The username of the sender.
+ * @param message_text The text of the message.
+ * @param text_len The length of the text.
+ * @return The Frame, or nullptr if the message is too long.
+ */
+Frame *Frame::encode_delivery(const std::string &room_name,
+                              const std::string &sender_username,
+                              const char *message_text, size_t text_len) {
+  return encode_delivery(room_name, nullptr, 0, sender_username, message_text, text_len);
+}
+
+/**
+ * Encodes a delivery message carrying the message's sequence number
+ * into a new Frame ("room:seq:sender:text").
+ *
+ * @param room_name The room the message was sent to.
+ * @param seq The message's sequence number in the room.
+ * @param sender_username The username of the sender.
+ * @param message_text The text of the message.
+ * @param text_len The length of the text.
+ * @return The Frame, or nullptr if the message is too long.
+ */
+Frame *Frame::encode_numbered_delivery(const std::string &room_name, uint64_t seq,
+                                       const std::string &sender_username,
+                                       const char *message_text, size_t text_len) {
+  char digits[20];
+  const char *seq_start = format_seq(seq, digits);
+  size_t seq_len = digits + sizeof(digits) - seq_start;
+  return encode_delivery(room_name, seq_start, seq_len, sender_username, message_text, text_len);
+}
+
+/**
+ * Encodes a delivery message, with the sequence number's digits
+ * after the room name unless there are none.
+ */
+Frame *Frame::encode_delivery(const std::string &room_name, const char *seq, size_t seq_len,
+                              const std::string &sender_username,
+                              const char *message_text, size_t text_len) {
+  const size_t tag_len = tag_length(TAG_DELIVERY);
+  size_t size = tag_len + 1 + room_name.length() + 1 + (seq_len > 0 ? seq_len + 1 : 0)
+    + sender_username.length() + 1 + text_len + 1;
+  if (size > Message::MAX_LEN) {
+    return nullptr;
+  }
+
+  Frame *frame = allocate(size);
+  char *p = frame->m_data;
+  memcpy(p, tag_name(TAG_DELIVERY), tag_len);
+  p += tag_len;
+  *p++ = ':';
+  memcpy(p, room_name.data(), room_name.length());
+  p += room_name.length();
+  *p++ = ':';
+  if (seq_len > 0) {
+    memcpy(p, seq, seq_len);
+    p += seq_len;
+    *p++ = ':';
+  }
+  memcpy(p, sender_username.data(), sender_username.length());
+  p += sender_username.length();
+  *p++ = ':';
+  memcpy(p, message_text, text_len);
+  p += text_len;
+  *p = '\n';
+  return frame;
+}
+
+/**
+ * Encodes a delivery message into a new Frame in the binary protocol.
+ *
+ * @param room_id The id of the room the message was sent to.
+ * @param sender_id The id of the sender.
+ * @param seq The message's sequence number in the room.
+ * @param sender_username The username of the sender.
+ * @param message_text The text of the message.
+ * @param text_len The length of the text.
+ * @return The Frame, or nullptr if the message is too long.
+ */
+Frame *Frame::encode_binary_delivery(uint32_t room_id, uint32_t sender_id, uint64_t seq,
+                                     const std::string &sender_username,
+                                     const char *message_text, size_t text_len) {
+  size_t name_len = sender_username.length();
+  size_t payload_len = BinaryHeader::SEQ_SIZE + name_len + text_len;
+  if (payload_len > BinaryHeader::MAX_PAYLOAD || name_len > UINT8_MAX) {
+    return nullptr;
+  }
+
+  BinaryHeader header(TAG_DELIVERY, payload_len, room_id, sender_id);
+  header.name_len = uint8_t(name_len);
+
+  Frame *frame = allocate(BinaryHeader::SIZE + payload_len);
+  char *p = frame->m_data;
+  header.encode(p);
+  p += BinaryHeader::SIZE;
+  uint64_t le_seq = htole64(seq);
+  memcpy(p, &le_seq, BinaryHeader::SEQ_SIZE);
+  p += BinaryHeader::SEQ_SIZE;
+  memcpy(p, sender_username.data(), name_len);
+  p += name_len;
+  memcpy(p, message_text, text_len);
+  return frame;
+}
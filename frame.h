@@ -0,0 +1,78 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <string>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "message.h"
+
+// The encodings a receiver may get deliveries in: text, text carrying
+// the message's sequence number (for receivers that asked for history,
+// so they can resume), or binary frames (which always carry it)
+enum DeliveryFormat {
+  DELIVERY_TEXT,
+  DELIVERY_NUMBERED_TEXT,
+  DELIVERY_BINARY,
+  NUM_DELIVERY_FORMATS
+};
+
+// A Frame is a message in its encoded wire format ("tag:data\n", or
+// a binary frame).
+// Frames are immutable and reference counted, so a message broadcast
+// to a room is encoded once and the same Frame is shared by the queues
+// of all the room's members. A Frame and its bytes are a single
+// block from the BlockPool, released when the last reference is dropped.
+class Frame {
+public:
+  // Encode a message; returns nullptr if the encoded message would
+  // be longer than Message::MAX_LEN. The new Frame has one reference.
+  static Frame *encode(Tag tag, const std::string &data);
+  static Frame *encode(const InlineMessage &msg);
+
+  // Encode a delivery of message_text, sent by sender_username to
+  // room_name ("delivery:room:sender:text\n"), like encode does.
+  static Frame *encode_delivery(const std::string &room_name,
+                                const std::string &sender_username,
+                                const char *message_text, size_t text_len);
+
+  // Encode the same delivery with its sequence number seq in the room
+  // ("delivery:room:seq:sender:text\n")
+  static Frame *encode_numbered_delivery(const std::string &room_name, uint64_t seq,
+                                         const std::string &sender_username,
+                                         const char *message_text, size_t text_len);
+
+  // Encode the same delivery as a binary frame, whose payload is
+  // seq, the sender's username and the text; returns nullptr if
+  // the payload would be longer than BinaryHeader::MAX_PAYLOAD
+  static Frame *encode_binary_delivery(uint32_t room_id, uint32_t sender_id, uint64_t seq,
+                                       const std::string &sender_username,
+                                       const char *message_text, size_t text_len);
+
+  // Make a Frame from an already encoded message
+  static Frame *copy(const char *data, size_t size);
+
+  void ref(unsigned count = 1) { m_refs.fetch_add(count, std::memory_order_relaxed); }
+  void unref();
+
+  const char *data() const { return m_data; }
+  size_t size() const { return m_size; }
+
+private:
+  Frame(size_t size) : m_refs(1), m_size(size) { }
+
+  // prohibit value semantics
+  Frame(const Frame &);
+  Frame &operator=(const Frame &);
+
+  static Frame *allocate(size_t size);
+  static Frame *encode_delivery(const std::string &room_name, const char *seq, size_t seq_len,
+                                const std::string &sender_username,
+                                const char *message_text, size_t text_len);
+
+  std::atomic<unsigned> m_refs;
+  unsigned m_size;
+  char m_data[1]; // actually m_size bytes
+};
+
+#endif // FRAME_H
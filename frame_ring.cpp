@@ -0,0 +1,141 @@
+#include <algorithm>
+#include "guard.h"
+#include "frame.h"
+#include "message_queue.h"
+#include "frame_ring.h"
+
+/**
+ * Constructor for the FrameRing class.
+ *
+ * @param capacity The minimum number of slots.
+ */
+FrameRing::FrameRing(size_t capacity)
+  : m_gate(0)
+  , m_has_waiters(false) {
+  size_t size = 1;
+  while (size < capacity) {
+    size *= 2;
+  }
+  m_slots = std::vector<Slot>(size);
+  for (Slot &slot : m_slots) {
+    slot.seq.store(0, std::memory_order_relaxed);
+    std::fill(slot.frames, slot.frames + NUM_DELIVERY_FORMATS, nullptr);
+  }
+  m_mask = size - 1;
+  pthread_mutex_init(&m_waiters_lock, NULL);
+}
+
+/**
+ * Destructor: releases the Frames still in the ring. No cursor may
+ * be attached anymore.
+ */
+FrameRing::~FrameRing() {
+  for (Slot &slot : m_slots) {
+    for (Frame *frame : slot.frames) {
+      if (frame != nullptr) {
+        frame->unref();
+      }
+    }
+  }
+  pthread_mutex_destroy(&m_waiters_lock);
+}
+
+/**
+ * Publishes a message into its slot, releasing the Frames of the
+ * message it held before. The caller must have made sure (see
+ * needs_gate) that no cursor still has to read that message.
+ *
+ * @param seq The sequence number of the message.
+ * @param frames The message in each DeliveryFormat, or nullptr.
+ */
+void FrameRing::publish(uint64_t seq, Frame *const frames[NUM_DELIVERY_FORMATS]) {
+  Slot &slot = m_slots[seq & m_mask];
+  for (int format = 0; format < NUM_DELIVERY_FORMATS; format++) {
+    if (slot.frames[format] != nullptr) {
+      slot.frames[format]->unref();
+    }
+    slot.frames[format] = frames[format];
+  }
+
+  // Pairs with consumers registering as waiters before checking for
+  // messages: either they see this message, or has_waiters sees them.
+  slot.seq.store(seq, std::memory_order_seq_cst);
+}
+
+/**
+ * Checks whether any consumer waits for the next publish.
+ */
+bool FrameRing::has_waiters() const {
+  return m_has_waiters.load(std::memory_order_seq_cst);
+}
+
+/**
+ * Wakes up every consumer which registered as a waiter; they register
+ * again the next time they find nothing to read.
+ */
+void FrameRing::wake_waiters() {
+  // the lock keeps queues from going away while they are woken up
+  Guard guard(m_waiters_lock);
+  for (MessageQueue *queue : m_waiters) {
+    queue->m_ring_waiter = false;
+    queue->wake_consumer();
+  }
+  m_waiters.clear();
+  m_has_waiters.store(false);
+}
+
+/**
+ * Returns a message in one format, for a cursor at its position.
+ * The cursor must be marked as reading, so the slot can't be reused
+ * meanwhile.
+ *
+ * @param seq The sequence number of the message, which was published.
+ * @param format The format of the Frame to get.
+ * @return The Frame with a new reference, or nullptr if the message
+ *         has none in the format.
+ */
+Frame *FrameRing::get(uint64_t seq, DeliveryFormat format) const {
+  Frame *frame = m_slots[seq & m_mask].frames[format];
+  if (frame != nullptr) {
+    frame->ref();
+  }
+  return frame;
+}
+
+/**
+ * Checks whether the message at a cursor's position was published.
+ */
+bool FrameRing::is_available(const std::atomic<uint64_t> &cursor) const {
+  uint64_t current = cursor.load(std::memory_order_seq_cst);
+  return current != DETACHED && is_published(position(current));
+}
+
+/**
+ * Checks whether the message numbered seq is in its slot.
+ */
+bool FrameRing::is_published(uint64_t seq) const {
+  return m_slots[seq & m_mask].seq.load(std::memory_order_seq_cst) == seq;
+}
+
+/**
+ * Registers a queue whose consumer is about to wait for a message.
+ */
+void FrameRing::add_waiter(MessageQueue *queue) {
+  Guard guard(m_waiters_lock);
+  if (!queue->m_ring_waiter) {
+    queue->m_ring_waiter = true;
+    m_waiters.push_back(queue);
+  }
+  m_has_waiters.store(true, std::memory_order_seq_cst);
+}
+
+/**
+ * Unregisters a queue, which is about to be destroyed.
+ */
+void FrameRing::remove_waiter(MessageQueue *queue) {
+  Guard guard(m_waiters_lock);
+  if (queue->m_ring_waiter) {
+    queue->m_ring_waiter = false;
+    m_waiters.erase(std::find(m_waiters.begin(), m_waiters.end(), queue));
+  }
+}
@@ -0,0 +1,98 @@
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <pthread.h>
+#include "frame.h"
+class MessageQueue;
+
+// A FrameRing delivers a room's messages to its members without a
+// queue per member (the "ring" delivery mode): each message is
+// published once, into the slot of the ring its sequence number maps
+// to, and every member's MessageQueue reads the slots in order with a
+// cursor of its own, the way a Disruptor's consumers do.
+//
+// A slot holds the message encoded in each DeliveryFormat (a Frame may
+// be missing if no member gets that format, or the message is too long
+// for it). Only one thread publishes at a time: the Room publishes
+// each batch once it is encoded, in the order they were numbered (see
+// Room::drain_deliveries). Before a slot is reused, every cursor must
+// have moved past the message it held; a member which lags that far
+// behind gets the messages it didn't read moved to its queue, or, if
+// an overflow policy was configured, gets its cursor moved ahead or
+// is disconnected (see MessageQueue::make_room).
+//
+// Consumers which find nothing to read register as waiters, and the
+// next publish wakes them all up.
+class FrameRing {
+public:
+  // A ring of at least capacity slots (rounded up to a power of 2)
+  FrameRing(size_t capacity);
+  ~FrameRing();
+
+  size_t get_capacity() const { return m_slots.size(); }
+
+  // Whether publishing the message numbered seq would reuse a slot a
+  // cursor might still have to read, so the publisher has to call
+  // make_room for every member's queue and pass their minimum to
+  // set_gate first
+  bool needs_gate(uint64_t seq) const { return seq >= m_gate + m_slots.size(); }
+  void set_gate(uint64_t min_position) { m_gate = min_position; }
+
+  // Publish message number seq, taking over a reference to each Frame
+  // (one per DeliveryFormat, any may be nullptr). If has_waiters
+  // returns true afterwards, the publisher must call wake_waiters.
+  void publish(uint64_t seq, Frame *const frames[NUM_DELIVERY_FORMATS]);
+  bool has_waiters() const;
+  void wake_waiters();
+
+  // Whether the message numbered seq was published, and is still in
+  // its slot
+  bool is_published(uint64_t seq) const;
+
+  // The published message numbered seq in the format, with a new
+  // reference (nullptr if it has none); only for the holder of a cursor
+  // marked READING at its position (see MessageQueue)
+  Frame *get(uint64_t seq, DeliveryFormat format) const;
+
+  // Whether there is a message to read at the cursor's position
+  bool is_available(const std::atomic<uint64_t> &cursor) const;
+
+  // Register queue to be woken up by the next publish; unregister it
+  void add_waiter(MessageQueue *queue);
+  void remove_waiter(MessageQueue *queue);
+
+  // Cursors hold the position of the next message to read shifted
+  // left by one; the low bit is set while the consumer reads the slot
+  // at that position, or the publisher moves the messages it didn't
+  // read yet to its queue, so neither can happen meanwhile
+  static const uint64_t READING = 1;
+  static const uint64_t DETACHED = UINT64_MAX; // disconnected
+  static uint64_t cursor_at(uint64_t seq) { return seq << 1; }
+  static uint64_t position(uint64_t cursor) { return cursor >> 1; }
+
+private:
+  // prohibit value semantics
+  FrameRing(const FrameRing &);
+  FrameRing &operator=(const FrameRing &);
+
+  struct Slot {
+    std::atomic<uint64_t> seq; // of the message published into it, 0 if none
+    Frame *frames[NUM_DELIVERY_FORMATS];
+  };
+
+  std::vector<Slot> m_slots;
+  uint64_t m_mask;
+
+  // all cursors were at or past this sequence number when last checked
+  uint64_t m_gate;
+
+  // queues waiting for the next publish
+  pthread_mutex_t m_waiters_lock;
+  std::vector<MessageQueue *> m_waiters;
+  std::atomic<bool> m_has_waiters;
+};
+
+#endif // FRAME_RING_H
@@ -0,0 +1,134 @@
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include "line_reader.h"
+
+/**
+ * Constructor for the LineReader class.
+ *
+ * @param fd The file descriptor to read from.
+ */
+LineReader::LineReader(int fd)
+  : m_fd(fd)
+  , m_start(0)
+  , m_end(0)
+  , m_eof(false) {
+}
+
+/**
+ * Starts reading from another file descriptor, discarding
+ * anything buffered.
+ *
+ * @param fd The file descriptor to read from.
+ */
+void LineReader::reset(int fd) {
+  m_fd = fd;
+  m_start = m_end = 0;
+  m_eof = false;
+}
+
+/**
+ * Reads the next line.
+ *
+ * @param line Set to point to the line in the buffer.
+ * @param max_len The line limit, as for rio_readlineb (at most BUFFER_SIZE).
+ * @return The length of the line, 0 at EOF, or -1 on error.
+ */
+ssize_t LineReader::read_line(const char **line, size_t max_len) {
+  const size_t limit = max_len - 1;
+
+  while (true) {
+    size_t avail = m_end - m_start;
+    size_t scan = avail < limit ? avail : limit;
+    const char *start = m_buf + m_start;
+    const char *nl = static_cast<const char *>(memchr(start, '\n', scan));
+
+    size_t len = 0;
+    if (nl != nullptr) {
+      len = nl - start + 1;
+    } else if (avail >= limit || (m_eof && avail > 0)) {
+      len = scan; // overlong line, or the last one
+    } else if (m_eof) {
+      return 0;
+    }
+    if (len > 0) {
+      m_start += len;
+      *line = start;
+      return ssize_t(len);
+    }
+
+    // The line continues beyond the buffered data: make sure there
+    // is room for all of it after its start, then read some more
+    if (avail == 0) {
+      m_start = m_end = 0;
+    } else if (BUFFER_SIZE - m_start < limit) {
+      memmove(m_buf, start, avail);
+      m_start = 0;
+      m_end = avail;
+    }
+
+    ssize_t n = read(m_fd, m_buf + m_end, BUFFER_SIZE - m_end);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (n == 0) {
+      m_eof = true;
+    }
+    m_end += n;
+  }
+}
+
+/**
+ * Checks whether a complete line is buffered.
+ *
+ * @param max_len The max_len that will be passed to read_line.
+ * @return True if the next read_line won't have to read.
+ */
+bool LineReader::has_line(size_t max_len) const {
+  size_t avail = m_end - m_start;
+  return avail >= max_len - 1 || m_eof || memchr(m_buf + m_start, '\n', avail) != nullptr;
+}
+
+/**
+ * Reads a block of a known length.
+ *
+ * @param data Set to point to the block, in the buffer.
+ * @param len The length of the block, at most BUFFER_SIZE.
+ * @return len, 0 at EOF, or -1 on error (errno is set).
+ */
+ssize_t LineReader::read_bytes(const char **data, size_t len) {
+  while (m_end - m_start < len) {
+    if (m_eof) {
+      return 0;
+    }
+
+    // make sure there is room for all of the block after its start
+    size_t avail = m_end - m_start;
+    if (avail == 0) {
+      m_start = m_end = 0;
+    } else if (BUFFER_SIZE - m_start < len) {
+      memmove(m_buf, m_buf + m_start, avail);
+      m_start = 0;
+      m_end = avail;
+    }
+
+    ssize_t n = read(m_fd, m_buf + m_end, BUFFER_SIZE - m_end);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (n == 0) {
+      m_eof = true;
+    }
+    m_end += n;
+  }
+
+  *data = m_buf + m_start;
+  m_start += len;
+  return ssize_t(len);
+}
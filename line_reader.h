@@ -0,0 +1,59 @@
+#ifndef LINE_READER_H
+#define LINE_READER_H
+
+#include <cstddef>
+#include <sys/types.h>
+
+// A LineReader reads newline-terminated lines from a file descriptor
+// through a buffer. Each read fills as much of the buffer as the
+// descriptor provides, and lines are found with memchr, so they are
+// returned in place, without copying, and a line may span reads.
+//
+// Lines follow the rules of rio_readlineb called with a max_len byte
+// buffer: a line longer than max_len - 1 bytes is returned in pieces
+// of max_len - 1 bytes, and a final line without newline is returned
+// at EOF.
+//
+// It can also return blocks of a known length in place, which is how
+// binary frames are read.
+class LineReader {
+public:
+  static const size_t BUFFER_SIZE = 8192;
+
+  LineReader(int fd = -1);
+
+  void reset(int fd);
+
+  // Read the next line. On success, *line points to it (including the
+  // newline, if any) and stays valid until the next call. Returns the
+  // length of the line, 0 at EOF, or -1 on error (errno is set).
+  ssize_t read_line(const char **line, size_t max_len);
+
+  // Returns true if read_line can return a line without reading
+  bool has_line(size_t max_len) const;
+
+  // Read the next len bytes, at most BUFFER_SIZE. On success, *data
+  // points to them and stays valid until the next call. Returns len,
+  // 0 at EOF (even if fewer than len bytes were left), or -1 on error.
+  ssize_t read_bytes(const char **data, size_t len);
+
+  // Point *data to the bytes buffered but not returned yet;
+  // returns their number
+  size_t peek(const char **data) const {
+    *data = m_buf + m_start;
+    return m_end - m_start;
+  }
+
+private:
+  // prohibit value semantics
+  LineReader(const LineReader &);
+  LineReader &operator=(const LineReader &);
+
+  int m_fd;
+  size_t m_start; // first unread byte in m_buf
+  size_t m_end;   // end of the data in m_buf
+  bool m_eof;
+  char m_buf[BUFFER_SIZE];
+};
+
+#endif // LINE_READER_H
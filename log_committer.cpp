@@ -0,0 +1,112 @@
+#include <iostream>
+#include <cerrno>
+#include <time.h>
+#include <sys/stat.h>
+#include "guard.h"
+#include "room.h"
+#include "log_committer.h"
+
+/**
+ * Constructor for the LogCommitter class.
+ *
+ * @param dir The directory holding the rooms' logs.
+ */
+LogCommitter::LogCommitter(const std::string &dir)
+  : m_dir(dir)
+  , m_rounds(0)
+  , m_syncs(0)
+  , m_records(0)
+  , m_bytes(0) {
+  pthread_mutex_init(&m_lock, NULL);
+}
+
+/**
+ * Destructor. The committer thread runs as long as the server does,
+ * so there is nothing to stop.
+ */
+LogCommitter::~LogCommitter() {
+  pthread_mutex_destroy(&m_lock);
+}
+
+/**
+ * Creates the log directory if necessary, and starts the committer thread.
+ *
+ * @return True if successful.
+ */
+bool LogCommitter::start() {
+  if (mkdir(m_dir.c_str(), 0755) < 0 && errno != EEXIST) {
+    std::cerr << "Error: could not create the log directory " << m_dir << std::endl;
+    return false;
+  }
+  if (pthread_create(&m_thread, NULL, run, this) != 0) {
+    std::cerr << "Pthread Creation Error" << std::endl;
+    return false;
+  }
+  pthread_detach(m_thread);
+  return true;
+}
+
+/**
+ * Schedules a room's log to be committed in the next round.
+ *
+ * @param room The room, whose reference the committer takes over.
+ */
+void LogCommitter::schedule(Room *room) {
+  Guard guard(m_lock);
+  m_scheduled.push_back(room);
+}
+
+/**
+ * Returns the totals of all commits so far.
+ */
+LogCommitter::Stats LogCommitter::get_stats() const {
+  Stats stats;
+  stats.rounds = m_rounds.load(std::memory_order_relaxed);
+  stats.syncs = m_syncs.load(std::memory_order_relaxed);
+  stats.records = m_records.load(std::memory_order_relaxed);
+  stats.bytes = m_bytes.load(std::memory_order_relaxed);
+  return stats;
+}
+
+/**
+ * Thread function committing the scheduled logs once per interval.
+ *
+ * @param arg The LogCommitter object.
+ * @return nullptr.
+ */
+void *LogCommitter::run(void *arg) {
+  LogCommitter *committer = static_cast<LogCommitter *>(arg);
+  struct timespec interval;
+  interval.tv_sec = 0;
+  interval.tv_nsec = COMMIT_INTERVAL_MS * 1000000L;
+  while (true) {
+    nanosleep(&interval, nullptr);
+    committer->commit_round();
+  }
+  return nullptr;
+}
+
+/**
+ * Commits the logs of all rooms scheduled since the previous round.
+ */
+void LogCommitter::commit_round() {
+  std::vector<Room *> rooms;
+  {
+    Guard guard(m_lock);
+    rooms.swap(m_scheduled);
+  }
+  if (rooms.empty()) {
+    return;
+  }
+
+  unsigned long records = 0;
+  unsigned long bytes = 0;
+  for (Room *room : rooms) {
+    room->commit_log(records, bytes);
+    room->unref();
+  }
+  m_rounds.fetch_add(1, std::memory_order_relaxed);
+  m_syncs.fetch_add(rooms.size(), std::memory_order_relaxed);
+  m_records.fetch_add(records, std::memory_order_relaxed);
+  m_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
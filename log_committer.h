@@ -0,0 +1,65 @@
+#ifndef LOG_COMMITTER_H
+#define LOG_COMMITTER_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <pthread.h>
+class Room;
+
+// The LogCommitter writes the rooms' logs to disk. A room whose log
+// has records waiting to be committed is scheduled once (and keeps
+// a reference to it meanwhile); every COMMIT_INTERVAL_MS, the
+// committer thread commits the logs of all rooms scheduled since the
+// previous round, so a message is durable within about one interval
+// and each room's log is synced at most once per interval however
+// many messages it gets.
+class LogCommitter {
+public:
+  static const int COMMIT_INTERVAL_MS = 10;
+
+  // Totals of all commits so far
+  struct Stats {
+    unsigned long rounds;  // rounds which committed anything
+    unsigned long syncs;   // logs committed
+    unsigned long records;
+    unsigned long bytes;
+  };
+
+  // Room logs are kept in subdirectories of dir, named after the rooms
+  LogCommitter(const std::string &dir);
+  ~LogCommitter();
+
+  // Create the log directory and start the committer thread
+  bool start();
+
+  const std::string &get_dir() const { return m_dir; }
+
+  // Commit room's log in the next round. The committer takes over
+  // a reference to the room, which it drops once it is done.
+  void schedule(Room *room);
+
+  Stats get_stats() const;
+
+private:
+  // prohibit value semantics
+  LogCommitter(const LogCommitter &);
+  LogCommitter &operator=(const LogCommitter &);
+
+  static void *run(void *arg);
+  void commit_round();
+
+  std::string m_dir;
+  pthread_t m_thread;
+
+  // protects m_scheduled
+  pthread_mutex_t m_lock;
+  std::vector<Room *> m_scheduled;
+
+  std::atomic<unsigned long> m_rounds;
+  std::atomic<unsigned long> m_syncs;
+  std::atomic<unsigned long> m_records;
+  std::atomic<unsigned long> m_bytes;
+};
+
+#endif // LOG_COMMITTER_H
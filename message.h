@@ -3,6 +3,189 @@
 
 #include <vector>
 #include <string>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+
+// standard message tags (note that you don't need to worry about
+// "senduser" or "empty" messages)
+enum Tag : uint8_t {
+  TAG_ERR,      // protocol error
+  TAG_OK,       // success response
+  TAG_SLOGIN,   // register as specific user for sending
+  TAG_RLOGIN,   // register as specific user for receiving
+  TAG_JOIN,     // join a chat room
+  TAG_LEAVE,    // leave a chat room
+  TAG_SENDALL,  // send message to all users in chat room
+  TAG_SENDUSER, // send message to specific user in chat room
+  TAG_QUIT,     // quit
+  TAG_DELIVERY, // message delivered by server to receiving client
+  TAG_EMPTY,    // sent by server to receiving client to indicate no msgs available
+  TAG_PIPELINE, // sender asks not to get a reply to every request
+  TAG_ACK,      // server acknowledges pipelined requests up to a sequence number
+  TAG_SENDBATCH, // send several messages to all users in chat room (binary protocol)
+  TAG_UNKNOWN,  // anything else received
+};
+
+const unsigned NUM_TAGS = TAG_UNKNOWN;
+
+// Returns the wire format name of a tag
+constexpr const char *tag_name(Tag tag) {
+  switch (tag) {
+  case TAG_ERR:      return "err";
+  case TAG_OK:       return "ok";
+  case TAG_SLOGIN:   return "slogin";
+  case TAG_RLOGIN:   return "rlogin";
+  case TAG_JOIN:     return "join";
+  case TAG_LEAVE:    return "leave";
+  case TAG_SENDALL:  return "sendall";
+  case TAG_SENDUSER: return "senduser";
+  case TAG_QUIT:     return "quit";
+  case TAG_DELIVERY: return "delivery";
+  case TAG_EMPTY:    return "empty";
+  case TAG_PIPELINE: return "pipeline";
+  case TAG_ACK:      return "ack";
+  case TAG_SENDBATCH: return "sendbatch";
+  default:           return "";
+  }
+}
+
+constexpr size_t tag_length(Tag tag) {
+  size_t len = 0;
+  for (const char *p = tag_name(tag); *p != '\0'; p++) {
+    len++;
+  }
+  return len;
+}
+
+// Tags are decoded with a perfect hash of their first two characters
+// and length, whose multiplier is searched for at compile time: it is
+// the first one mapping every tag name to a different slot of a table.
+namespace tag_hash {
+
+const unsigned SLOT_BITS = 5;
+const unsigned NUM_SLOTS = 1u << SLOT_BITS;
+
+constexpr unsigned slot(uint32_t multiplier, const char *tag, size_t len) {
+  uint32_t key = (uint32_t(uint8_t(tag[0])) << 16) | (uint32_t(uint8_t(tag[1])) << 8) | uint32_t(len);
+  return uint32_t(key * multiplier) >> (32 - SLOT_BITS);
+}
+
+constexpr bool is_perfect(uint32_t multiplier) {
+  bool used[NUM_SLOTS] = { };
+  for (unsigned t = 0; t < NUM_TAGS; t++) {
+    unsigned s = slot(multiplier, tag_name(Tag(t)), tag_length(Tag(t)));
+    if (used[s]) {
+      return false;
+    }
+    used[s] = true;
+  }
+  return true;
+}
+
+constexpr uint32_t find_multiplier() {
+  uint32_t multiplier = 0x9e3779b1; // odd, so every bit of the key matters
+  while (!is_perfect(multiplier)) {
+    multiplier += 2;
+  }
+  return multiplier;
+}
+
+const uint32_t MULTIPLIER = find_multiplier();
+
+// the tag hashed to each slot (TAG_UNKNOWN for unused slots),
+// with its name and length
+struct Table {
+  Tag tags[NUM_SLOTS];
+  const char *names[NUM_SLOTS];
+  uint8_t lengths[NUM_SLOTS];
+};
+
+constexpr Table make_table() {
+  Table table = { };
+  for (unsigned s = 0; s < NUM_SLOTS; s++) {
+    table.tags[s] = TAG_UNKNOWN;
+    table.names[s] = "";
+    table.lengths[s] = 0;
+  }
+  for (unsigned t = 0; t < NUM_TAGS; t++) {
+    unsigned s = slot(MULTIPLIER, tag_name(Tag(t)), tag_length(Tag(t)));
+    table.tags[s] = Tag(t);
+    table.names[s] = tag_name(Tag(t));
+    table.lengths[s] = uint8_t(tag_length(Tag(t)));
+  }
+  return table;
+}
+
+constexpr Table TABLE = make_table();
+
+}
+
+// Returns the tag named by the len characters at name
+inline Tag decode_tag(const char *name, size_t len) {
+  if (len < 2) {
+    return TAG_UNKNOWN; // every tag has at least two characters
+  }
+  unsigned s = tag_hash::slot(tag_hash::MULTIPLIER, name, len);
+  if (tag_hash::TABLE.lengths[s] != len || memcmp(tag_hash::TABLE.names[s], name, len) != 0) {
+    return TAG_UNKNOWN;
+  }
+  return tag_hash::TABLE.tags[s];
+}
+
+// An encoded "tag:data" line (or binary frame) parsed in place: data
+// points into the buffer holding the message, so it is only valid for
+// as long as the buffer is. Whatever must outlive it is copied into a
+// Message.
+struct MessageView {
+  const char *tag = nullptr;
+  size_t tag_len = 0;
+  const char *data = nullptr;
+  size_t data_len = 0;
+  Tag id = TAG_UNKNOWN; // the tag decoded
+
+  MessageView() { }
+
+  MessageView(const char *line, size_t len) { parse(line, len); }
+
+  // Parse an encoded "tag:data" line. The trailing newline,
+  // if any, is not part of the data.
+  void parse(const char *line, size_t len) {
+    if (len > 0 && line[len - 1] == '\n') {
+      len--;
+    }
+    const char *colon = static_cast<const char *>(memchr(line, ':', len));
+    tag = line;
+    if (colon == nullptr) {
+      tag_len = len;
+      data = line + len;
+      data_len = 0;
+    } else {
+      tag_len = colon - line;
+      data = colon + 1;
+      data_len = line + len - data;
+    }
+    id = decode_tag(tag, tag_len);
+  }
+
+  // Set the parts of a message whose tag is decoded already
+  void set(Tag t, const char *d, size_t len) {
+    tag = tag_name(t);
+    tag_len = tag_length(t);
+    data = d;
+    data_len = len;
+    id = t;
+  }
+
+  Tag tag_id() const { return id; }
+
+  // Copy the data into a string
+  std::string data_string() const { return std::string(data, data_len); }
+
+  bool has_tag(Tag t) const {
+    return tag_length(t) == tag_len && memcmp(tag, tag_name(t), tag_len) == 0;
+  }
+};
 
 struct Message {
   // An encoded message may have at most this many characters,
@@ -11,29 +194,138 @@ struct Message {
   // temporarily store the encoded message.)
   static const unsigned MAX_LEN = 255;
 
-  std::string tag;
+  Tag tag;
   std::string data;
 
-  Message() { }
+  Message() : tag(TAG_UNKNOWN) { }
 
-  Message(const std::string &tag, const std::string &data)
+  Message(Tag tag, const std::string &data)
     : tag(tag), data(data) { }
 
-  // TODO: you could add helper functions
+  // Encode the message in the "tag:data\n" wire format
+  std::string encode() const { return tag_name(tag) + (":" + data) + "\n"; }
+
+  // Append the encoded message to out, unless it is too long to be
+  // encoded (Connection::send refuses to send such messages, too)
+  bool append_encoded(std::string &out) const {
+    if (tag_length(tag) + data.length() + 1 > MAX_LEN) {
+      return false;
+    }
+    out += tag_name(tag);
+    out += ':';
+    out += data;
+    out += '\n';
+    return true;
+  }
+
+  // Decode an encoded "tag:data" line. The trailing newline,
+  // if any, is not part of the data.
+  void decode(const char *line, size_t len) { assign(MessageView(line, len)); }
+
+  // Copy a parsed message (reusing the data string's storage)
+  void assign(const MessageView &view) {
+    tag = view.tag_id();
+    data.assign(view.data, view.data_len);
+  }
+
+  // Returns the length of the first line in buf (including its newline),
+  // or 0 if buf doesn't hold a complete line yet. Like rio_readlineb called
+  // with a MAX_LEN byte buffer, overlong lines are split into pieces of
+  // MAX_LEN - 1 bytes, and at EOF a final line without newline is accepted.
+  static size_t line_length(const char *buf, size_t avail, bool eof) {
+    const size_t limit = MAX_LEN - 1;
+    size_t scan = avail < limit ? avail : limit;
+    const char *nl = static_cast<const char *>(memchr(buf, '\n', scan));
+    if (nl != nullptr) {
+      return nl - buf + 1;
+    }
+    if (avail >= limit || eof) {
+      return scan;
+    }
+    return 0;
+  }
 };
 
-// standard message tags (note that you don't need to worry about
-// "senduser" or "empty" messages)
-#define TAG_ERR       "err"       // protocol error
-#define TAG_OK        "ok"        // success response
-#define TAG_SLOGIN    "slogin"    // register as specific user for sending
-#define TAG_RLOGIN    "rlogin"    // register as specific user for receiving
-#define TAG_JOIN      "join"      // join a chat room
-#define TAG_LEAVE     "leave"     // leave a chat room
-#define TAG_SENDALL   "sendall"   // send message to all users in chat room
-#define TAG_SENDUSER  "senduser"  // send message to specific user in chat room
-#define TAG_QUIT      "quit"      // quit
-#define TAG_DELIVERY  "delivery"  // message delivered by server to receiving client
-#define TAG_EMPTY     "empty"     // sent by server to receiving client to indicate no msgs available
+// A message in a fixed-size, trivially copyable block: the tag and
+// the length of the data are stored along with the data itself.
+// Every message short enough to be encoded fits, so the server can
+// receive, handle and reply to requests without allocating memory.
+// Messages too long to be encoded are marked invalid instead.
+struct InlineMessage {
+  // Room for the data of the longest encodable message
+  static const unsigned CAPACITY = Message::MAX_LEN - 1;
+
+  InlineMessage() : m_tag(TAG_UNKNOWN), m_size(0) { }
+
+  InlineMessage(Tag tag, const char *data) { set(tag, data, strlen(data)); }
+  InlineMessage(Tag tag, const std::string &data) { set(tag, data.data(), data.length()); }
+
+  // Conversions from and to the std::string based representation
+  explicit InlineMessage(const Message &msg) { set(msg.tag, msg.data.data(), msg.data.length()); }
+  Message to_message() const { return Message(tag(), data_string()); }
+
+  // Store tag and data; returns false (and marks the message
+  // invalid) if the encoded message would be too long
+  bool set(Tag tag, const char *data, size_t data_len) {
+    if (tag_length(tag) + 1 + data_len + 1 > Message::MAX_LEN) {
+      m_tag = TAG_UNKNOWN;
+      m_size = INVALID_SIZE;
+      return false;
+    }
+    m_tag = tag;
+    m_size = uint8_t(data_len);
+    memcpy(m_bytes, data, data_len);
+    return true;
+  }
+
+  // Parse an encoded "tag:data" line. The trailing newline,
+  // if any, is not part of the data.
+  bool parse(const char *line, size_t len) {
+    MessageView view(line, len);
+    return set(view.tag_id(), view.data, view.data_len);
+  }
+
+  bool is_valid() const { return m_size != INVALID_SIZE; }
+
+  Tag tag() const { return m_tag; }
+  const char *data() const { return m_bytes; }
+  size_t data_length() const { return m_size; }
+  std::string data_string() const { return std::string(data(), data_length()); }
+
+  // Length of the encoded message, including the trailing newline
+  size_t encoded_length() const { return tag_length(m_tag) + 1 + m_size + 1; }
+
+  // Encode the message into out, which must have room for
+  // encoded_length() bytes; returns the encoded length
+  size_t encode(char *out) const {
+    size_t tag_len = tag_length(m_tag);
+    memcpy(out, tag_name(m_tag), tag_len);
+    out[tag_len] = ':';
+    memcpy(out + tag_len + 1, m_bytes, m_size);
+    out[tag_len + 1 + m_size] = '\n';
+    return tag_len + 1 + m_size + 1;
+  }
+
+  // Append the encoded message to out, unless it is invalid
+  bool append_encoded(std::string &out) const {
+    if (!is_valid()) {
+      return false;
+    }
+    size_t pos = out.size();
+    out.resize(pos + encoded_length());
+    encode(&out[pos]);
+    return true;
+  }
+
+private:
+  static const uint8_t INVALID_SIZE = 0xff;
+
+  Tag m_tag;
+  uint8_t m_size; // of the data, or INVALID_SIZE
+  char m_bytes[CAPACITY];
+};
+
+static_assert(std::is_trivially_copyable<InlineMessage>::value, "InlineMessage must be trivially copyable");
+static_assert(sizeof(InlineMessage) == 256, "InlineMessage should fill four cache lines");
 
 #endif // MESSAGE_H
@@ -1,74 +1,849 @@
-#include <cassert>
-#include <ctime>
-#include "message_queue.h"
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include "guard.h"
+#include "message.h"
+#include "binary_frame.h"
+#include "frame.h"
+#include "block_pool.h"
+#include "frame_ring.h"
+#include "message_queue.h"
+
+namespace {
+
+// Spilled messages are read back this many bytes at a time
+const size_t REFILL_BYTES = 64 * 1024;
+
+// A backlog is produced this many messages at a time
+const size_t BACKLOG_CHUNK = 256;
+
+// Holds the pop spinlock for the current scope, if it is in use
+class PopGuard {
+public:
+  PopGuard(std::atomic<bool> &lock, bool enabled)
+    : m_lock(enabled ? &lock : nullptr) {
+    if (m_lock != nullptr) {
+      while (m_lock->exchange(true, std::memory_order_acquire)) {
+        sched_yield();
+      }
+    }
+  }
+
+  ~PopGuard() {
+    if (m_lock != nullptr) {
+      m_lock->store(false, std::memory_order_release);
+    }
+  }
+
+private:
+  PopGuard(const PopGuard &);
+  PopGuard &operator=(const PopGuard &);
+  std::atomic<bool> *m_lock;
+};
+
+// Creates an anonymous file in dir, returns -1 on failure
+int open_spill_file(const std::string &dir) {
+  int fd = open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd >= 0) {
+    return fd;
+  }
+
+  // file systems without O_TMPFILE support
+  std::string path = dir + "/chat-spill-XXXXXX";
+  std::vector<char> name(path.begin(), path.end());
+  name.push_back('\0');
+  fd = mkostemp(name.data(), O_CLOEXEC);
+  if (fd >= 0) {
+    unlink(name.data());
+  }
+  return fd;
+}
+
+bool write_fully(int fd, const char *buf, size_t len, off_t off) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, off);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    buf += n;
+    len -= n;
+    off += n;
+  }
+  return true;
+}
+
+}
+
+/**
+ * Adds the outcome of an enqueue to the counters.
+ *
+ * @param result The value returned by MessageQueue::enqueue.
+ */
+void MessageQueue::OverflowStats::count(EnqueueResult result) {
+  switch (result) {
+  case SPILLED:
+    spilled++;
+    break;
+  case DROPPED_OLDEST:
+    dropped_oldest++;
+    break;
+  case DROPPED_NEWEST:
+    dropped_newest++;
+    break;
+  case DISCONNECTED:
+    disconnects++;
+    break;
+  default:
+    break;
+  }
+}
+
+/**
+ * Adds the counts of other statistics to these.
+ */
+void MessageQueue::OverflowStats::add(const OverflowStats &other) {
+  dropped_oldest += other.dropped_oldest;
+  dropped_newest += other.dropped_newest;
+  spilled += other.spilled;
+  disconnects += other.disconnects;
+}
 
 /**
  * Constructor for the MessageQueue class.
- * Initializes the mutex and semaphore used for synchronization.
+ * Creates the dummy node the queue starts out with.
  */
-MessageQueue::MessageQueue() {
-  pthread_mutex_init(&m_lock, NULL);
-  sem_init(&m_avail, 0, 0);
+MessageQueue::MessageQueue()
+  : m_size(0)
+  , m_waiting(false)
+  , m_notify_fd(-1)
+  , m_limit(0)
+  , m_policy(DROP_OLDEST)
+  , m_socket_fd(-1)
+  , m_pop_lock(false)
+  , m_spilling(false)
+  , m_spill_fd(-1)
+  , m_spill_read(0)
+  , m_spill_write(0)
+  , m_disconnected(false)
+  , m_backlog_fill(nullptr)
+  , m_backlog_release(nullptr)
+  , m_backlog_arg(nullptr)
+  , m_backlog_pos(0)
+  , m_ring(nullptr)
+  , m_ring_format(DELIVERY_TEXT)
+  , m_cursor(0)
+  , m_ring_waiter(false)
+  , m_ring_overrun(false)
+  , m_dropped_oldest(0)
+  , m_dropped_newest(0)
+  , m_spilled(0) {
+  Node *stub = new Node();
+  stub->next.store(nullptr, std::memory_order_relaxed);
+  stub->frame = nullptr;
+  m_head.store(stub, std::memory_order_relaxed);
+  m_tail = stub;
+  pthread_mutex_init(&m_socket_lock, NULL);
+  pthread_mutex_init(&m_spill_lock, NULL);
 }
 
 /**
  * Destructor for the MessageQueue class.
- * Destroys the mutex and semaphore used for synchronization.
+ * Releases any messages which were never delivered.
+ * No other thread may be using the queue anymore.
  */
 MessageQueue::~MessageQueue() {
-  pthread_mutex_destroy(&m_lock);
-  sem_destroy(&m_avail);
+  Frame *frame;
+  while ((frame = pop()) != nullptr) {
+    frame->unref();
+  }
+  delete m_tail;
+
+  for (Frame *spilled : m_refill) {
+    spilled->unref();
+  }
+  if (m_backlog_fill != nullptr) {
+    for (size_t i = m_backlog_pos; i < m_backlog.size(); i++) {
+      m_backlog[i]->unref();
+    }
+    m_backlog_release(m_backlog_arg);
+  }
+  if (m_spill_fd >= 0) {
+    close(m_spill_fd);
+  }
+  pthread_mutex_destroy(&m_spill_lock);
+  pthread_mutex_destroy(&m_socket_lock);
+
+  int fd = m_notify_fd.load();
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+/**
+ * Limits the number of messages the queue holds in memory.
+ *
+ * @param limit The maximum number of messages, 0 for no limit.
+ * @param policy What to do with messages enqueued while the queue is full.
+ * @param spill_dir The directory to create the spill file in (SPILL only).
+ */
+void MessageQueue::set_limit(size_t limit, OverflowPolicy policy, const std::string &spill_dir) {
+  m_limit = limit;
+  m_policy = policy;
+  m_spill_dir = spill_dir;
 }
 
 /**
- * Enqueues a Message into the message queue.
- * The specified message is added to the queue, and the semaphore is posted
- * to indicate the availability of a message.
+ * Sets the socket the DISCONNECT policy shuts down.
  *
- * @param msg The Message to enqueue.
+ * @param fd The consumer's socket, or -1 once it is about to be closed.
  */
-void MessageQueue::enqueue(Message *msg) {
-  // Guard the mutex for thread safety
-  Guard guard(m_lock);
+void MessageQueue::set_socket(int fd) {
+  Guard guard(m_socket_lock);
+  m_socket_fd = fd;
+}
 
-  // Put the specified message on the queue
-  m_messages.push_back(msg);
+/**
+ * Enqueues a Frame into the message queue, and wakes up the consumer
+ * if it is waiting for a message. If the queue is full, the overflow
+ * policy decides what happens to the Frame.
+ *
+ * @param frame The Frame to enqueue, along with one reference to it.
+ * @return What happened to the Frame.
+ */
+MessageQueue::EnqueueResult MessageQueue::enqueue(Frame *frame) {
+  if (m_disconnected.load()) {
+    frame->unref();
+    return DISCARDED;
+  }
+
+  EnqueueResult result = ENQUEUED;
+  if (m_limit == 0) {
+    push(frame);
+  } else if (m_policy == SPILL && m_spilling.load()) {
+    // keep spilling until the consumer has read everything back
+    result = overflow(frame);
+  } else if (m_size.fetch_add(1) < m_limit) {
+    push(frame);
+  } else {
+    m_size.fetch_sub(1);
+    result = overflow(frame);
+  }
 
-  // Post to the semaphore to indicate that a message is available
-  sem_post(&m_avail);
+  // Pairs with the consumer setting m_waiting before checking for
+  // messages: either it sees our message, or we see it waiting.
+  if (m_waiting.load(std::memory_order_seq_cst)) {
+    wake_consumer();
+  }
+  return result;
 }
 
 /**
- * Dequeues a Message from the message queue.
- * Waits up to 1 second for a message to be available, and then removes and
- * returns the next message from the queue.
+ * Enqueues several messages, in order. Unless the queue would
+ * overflow, this costs one atomic exchange (and at most one wakeup)
+ * for the whole batch; otherwise the frames are enqueued one by one.
+ * The queue takes over one reference to each Frame.
  *
- * @return A pointer to the dequeued Message, or nullptr if no message is available.
+ * @param frames The Frames to enqueue.
+ * @param count The number of Frames.
+ * @param stats Counts how often the overflow policy kicked in.
  */
-Message *MessageQueue::dequeue() {
-  struct timespec ts;
-  
-  clock_gettime(CLOCK_REALTIME, &ts);
+void MessageQueue::enqueue_batch(Frame *const *frames, size_t count, OverflowStats &stats) {
+  if (count == 0) {
+    return;
+  }
 
-  // Compute a time one second in the future
-  ts.tv_sec += 1;
+  bool fits = !m_disconnected.load() && m_limit == 0;
+  if (!m_disconnected.load() && m_limit != 0 && !(m_policy == SPILL && m_spilling.load())) {
+    fits = m_size.fetch_add(count) + count <= m_limit;
+    if (!fits) {
+      m_size.fetch_sub(count);
+    }
+  }
+  if (!fits) {
+    for (size_t i = 0; i < count; i++) {
+      stats.count(enqueue(frames[i]));
+    }
+    return;
+  }
+
+  push_batch(frames, count);
+  if (m_waiting.load(std::memory_order_seq_cst)) {
+    wake_consumer();
+  }
+}
+
+/**
+ * Dequeues a Frame from the message queue, waiting for one to be
+ * enqueued if the queue is empty. The wait is a poll on the queue's
+ * eventfd, armed like an event loop arms it.
+ *
+ * @return A pointer to the dequeued Frame, or nullptr if the
+ *         consumer was disconnected (or there is no eventfd to wait on).
+ */
+Frame *MessageQueue::dequeue() {
+  int fd = get_notify_fd();
+  while (fd >= 0 && !m_disconnected.load()) {
+    Frame *frame = try_dequeue();
+    if (frame != nullptr) {
+      return frame;
+    }
+    if (!arm_notify() || m_disconnected.load()) {
+      continue;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+      break;
+    }
+    uint64_t count;
+    ssize_t rc = read(fd, &count, sizeof(count));
+    (void) rc; // nothing to reset if another wakeup was consumed already
+  }
+  return nullptr;
+}
+
+/**
+ * Dequeues a batch of Frames from the message queue, waiting for
+ * the first one if the queue is empty.
+ *
+ * @param frames Where to store the dequeued Frames.
+ * @param max_frames The maximum number of Frames to dequeue (at least 1).
+ * @return The number of Frames dequeued, 0 if the consumer was disconnected.
+ */
+size_t MessageQueue::dequeue_batch(Frame **frames, size_t max_frames) {
+  Frame *first = dequeue();
+  if (first == nullptr) {
+    return 0;
+  }
+
+  size_t count = 0;
+  frames[count++] = first;
+  while (count < max_frames) {
+    Frame *frame = try_dequeue();
+    if (frame == nullptr) {
+      break;
+    }
+    frames[count++] = frame;
+  }
+  return count;
+}
+
+/**
+ * Dequeues a Frame from the message queue without blocking.
+ *
+ * @return A pointer to the dequeued Frame, or nullptr if the queue is empty.
+ */
+Frame *MessageQueue::try_dequeue() {
+  if (m_backlog_fill != nullptr) {
+    Frame *frame = take_backlog();
+    if (frame != nullptr) {
+      return frame;
+    }
+  }
+
+  // messages read back from the spill file are older than
+  // anything enqueued in memory since
+  if (m_refill.empty()) {
+    Frame *frame = pop();
+    if (frame != nullptr) {
+      return frame;
+    }
+    if (!m_spilling.load()) {
+      // anything queued came before the messages in the ring
+      return m_ring != nullptr ? take_from_ring() : nullptr;
+    }
+    refill();
+    if (m_refill.empty()) {
+      return nullptr;
+    }
+  }
 
-  // Call sem_timedwait to wait up to 1 second for a message
-  // to be available, return nullptr if no message is available
-  if (sem_timedwait(&m_avail, &ts) == -1) {
+  Frame *frame = m_refill.front();
+  m_refill.pop_front();
+  return frame;
+}
+
+/**
+ * Returns the eventfd which is signaled when a message is enqueued
+ * after arm_notify, creating it if necessary.
+ *
+ * @return The eventfd file descriptor, or -1 if it could not be created.
+ */
+int MessageQueue::get_notify_fd() {
+  // only the consumer calls this, so there is no race creating it
+  int fd = m_notify_fd.load();
+  if (fd < 0) {
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_notify_fd.store(fd);
+  }
+  return fd;
+}
+
+/**
+ * Requests the next enqueue to signal the notify fd.
+ *
+ * @return True if the queue is still empty, false if the
+ *         consumer should keep dequeuing.
+ */
+bool MessageQueue::arm_notify() {
+  m_waiting.store(true, std::memory_order_seq_cst);
+  if (m_ring != nullptr) {
+    m_ring->add_waiter(this);
+  }
+  if (!is_empty()) {
+    m_waiting.store(false, std::memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Returns how often the overflow policy kicked in for this queue.
+ */
+MessageQueue::OverflowStats MessageQueue::get_overflow_stats() const {
+  OverflowStats stats;
+  stats.dropped_oldest = m_dropped_oldest.load(std::memory_order_relaxed);
+  stats.dropped_newest = m_dropped_newest.load(std::memory_order_relaxed);
+  stats.spilled = m_spilled.load(std::memory_order_relaxed);
+  stats.disconnects = m_disconnected.load() ? 1 : 0;
+  return stats;
+}
+
+/**
+ * Gives the queue a backlog, handed out before any other messages.
+ *
+ * @param fill Stores the next chunk of the backlog, returns its size.
+ * @param release Called once the backlog is over, or the queue destroyed.
+ * @param arg Passed to fill and release.
+ */
+void MessageQueue::set_backlog(size_t (*fill)(Frame **frames, size_t max, void *arg),
+                               void (*release)(void *arg), void *arg) {
+  m_backlog_fill = fill;
+  m_backlog_release = release;
+  m_backlog_arg = arg;
+  m_backlog_pos = 0;
+  m_backlog.clear();
+}
+
+/**
+ * Takes the next message of the backlog, producing the next chunk
+ * of it once the previous one was handed out.
+ *
+ * @return The Frame, or nullptr once the backlog is over.
+ */
+Frame *MessageQueue::take_backlog() {
+  if (m_backlog_pos == m_backlog.size()) {
+    m_backlog.resize(BACKLOG_CHUNK);
+    m_backlog.resize(m_backlog_fill(m_backlog.data(), BACKLOG_CHUNK, m_backlog_arg));
+    m_backlog_pos = 0;
+    if (m_backlog.empty()) {
+      end_backlog();
+      return nullptr;
+    }
+  }
+  return m_backlog[m_backlog_pos++];
+}
+
+/**
+ * Takes the next message from the ring. The cursor is marked as
+ * reading while the slot's Frame is referenced, so the slot can't be
+ * reused and the cursor can't be moved (by make_room) meanwhile; if
+ * make_room moved messages to the queue just before, they come first.
+ * Messages without a Frame for the format are skipped.
+ *
+ * @return The Frame, or nullptr if there is none (yet), or the cursor
+ *         was detached.
+ */
+Frame *MessageQueue::take_from_ring() {
+  while (true) {
+    uint64_t current = m_cursor.load(std::memory_order_acquire);
+    if (current == FrameRing::DETACHED) {
+      return nullptr;
+    }
+    if (current & FrameRing::READING) {
+      sched_yield(); // the publisher is moving messages to the queue
+      continue;
+    }
+    uint64_t seq = FrameRing::position(current);
+    if (!m_ring->is_published(seq)) {
+      if (m_cursor.load(std::memory_order_acquire) != current) {
+        continue; // the cursor was moved ahead meanwhile
+      }
+      return nullptr;
+    }
+    if (!m_cursor.compare_exchange_weak(current, current | FrameRing::READING,
+                                        std::memory_order_acq_rel)) {
+      continue;
+    }
+
+    Frame *frame = pop();
+    if (frame != nullptr) {
+      m_cursor.store(current, std::memory_order_release);
+      return frame;
+    }
+    frame = m_ring->get(seq, m_ring_format);
+    m_cursor.store(FrameRing::cursor_at(seq + 1), std::memory_order_release);
+    if (frame != nullptr) {
+      return frame;
+    }
+  }
+}
+
+/**
+ * Releases the backlog once it was handed out completely.
+ */
+void MessageQueue::end_backlog() {
+  m_backlog_release(m_backlog_arg);
+  m_backlog_fill = nullptr;
+  m_backlog_release = nullptr;
+  m_backlog_arg = nullptr;
+  std::vector<Frame *>().swap(m_backlog);
+}
+
+/**
+ * Makes the queue read the messages published into a room's ring.
+ *
+ * @param ring The ring.
+ * @param format The format of the Frames to read.
+ * @param seq The sequence number of the first message to read.
+ */
+void MessageQueue::attach_ring(FrameRing *ring, DeliveryFormat format, uint64_t seq) {
+  m_ring = ring;
+  m_ring_format = format;
+  m_cursor.store(FrameRing::cursor_at(seq));
+}
+
+/**
+ * Stops reading from the ring, which forgets about the queue.
+ */
+void MessageQueue::detach_ring() {
+  if (m_ring != nullptr) {
+    m_ring->remove_waiter(this);
+    m_ring = nullptr;
+  }
+}
+
+/**
+ * Makes sure the cursor moved past the message numbered evicted,
+ * which the ring's publisher is about to overwrite. If it hasn't, the
+ * messages up to it the consumer didn't read yet are moved to the
+ * queue, where the consumer finds them first, and the cursor is moved
+ * past them: a lagging consumer holds on to them, rather than the
+ * publisher waiting for it, which could wait for itself if it services
+ * the consumer, too. Only if the ring may be overrun, the consumer is
+ * disconnected (with the DISCONNECT policy), or the cursor is moved
+ * past it, dropping the older messages. A consumer in the middle of
+ * reading a message is waited for.
+ *
+ * @param evicted The sequence number of the message to overwrite.
+ * @param stats Counts the messages dropped, or the disconnect.
+ * @return The cursor's position, or UINT64_MAX if disconnected.
+ */
+uint64_t MessageQueue::make_room(uint64_t evicted, OverflowStats &stats) {
+  while (true) {
+    uint64_t current = m_cursor.load(std::memory_order_acquire);
+    if (current == FrameRing::DETACHED) {
+      return UINT64_MAX;
+    }
+    uint64_t seq = FrameRing::position(current);
+    if (seq > evicted) {
+      return seq;
+    }
+    if (current & FrameRing::READING) {
+      sched_yield();
+      continue;
+    }
+
+    if (!m_ring_overrun) {
+      if (!m_cursor.compare_exchange_weak(current, current | FrameRing::READING,
+                                          std::memory_order_acq_rel)) {
+        continue;
+      }
+      std::vector<Frame *> frames;
+      frames.reserve(evicted + 1 - seq);
+      for (uint64_t unread = seq; unread <= evicted; unread++) {
+        Frame *frame = m_ring->get(unread, m_ring_format);
+        if (frame != nullptr) {
+          frames.push_back(frame);
+        }
+      }
+      enqueue_batch(frames.data(), frames.size(), stats);
+      m_cursor.store(FrameRing::cursor_at(evicted + 1), std::memory_order_release);
+      return evicted + 1;
+    }
+
+    if (m_policy == DISCONNECT) {
+      if (!m_cursor.compare_exchange_weak(current, FrameRing::DETACHED)) {
+        continue;
+      }
+      if (disconnect()) {
+        stats.disconnects++;
+      }
+      wake_consumer();
+      return UINT64_MAX;
+    }
+
+    if (!m_cursor.compare_exchange_weak(current, FrameRing::cursor_at(evicted + 1))) {
+      continue;
+    }
+    m_dropped_oldest.fetch_add(evicted + 1 - seq, std::memory_order_relaxed);
+    stats.dropped_oldest += evicted + 1 - seq;
+    return evicted + 1;
+  }
+}
+
+void *MessageQueue::Node::operator new(size_t size) {
+  return BlockPool::allocate(size);
+}
+
+void MessageQueue::Node::operator delete(void *node, size_t size) {
+  BlockPool::release(node, size);
+}
+
+/**
+ * Appends a Frame to the in-memory queue.
+ */
+void MessageQueue::push(Frame *frame) {
+  Node *node = new Node();
+  node->next.store(nullptr, std::memory_order_relaxed);
+  node->frame = frame;
+
+  // Swing the head to the new node, then link the previous head to it.
+  // Until the link is made, the consumer sees the queue as ending at prev.
+  Node *prev = m_head.exchange(node, std::memory_order_acq_rel);
+  prev->next.store(node, std::memory_order_seq_cst);
+}
+
+/**
+ * Appends several Frames to the in-memory queue at once: they are
+ * linked to each other first, then to the queue like a single node.
+ */
+void MessageQueue::push_batch(Frame *const *frames, size_t count) {
+  Node *first = new Node();
+  first->frame = frames[0];
+  Node *last = first;
+  for (size_t i = 1; i < count; i++) {
+    Node *node = new Node();
+    node->frame = frames[i];
+    last->next.store(node, std::memory_order_relaxed);
+    last = node;
+  }
+  last->next.store(nullptr, std::memory_order_relaxed);
+
+  Node *prev = m_head.exchange(last, std::memory_order_acq_rel);
+  prev->next.store(first, std::memory_order_seq_cst);
+}
+
+/**
+ * Removes the oldest Frame from the in-memory queue.
+ *
+ * @return The Frame, or nullptr if the queue is empty.
+ */
+Frame *MessageQueue::pop() {
+  PopGuard guard(m_pop_lock, m_policy == DROP_OLDEST && m_limit != 0);
+
+  Node *tail = m_tail;
+  Node *next = tail->next.load(std::memory_order_acquire);
+  if (next == nullptr) {
     return nullptr;
   }
 
-  Message *msg = nullptr;
+  // next becomes the new stub, its frame is handed to the caller
+  Frame *frame = next->frame;
+  next->frame = nullptr;
+  m_tail = next;
+  delete tail;
+  if (m_limit != 0) {
+    m_size.fetch_sub(1);
+  }
+  return frame;
+}
+
+/**
+ * Checks whether a message is waiting to be dequeued.
+ * Only the consumer may call this.
+ */
+bool MessageQueue::is_empty() {
+  if (m_backlog_fill != nullptr || !m_refill.empty() || m_spilling.load()) {
+    return false;
+  }
+
+  {
+    PopGuard guard(m_pop_lock, m_policy == DROP_OLDEST && m_limit != 0);
+    if (m_tail->next.load(std::memory_order_seq_cst) != nullptr) {
+      return false;
+    }
+  }
+  return m_ring == nullptr || !m_ring->is_available(m_cursor);
+}
+
+/**
+ * Wakes up the waiting consumer, if no other producer beat us to it.
+ */
+void MessageQueue::wake_consumer() {
+  if (!m_waiting.exchange(false, std::memory_order_seq_cst)) {
+    return;
+  }
+
+  int fd = m_notify_fd.load();
+  if (fd >= 0) {
+    uint64_t one = 1;
+    ssize_t rc = write(fd, &one, sizeof(one));
+    (void) rc; // the counter can't overflow in practice
+  }
+}
 
-  // Guard the mutex for thread safety
-  Guard g(m_lock);
+/**
+ * Handles a Frame enqueued while the queue is full,
+ * according to the overflow policy.
+ */
+MessageQueue::EnqueueResult MessageQueue::overflow(Frame *frame) {
+  switch (m_policy) {
+  case DROP_OLDEST:
+    {
+      Frame *oldest = pop();
+      m_size.fetch_add(1);
+      push(frame);
+      if (oldest == nullptr) {
+        return ENQUEUED; // the consumer made room in the meantime
+      }
+      oldest->unref();
+      m_dropped_oldest.fetch_add(1, std::memory_order_relaxed);
+      return DROPPED_OLDEST;
+    }
+
+  case DROP_NEWEST:
+    frame->unref();
+    m_dropped_newest.fetch_add(1, std::memory_order_relaxed);
+    return DROPPED_NEWEST;
+
+  case DISCONNECT:
+    frame->unref();
+    return disconnect() ? DISCONNECTED : DISCARDED;
 
-  // Remove the next message from the queue and return it
-  assert(!m_messages.empty());
-  msg = m_messages.front();
-  m_messages.pop_front();
+  case SPILL:
+    {
+      Guard guard(m_spill_lock);
+      if (!m_spilling.load()) {
+        if (m_size.fetch_add(1) < m_limit) {
+          push(frame); // the consumer caught up in the meantime
+          return ENQUEUED;
+        }
+        m_size.fetch_sub(1);
+      }
+
+      bool spilled = spill(frame);
+      frame->unref();
+      if (!spilled) {
+        m_dropped_newest.fetch_add(1, std::memory_order_relaxed);
+        return DROPPED_NEWEST;
+      }
+      m_spilling.store(true);
+      m_spilled.fetch_add(1, std::memory_order_relaxed);
+      return SPILLED;
+    }
+  }
+  return ENQUEUED;
+}
 
-  return msg;
+/**
+ * Disconnects the consumer, shutting down its socket and waking it
+ * up if it waits.
+ *
+ * @return False if it was disconnected already.
+ */
+bool MessageQueue::disconnect() {
+  if (m_disconnected.exchange(true)) {
+    return false;
+  }
+  {
+    Guard guard(m_socket_lock);
+    if (m_socket_fd >= 0) {
+      // the consumer notices the socket going away, even if it
+      // is blocked writing to it or waiting for it to be writable
+      shutdown(m_socket_fd, SHUT_RDWR);
+    }
+  }
+
+  // and a consumer blocked in dequeue notices, too
+  if (m_waiting.load(std::memory_order_seq_cst)) {
+    wake_consumer();
+  }
+  return true;
+}
+
+/**
+ * Appends a Frame to the spill file, creating the file if necessary.
+ * The spill lock must be held.
+ *
+ * @return True if the Frame was written, false on failure.
+ */
+bool MessageQueue::spill(Frame *frame) {
+  if (m_spill_fd < 0) {
+    m_spill_fd = open_spill_file(m_spill_dir);
+    if (m_spill_fd < 0) {
+      std::cerr << "Error: could not create spill file in " << m_spill_dir << std::endl;
+      return false;
+    }
+  }
+
+  // frames are never longer than a binary frame may be
+  char record[2 + BinaryHeader::MAX_FRAME];
+  uint16_t len = uint16_t(frame->size());
+  memcpy(record, &len, sizeof(len));
+  memcpy(record + 2, frame->data(), len);
+  if (!write_fully(m_spill_fd, record, 2 + len, m_spill_write)) {
+    return false;
+  }
+  m_spill_write += 2 + len;
+  return true;
+}
+
+/**
+ * Reads a chunk of spilled messages back into m_refill. Once all of
+ * them were read, the file is emptied and spilling stops.
+ * Only the consumer may call this.
+ */
+void MessageQueue::refill() {
+  Guard guard(m_spill_lock);
+
+  std::vector<char> buf(REFILL_BYTES);
+  ssize_t n = pread(m_spill_fd, buf.data(), buf.size(), m_spill_read);
+  if (n <= 0) {
+    n = 0;
+  }
+
+  size_t pos = 0;
+  while (pos + 2 <= size_t(n)) {
+    uint16_t len;
+    memcpy(&len, buf.data() + pos, sizeof(len));
+    if (pos + 2 + len > size_t(n)) {
+      break; // the rest of the record is in the next chunk
+    }
+    m_refill.push_back(Frame::copy(buf.data() + pos + 2, len));
+    pos += 2 + len;
+  }
+  m_spill_read += pos;
+
+  if (m_spill_read >= m_spill_write || pos == 0) {
+    // everything was read back (or the file became unreadable)
+    m_spill_read = m_spill_write = 0;
+    if (ftruncate(m_spill_fd, 0) < 0) {
+      std::cerr << "Error: could not truncate spill file" << std::endl;
+    }
+    m_spilling.store(false);
+  }
 }
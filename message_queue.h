@@ -1,33 +1,241 @@
 #ifndef MESSAGE_QUEUE_H
 #define MESSAGE_QUEUE_H
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <deque>
+#include <string>
+#include <vector>
 #include <pthread.h>
-#include <semaphore.h>
-struct Message;
+#include <sys/types.h>
+#include "frame.h"
+class FrameRing;
 
-// This data type represents a queue of Messages waiting to
-// be delivered to a receiver
+// This data type represents a queue of encoded messages waiting to
+// be delivered to a receiver. The queue owns one reference to each
+// Frame it holds, which is handed over to whoever dequeues it.
+//
+// The queue is lock-free: any number of threads may enqueue, but only
+// a single thread (the receiver's) may dequeue. A consumer which finds
+// the queue empty announces that it is going to wait (arm_notify), and
+// the next enqueue wakes it up by signaling an eventfd, which it polls
+// (dequeue does that for it) or watches from an event loop. Enqueues
+// made while the consumer is busy cost no system call at all.
+//
+// A queue may be given a limit on the number of messages it holds in
+// memory, along with a policy deciding what happens once it is full.
+//
+// Before anything else, the consumer gets the queue's backlog, if it
+// has one: messages (the history replayed to a receiver when it joins)
+// which the consumer produces itself, a chunk at a time as it dequeues,
+// so they neither pile up in memory nor count against the limit.
+//
+// In the ring delivery mode, a receiver's room publishes its messages
+// into a FrameRing instead, and the queue reads them from there with a
+// cursor, once it has handed out its backlog. A receiver lagging a
+// whole ring behind gets the messages it didn't read moved to its
+// queue, before they are overwritten, unless it may overrun the ring
+// (see set_ring_overrun): then the overflow policy decides, and
+// DISCONNECT disconnects it, while the other policies drop the
+// oldest messages it didn't read.
 class MessageQueue {
 public:
+  // What enqueue does when the queue is at its limit
+  enum OverflowPolicy {
+    DROP_OLDEST, // discard the oldest queued message
+    DROP_NEWEST, // discard the message being enqueued
+    DISCONNECT,  // discard the message and shut down the consumer's socket
+    SPILL,       // append messages to a file until the consumer catches up
+  };
+
+  // Outcome of an enqueue
+  enum EnqueueResult {
+    ENQUEUED,       // the message was queued in memory
+    SPILLED,        // the message was written to the spill file
+    DROPPED_OLDEST, // the message was queued, the oldest one dropped
+    DROPPED_NEWEST, // the message was dropped
+    DISCONNECTED,   // the message was dropped, the consumer disconnected
+    DISCARDED,      // the consumer was disconnected earlier
+  };
+
+  // How often the overflow policy kicked in
+  struct OverflowStats {
+    unsigned long dropped_oldest = 0;
+    unsigned long dropped_newest = 0;
+    unsigned long spilled = 0;
+    unsigned long disconnects = 0;
+
+    bool any() const { return dropped_oldest || dropped_newest || spilled || disconnects; }
+    void count(EnqueueResult result);
+    void add(const OverflowStats &other);
+  };
+
   MessageQueue();
   ~MessageQueue();
 
-  void enqueue(Message *msg); // will not block
-  Message *dequeue();         // blocks for at most a finite amount of time
+  // Limit the queue to limit messages in memory (0: unlimited), handling
+  // overflow according to policy; spill files are created in spill_dir.
+  // Must be called before the queue is shared with other threads.
+  void set_limit(size_t limit, OverflowPolicy policy, const std::string &spill_dir);
+
+  // Set the socket shut down by the DISCONNECT policy (-1: none). Once
+  // set_socket(-1) returns, producers no longer touch the old socket,
+  // so it may be closed even while they can still reach the queue.
+  void set_socket(int fd);
+
+  EnqueueResult enqueue(Frame *frame); // will not block
+
+  // Enqueue count frames in order; while the queue has room for all
+  // of them, they are linked in with a single atomic exchange. The
+  // outcome of enqueues the overflow policy handled is added to stats.
+  void enqueue_batch(Frame *const *frames, size_t count, OverflowStats &stats);
+  Frame *dequeue();           // blocks until a message is available,
+                              // returns nullptr once disconnected
+  Frame *try_dequeue();       // never blocks, returns nullptr if empty
+
+  // Blocks until at least one message is available, then dequeues up
+  // to max_frames messages into frames; returns how many were dequeued,
+  // or 0 once disconnected
+  size_t dequeue_batch(Frame **frames, size_t max_frames);
+
+  // Returns an eventfd which the consumer can wait on for messages
+  // becoming available. The eventfd is created on the first call and
+  // is owned by the queue. It is only signaled after arm_notify().
+  int get_notify_fd();
+
+  // Called by the consumer after try_dequeue found the queue empty
+  // (and after get_notify_fd): requests the notify fd to be signaled
+  // by the next enqueue.
+  // Returns false if messages arrived in the meantime, in which case
+  // the consumer should keep dequeuing instead of waiting.
+  bool arm_notify();
+
+  bool is_disconnected() const { return m_disconnected.load(); }
+
+  OverflowStats get_overflow_stats() const;
+
+  // Hand out a backlog before any other messages: try_dequeue calls
+  // fill(frames, max, arg) for the next chunk of up to max Frames,
+  // which returns how many it stored, 0 once the backlog is over;
+  // then release(arg) is called (or once the queue is destroyed).
+  // Only the consumer's thread may call this.
+  void set_backlog(size_t (*fill)(Frame **frames, size_t max, void *arg),
+                   void (*release)(void *arg), void *arg);
+
+  // Read messages from ring, starting with the one numbered seq, in
+  // the given format. Must be called before a publisher can reach
+  // the queue.
+  void attach_ring(FrameRing *ring, DeliveryFormat format, uint64_t seq);
+
+  // Stop reading from the ring; publishers must no longer be able to
+  // reach the queue
+  void detach_ring();
+
+  // Whether the ring's publisher may apply the overflow policy to
+  // messages the consumer didn't read yet, rather than moving them
+  // to the queue (the default)
+  void set_ring_overrun(bool overrun) { m_ring_overrun = overrun; }
+
+  // Called by the ring's publisher before it reuses the slot of the
+  // message numbered evicted: makes sure the cursor is past it,
+  // moving the messages up to it to the queue if it isn't, or applying
+  // the overflow policy if the ring may be overrun. Outcomes are added to
+  // stats. Returns the position of the cursor, UINT64_MAX if the
+  // consumer is disconnected.
+  uint64_t make_room(uint64_t evicted, OverflowStats &stats);
 
 private:
+  friend class FrameRing;
+
   // value semantics prohibited
   MessageQueue(const MessageQueue &);
   MessageQueue &operator=(const MessageQueue &);
 
-  // these data members are sufficient to implement the
-  // enqueue and dequeue operations: the idea is that the semaphore
-  // keeps a count of how many messages are currently in the queue
+  struct Node {
+    std::atomic<Node *> next;
+    Frame *frame;
+
+    // nodes come from the BlockPool
+    static void *operator new(size_t size);
+    static void operator delete(void *node, size_t size);
+  };
+
+  void push(Frame *frame);
+  void push_batch(Frame *const *frames, size_t count);
+  Frame *pop();
+  Frame *take_backlog();
+  void end_backlog();
+  Frame *take_from_ring();
+  bool is_empty();
+  void wake_consumer();
+  EnqueueResult overflow(Frame *frame);
+  bool disconnect();
+  bool spill(Frame *frame);
+  void refill();
+
+  // Producers append at m_head, the consumer removes from m_tail. The
+  // node at m_tail is a stub whose frame was already dequeued (or the
+  // initial dummy), the first message is in the node after it.
+  std::atomic<Node *> m_head;
+  Node *m_tail;
+
+  // messages in the in-memory queue
+  std::atomic<size_t> m_size;
+
+  // set by a consumer about to wait, cleared by the producer
+  // which wakes it up
+  std::atomic<bool> m_waiting;
+
+  std::atomic<int> m_notify_fd;
+
+  size_t m_limit;
+  OverflowPolicy m_policy;
+  std::string m_spill_dir;
+
+  // protects m_socket_fd, so the socket isn't shut down after
+  // the consumer let go of it
+  pthread_mutex_t m_socket_lock;
+  int m_socket_fd;
+
+  // with DROP_OLDEST, producers remove messages too, so
+  // removing from the queue is serialized by this spinlock
+  std::atomic<bool> m_pop_lock;
+
+  // while spilling, new messages are appended to the spill file
+  // (as a 16 bit length followed by the encoded message); the
+  // consumer reads them back into m_refill once memory is empty
+  pthread_mutex_t m_spill_lock;
+  std::atomic<bool> m_spilling;
+  int m_spill_fd;
+  off_t m_spill_read;
+  off_t m_spill_write;
+  std::deque<Frame *> m_refill;
+
+  std::atomic<bool> m_disconnected;
+
+  // the backlog (see set_backlog) while it lasts, and the chunk of it
+  // not handed out yet, from m_backlog_pos on; only the consumer
+  // touches them
+  size_t (*m_backlog_fill)(Frame **frames, size_t max, void *arg);
+  void (*m_backlog_release)(void *arg);
+  void *m_backlog_arg;
+  std::vector<Frame *> m_backlog;
+  size_t m_backlog_pos;
+
+  // in the ring delivery mode: the room's ring, the format to read,
+  // the cursor (see FrameRing), whether the queue is one of the
+  // ring's waiters (protected by the ring's waiter lock), and whether
+  // the publisher may overrun the cursor (see set_ring_overrun)
+  FrameRing *m_ring;
+  DeliveryFormat m_ring_format;
+  std::atomic<uint64_t> m_cursor;
+  bool m_ring_waiter;
+  bool m_ring_overrun;
 
-  pthread_mutex_t m_lock; // must be held while accessing queue
-  sem_t m_avail;
-  std::deque<Message *> m_messages;
+  std::atomic<unsigned long> m_dropped_oldest;
+  std::atomic<unsigned long> m_dropped_newest;
+  std::atomic<unsigned long> m_spilled;
 };
 
 #endif // MESSAGE_QUEUE_H
@@ -1,28 +1,133 @@
 #include <iostream>
 #include <string>
-#include <vector>
 #include <stdexcept>
-#include <sstream>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
 #include "csapp.h"
 #include "message.h"
 #include "connection.h"
 #include "client_util.h"
 
-int main(int argc, char **argv) {
-  if (argc != 5) {
-    std::cerr << "Usage: ./receiver [server_address] [port] [username] [room]\n";
-    return 1;
+namespace {
+
+/**
+ * Prints the last two ':'-separated fields of a delivery's data
+ * ("room:sender:text", or "room:seq:sender:text") as "sender: text".
+ *
+ * @param data The delivery's data.
+ * @param len The length of the data.
+ */
+void print_delivery(const char *data, size_t len) {
+  // a trailing ':' doesn't start another field
+  if (len > 0 && data[len - 1] == ':') {
+    len--;
+  }
+
+  const char *text = static_cast<const char *>(memrchr(data, ':', len));
+  if (text == nullptr) {
+    return; // only one field
+  }
+  const char *sender = static_cast<const char *>(memrchr(data, ':', text - data));
+  sender = sender == nullptr ? data : sender + 1;
+
+  std::cout.write(sender, text - sender);
+  std::cout << ": ";
+  std::cout.write(text + 1, data + len - (text + 1));
+  std::cout << std::endl;
+}
+
+/**
+ * Prints a binary delivery, whose payload is the message's sequence
+ * number, the sender's username and the text, as "sender: text".
+ *
+ * @param header The delivery's header.
+ * @param payload The delivery's payload.
+ */
+void print_binary_delivery(const BinaryHeader &header, const char *payload) {
+  if (BinaryHeader::SEQ_SIZE + header.name_len > header.length) {
+    return; // malformed
+  }
+  payload += BinaryHeader::SEQ_SIZE;
+  size_t len = header.length - BinaryHeader::SEQ_SIZE;
+  std::cout.write(payload, header.name_len);
+  std::cout << ": ";
+  std::cout.write(payload + header.name_len, len - header.name_len);
+  std::cout << std::endl;
+}
+
+/**
+ * Returns the sequence number of a delivery: the second field of
+ * its data in the text protocol, if the deliveries are numbered, the
+ * start of its payload in the binary protocol.
+ *
+ * @param binary Whether the delivery is a binary frame.
+ * @param numbered Whether text deliveries carry sequence numbers.
+ * @param data The delivery's data or payload.
+ * @param len Its length.
+ * @return The sequence number, or 0 if the delivery has none.
+ */
+uint64_t delivery_seq(bool binary, bool numbered, const char *data, size_t len) {
+  if (!binary && !numbered) {
+    return 0;
+  }
+  if (binary) {
+    uint64_t seq = 0;
+    if (len >= BinaryHeader::SEQ_SIZE) {
+      memcpy(&seq, data, BinaryHeader::SEQ_SIZE);
+    }
+    return le64toh(seq);
+  }
+
+  const char *p = static_cast<const char *>(memchr(data, ':', len));
+  if (p == nullptr) {
+    return 0;
+  }
+  uint64_t seq = 0;
+  for (p++; p < data + len && *p >= '0' && *p <= '9'; p++) {
+    seq = seq * 10 + (*p - '0');
   }
+  return seq;
+}
+
+void usage() {
+  std::cerr << "Usage: ./receiver [-b] [-n count | -s seq] [-r] [server_address] [port] [username] [room]\n"
+            << "  -b        use the binary protocol\n"
+            << "  -n count  first get the last count messages sent to the room\n"
+            << "  -s seq    first get the messages sent to the room from number seq on\n"
+            << "  -r        reconnect when the connection is lost, resuming after\n"
+            << "            the last message received\n";
+}
 
-  std::string server_hostname = argv[1];
-  int server_port = std::stoi(argv[2]);
-  std::string username = argv[3];
-  std::string room_name = argv[4];
+// What a receiver session needs to know, and what it remembers
+// for the next one if it reconnects
+struct ReceiverState {
+  std::string server_hostname;
+  int server_port;
+  std::string username;
+  std::string room_name;
+  bool want_binary = false;
+  bool resume = false; // reconnect after losing the connection (-r)
+  std::string history; // appended to the join request
 
+  bool joined = false;   // whether any session joined the room
+  uint64_t last_seq = 0; // sequence number of the last delivery
+};
+
+/**
+ * Connects to the server, logs in, joins the room and prints the
+ * messages delivered until the connection is lost. Once a message
+ * was received, the join request asks for the messages after it.
+ *
+ * @param state The receiver's settings and progress.
+ * @return The exit status: 1 if the connection failed, 2 if the
+ *         server refused a request or the connection was lost.
+ */
+int receive_messages(ReceiverState &state) {
   Connection conn;
 
   // Connect to server
-  conn.connect(server_hostname, server_port);
+  conn.connect(state.server_hostname, state.server_port);
 
   if (!conn.is_open()) {
     std::cerr << "Server Connection Failure" << std::endl;
@@ -30,7 +135,7 @@ int main(int argc, char **argv) {
   }
 
   /* Start of: Send rlogin message */ 
-  Message rlogin_msg = Message(TAG_RLOGIN, username);
+  Message rlogin_msg = Message(TAG_RLOGIN, state.want_binary ? state.username + ":binary" : state.username);
   if (!conn.send(rlogin_msg)) {
     std::cerr << "Message Send Failure: RLOGIN" << std::endl;
     return 2;
@@ -44,18 +149,30 @@ int main(int argc, char **argv) {
   }
   if (rlogin_msg_received.tag == TAG_ERR){
     std::cerr << rlogin_msg_received.data << std::endl; // output error message
+    state.joined = false; // don't retry
     return 2;
   }
+  conn.set_binary(state.want_binary);
   /* End of: Send rlogin message */ 
 
 
   /* Start of: Send join message */
-  if (!conn.send(Message(TAG_JOIN, room_name))) {
+  // joining with history has deliveries carry their sequence numbers,
+  // which resuming needs
+  std::string history = state.history;
+  uint64_t resumed_after = state.last_seq;
+  if (state.last_seq > 0) {
+    history = ":since:" + std::to_string(state.last_seq + 1);
+  } else if (state.resume && history.empty()) {
+    history = ":last:0";
+  }
+  bool numbered = !history.empty();
+  if (!conn.send(Message(TAG_JOIN, state.room_name + history))) {
     std::cerr << "Message Send Failure: JOIN" << std::endl;
     return 2;
   }
 
-  Message join_msg = Message(TAG_JOIN, room_name);
+  Message join_msg = Message(TAG_JOIN, state.room_name);
   
   if (!conn.receive(join_msg)) {
     std::cerr << "Message Receive Failure: JOIN" << std::endl;
@@ -63,48 +180,89 @@ int main(int argc, char **argv) {
   }
   if (join_msg.tag == TAG_ERR) {
     std::cerr << join_msg.data << std::endl; // output error message
+    state.joined = false; // don't retry
     return 2;
   }
+  state.joined = true;
   /* End of: Send join message */
 
 
 
   // Loop waiting for messages from server (which should be tagged with TAG_DELIVERY)
   while (true) {
-    Message received_msg = Message();
+    // parsed in place in the connection's buffer, nothing is copied
+    MessageView received_msg;
     /* Start of Error handling */
     if (!conn.receive(received_msg)) {
-      std::cerr << "Message Receive Failure";
+      std::cerr << "Message Receive Failure" << std::endl;
       return 2;
     }
 
-    if (received_msg.tag == TAG_ERR) {
-      std::cerr << received_msg.data; // output error message
+    if (received_msg.has_tag(TAG_ERR)) {
+      std::cerr.write(received_msg.data, received_msg.data_len); // output error message
       return 2;
     }
     /* End of Error handling */
 
-    if (received_msg.tag == TAG_DELIVERY) {
-      std::stringstream ss(received_msg.data);
-      std::vector<std::string> tokens;
-      std::string token;
+    if (!received_msg.has_tag(TAG_DELIVERY)) {
+      continue;
+    }
+    uint64_t seq = delivery_seq(conn.is_binary(), numbered, received_msg.data, received_msg.data_len);
+    if (state.resume && seq != 0 && seq <= resumed_after) {
+      continue; // seen before the connection was lost
+    }
+    state.last_seq = std::max(state.last_seq, seq);
+    if (conn.is_binary()) {
+      print_binary_delivery(conn.get_last_header(), received_msg.data);
+    } else {
+      print_delivery(received_msg.data, received_msg.data_len);
+    }
 
-      // Use ':' as the delimiter to split the string
-      while (std::getline(ss, token, ':')) {
-          tokens.push_back(token);
-      }
+  }
+}
 
-      // Check if there are at least two tokens
-      if (tokens.size() >= 2) {
-          // Extract the last two tokens
-          std::string last_two_tokens = tokens[tokens.size() - 2] + ": " + tokens[tokens.size() - 1];
-          std::cout << last_two_tokens << std::endl;
-      }
+}
 
+int main(int argc, char **argv) {
+  ReceiverState state;
+  int opt;
+  while ((opt = getopt(argc, argv, "bn:s:r")) != -1) {
+    if (opt == 'b') {
+      state.want_binary = true;
+    } else if (opt == 'n') {
+      state.history = std::string(":last:") + optarg;
+    } else if (opt == 's') {
+      state.history = std::string(":since:") + optarg;
+    } else if (opt == 'r') {
+      state.resume = true;
+    } else {
+      usage();
+      return 1;
     }
+  }
 
+  if (argc - optind != 4) {
+    usage();
+    return 1;
   }
 
+  state.server_hostname = argv[optind];
+  state.server_port = std::stoi(argv[optind + 1]);
+  state.username = argv[optind + 2];
+  state.room_name = argv[optind + 3];
 
-  return 0;
+  // after a connection that got as far as joining the room was lost,
+  // retry with growing delays, up to about two seconds apart
+  const useconds_t MIN_DELAY = 100000;
+  const useconds_t MAX_DELAY = 2000000;
+  useconds_t delay = MIN_DELAY;
+  while (true) {
+    uint64_t last_seq = state.last_seq;
+    int status = receive_messages(state);
+    if (!state.resume || !state.joined) {
+      return status;
+    }
+    delay = state.last_seq != last_seq ? MIN_DELAY : std::min(delay * 2, MAX_DELAY);
+    usleep(delay);
+  }
 }
@@ -0,0 +1,70 @@
+#include "replay_ring.h"
+
+/**
+ * Constructor for the ReplayRing class.
+ *
+ * @param capacity The number of messages to keep.
+ * @param next_seq The sequence number of the first message appended.
+ */
+ReplayRing::ReplayRing(size_t capacity, uint64_t next_seq)
+  : m_slots(capacity)
+  , m_count(0)
+  , m_next(next_seq) {
+}
+
+/**
+ * Adds a message, overwriting the oldest one if the ring is full.
+ *
+ * @param seq The sequence number of the message.
+ * @param sender The username of the sender.
+ * @param text The text of the message.
+ * @param text_len The length of the text.
+ */
+void ReplayRing::append(uint64_t seq, const std::string &sender, const char *text, size_t text_len) {
+  m_next = seq + 1;
+  if (m_slots.empty()) {
+    return;
+  }
+  Slot &slot = m_slots[seq % m_slots.size()];
+  slot.seq = seq;
+  slot.sender = sender;
+  slot.text.assign(text, text_len);
+  if (m_count < m_slots.size()) {
+    m_count++;
+  }
+}
+
+/**
+ * Checks whether the messages from the one numbered first on are
+ * all still held. This is true of messages which weren't sent yet.
+ */
+bool ReplayRing::covers(uint64_t first) const {
+  return first + m_count >= m_next;
+}
+
+/**
+ * Visits up to max of the messages held from the one numbered first
+ * on, oldest first.
+ *
+ * @return The number of messages visited.
+ */
+size_t ReplayRing::read(uint64_t first, size_t max, void (*visit)(const RoomLog::Record &record, void *arg),
+                        void *arg) const {
+  uint64_t seq = m_next - m_count;
+  if (first > seq) {
+    seq = first;
+  }
+  uint64_t end = m_next - seq > max ? seq + max : m_next;
+  size_t visited = end - seq;
+  for (; seq < end; seq++) {
+    const Slot &slot = m_slots[seq % m_slots.size()];
+    RoomLog::Record record;
+    record.seq = slot.seq;
+    record.name = slot.sender.data();
+    record.name_len = slot.sender.length();
+    record.text = slot.text.data();
+    record.text_len = slot.text.length();
+    visit(record, arg);
+  }
+  return visited;
+}
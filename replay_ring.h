@@ -0,0 +1,46 @@
+#ifndef REPLAY_RING_H
+#define REPLAY_RING_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "room_log.h"
+
+// A ReplayRing keeps the most recent messages sent to a room, with
+// their sequence numbers, so a receiver which reconnects can resume
+// where it left off without reading the room's log (if it has one at
+// all). Once the ring is full, each message overwrites the oldest one.
+//
+// A ReplayRing isn't thread-safe: the Room serializes its use.
+class ReplayRing {
+public:
+  // Keep the last capacity messages (none if capacity is 0); the
+  // first message appended will be numbered next_seq
+  ReplayRing(size_t capacity, uint64_t next_seq);
+
+  // Add a message, whose sequence number must follow the previous one's
+  void append(uint64_t seq, const std::string &sender, const char *text, size_t text_len);
+
+  // Whether the ring holds every message from the one numbered first
+  // on, up to the last one appended
+  bool covers(uint64_t first) const;
+
+  // Call visit(record, arg) for up to max messages held, from the one
+  // numbered first (or the oldest one held, if that is gone) on;
+  // returns the number of messages visited
+  size_t read(uint64_t first, size_t max, void (*visit)(const RoomLog::Record &record, void *arg),
+              void *arg) const;
+
+private:
+  struct Slot {
+    uint64_t seq;
+    std::string sender;
+    std::string text; // keeps its capacity when overwritten
+  };
+
+  std::vector<Slot> m_slots;
+  size_t m_count;     // slots in use
+  uint64_t m_next;    // sequence number after the last message
+};
+
+#endif // REPLAY_RING_H
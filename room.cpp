@@ -1,20 +1,121 @@
+#include <algorithm>
+#include <new>
+#include <time.h>
 #include "guard.h"
 #include "message.h"
+#include "frame.h"
 #include "message_queue.h"
 #include "user.h"
+#include "room_log.h"
+#include "log_committer.h"
+#include "frame_ring.h"
+#include "fanout_pool.h"
+#include "block_pool.h"
 #include "room.h"
 
+namespace {
+
+/**
+ * Returns the current time in seconds, from a clock that never
+ * goes backwards.
+ */
+long monotonic_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec;
+}
+
+/**
+ * Returns the current time in nanoseconds, from a clock that never
+ * goes backwards.
+ */
+uint64_t monotonic_nanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return uint64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+// the id of the next room created
+std::atomic<uint32_t> next_room_id(1);
+
+/**
+ * Opens the log of a room, if its messages are to be logged.
+ *
+ * @return The log, or nullptr.
+ */
+RoomLog *open_log(const std::string &room_name, LogCommitter *committer) {
+  if (committer == nullptr) {
+    return nullptr;
+  }
+  RoomLog *log = new RoomLog(committer->get_dir() + "/" + room_name);
+  if (!log->is_open()) {
+    delete log;
+    return nullptr;
+  }
+  return log;
+}
+
+}
+
 // Constructor
-Room::Room(const std::string &room_name)
-  : room_name(room_name) {
-  // Initialize the mutex
+Room::Room(const std::string &room_name, LogCommitter *committer, size_t replay_size,
+           size_t ring_size, FanoutPool *fanout)
+  : room_name(room_name)
+  , id(next_room_id.fetch_add(1, std::memory_order_relaxed))
+  , refs(1)
+  , idle_since(monotonic_seconds())
+  , members(std::make_shared<MemberList>())
+  , log(open_log(room_name, committer))
+  , committer(committer)
+  , log_scheduled(false)
+  , next_message_seq(log != nullptr ? log->next_seq() : 1)
+  , recent(replay_size, next_message_seq)
+  , ring(ring_size > 0 ? new FrameRing(std::max<size_t>(ring_size, size_t(Batch::MAX_MESSAGES))) : nullptr)
+  , deliveries_head(nullptr)
+  , deliveries_tail(nullptr)
+  , num_encoding(0)
+  , draining(false)
+  , fanout(fanout)
+  , fanouts_pending(0) {
+  // Initialize the mutexes
   pthread_mutex_init(&lock, NULL);
+  pthread_mutex_init(&seq_lock, NULL);
+  pthread_mutex_init(&delivery_lock, NULL);
 }
 
 // Destructor
 Room::~Room() {
-  // Destroy the mutex
+  // commits what is left of the log
+  delete log;
+  delete ring;
+
+  // Destroy the mutexes
   pthread_mutex_destroy(&lock);
+  pthread_mutex_destroy(&seq_lock);
+  pthread_mutex_destroy(&delivery_lock);
+}
+
+/**
+ * Drops a reference, destroying the Room when it was the last one.
+ */
+void Room::unref() {
+  unsigned left = refs.fetch_sub(1, std::memory_order_acq_rel) - 1;
+  if (left == 0) {
+    delete this;
+  } else if (left == 1) {
+    idle_since.store(monotonic_seconds(), std::memory_order_relaxed);
+  }
+}
+
+/**
+ * Checks whether the room has been unused for a while.
+ *
+ * @param grace How long (in seconds) the room must have been unused.
+ * @return True if only one reference has been left for at least grace seconds.
+ */
+bool Room::is_idle(int grace) const {
+  return refs.load(std::memory_order_acquire) == 1 &&
+    monotonic_seconds() - idle_since.load(std::memory_order_relaxed) >= grace;
 }
 
 /**
@@ -23,29 +124,676 @@ Room::~Room() {
  * @param user The User object to add to the room.
  */
 void Room::add_member(User *user) {
+  Guard guard(seq_lock);
+  insert_member(user, next_message_seq);
+}
+
+// A batch of messages being delivered, encoded in each format the
+// members of the snapshot get. It comes from the BlockPool, with room
+// for the Frames of just the messages of the batch. In the ring
+// delivery mode, there is a Frame (or nullptr) for each message of a
+// format, and the ring takes them over when the batch is published.
+struct Room::Delivery {
+  Room *room;
+  Delivery *next; // the next one queued in the room
+  bool encoded;   // whether it may be delivered yet
+  MemberSnapshot snapshot;
+  uint64_t first_seq;
+  size_t count;                  // messages in the batch
+  uint64_t start;                // when the broadcast started (monotonic_nanos)
+  std::atomic<unsigned> pending; // partitions not delivered to yet
+  size_t capacity;               // Frames of each format there is room for
+  size_t num_frames[NUM_DELIVERY_FORMATS];
+  Frame *frames[1];              // capacity Frames of each format, in turn
+
+  static Delivery *allocate(size_t count);
+  void release();
+
+  Frame **frames_in(DeliveryFormat format) { return frames + format * capacity; }
+  Frame *const *frames_in(DeliveryFormat format) const { return frames + format * capacity; }
+
+private:
+  explicit Delivery(size_t capacity) : capacity(capacity), num_frames() { }
+  ~Delivery() { }
+
+  static size_t size_for(size_t capacity) {
+    return sizeof(Delivery) + (NUM_DELIVERY_FORMATS * capacity - 1) * sizeof(Frame *);
+  }
+};
+
+/**
+ * Allocates a Delivery with room for the Frames of count messages.
+ */
+Room::Delivery *Room::Delivery::allocate(size_t count) {
+  size_t capacity = std::max<size_t>(count, 1);
+  void *mem = BlockPool::allocate(size_for(capacity));
+  return new (mem) Delivery(capacity);
+}
+
+/**
+ * Destroys the Delivery, once its Frames were released.
+ */
+void Room::Delivery::release() {
+  size_t size = size_for(capacity);
+  this->~Delivery();
+  BlockPool::release(this, size);
+}
+
+// The history being replayed to a member, as the backlog of its queue
+struct Room::Replay {
+  Room *room;
+  DeliveryFormat format;
+  uint64_t next; // sequence number of the next message to replay
+  uint64_t end;  // sequence number of the first one delivered live
+
+  // the chunk being produced
+  Frame **frames;
+  size_t count;
+  size_t max;
+};
+
+/**
+ * Adds a user to the room, with the messages from the one numbered
+ * first_seq on to be replayed to it before the live ones: it becomes
+ * a member before another message is numbered, and broadcasts of
+ * messages numbered below that point skip it. The replay is left to
+ * its queue (see fill_replay), so joining doesn't wait for it, and it
+ * doesn't count against the queue's limit.
+ *
+ * @param user The User object to add to the room.
+ * @param first_seq The sequence number of the first message to replay.
+ */
+void Room::add_member_since(User *user, uint64_t first_seq) {
+  Guard guard(seq_lock);
+  uint64_t end = next_message_seq;
+  uint64_t first = std::max<uint64_t>(first_seq, 1);
+  if (end > MAX_HISTORY) {
+    first = std::max(first, end - MAX_HISTORY);
+  }
+  if (first < end) {
+    Replay *replay = new Replay;
+    replay->room = this;
+    replay->format = user->delivery_format();
+    replay->next = first;
+    replay->end = end;
+    user->mqueue.set_backlog(fill_replay, release_replay, replay);
+  }
+  insert_member(user, end);
+}
+
+/**
+ * Produces the next chunk of a replay, for the queue of the member
+ * it is for, while it dequeues. The messages are read from memory if
+ * they are still kept there, holding off numbering only while the
+ * chunk is read; otherwise from the log, without holding any lock the
+ * room's broadcasts need. The member holds a reference to the room
+ * meanwhile.
+ *
+ * @param frames Where to store the Frames.
+ * @param max The maximum number of Frames to store.
+ * @param arg The Replay.
+ * @return The number of Frames stored, 0 once the replay is over.
+ */
+size_t Room::fill_replay(Frame **frames, size_t max, void *arg) {
+  Replay *replay = static_cast<Replay *>(arg);
+  Room *room = replay->room;
+  replay->frames = frames;
+  replay->count = 0;
+  replay->max = max;
+
+  // messages too long for the member's format are skipped
+  while (replay->count == 0 && replay->next < replay->end) {
+    uint64_t next = replay->next;
+    bool from_memory;
+    {
+      Guard guard(room->seq_lock);
+      from_memory = room->log == nullptr || room->recent.covers(next);
+      if (from_memory) {
+        room->recent.read(next, max, replay_record, replay);
+      }
+    }
+    if (!from_memory && room->log->read(next, max, replay_record, replay) == 0 &&
+        !room->log->read_uncommitted(next, replay_record, replay)) {
+      continue; // committed meanwhile, read them from the log
+    }
+    if (replay->next == next) {
+      break; // none of them are kept anymore
+    }
+  }
+  return replay->count;
+}
+
+/**
+ * Frees a replay once it is over.
+ */
+void Room::release_replay(void *arg) {
+  delete static_cast<Replay *>(arg);
+}
+
+/**
+ * Adds a message to the chunk of the replay being produced, unless
+ * the chunk is full, or the message is delivered live.
+ */
+void Room::replay_record(const RoomLog::Record &record, void *arg) {
+  Replay *replay = static_cast<Replay *>(arg);
+  if (record.seq >= replay->end || replay->count == replay->max) {
+    return;
+  }
+  replay->next = record.seq + 1;
+
+  // the sender may be long gone, so replayed binary deliveries
+  // carry user id 0
+  std::string sender(record.name, record.name_len);
+  Frame *frame = replay->room->encode_message(replay->format, record.seq, 0, sender,
+                                              record.text, record.text_len);
+  if (frame != nullptr) {
+    replay->frames[replay->count++] = frame;
+  }
+}
+
+/**
+ * Returns the sequence number the next message will get.
+ */
+uint64_t Room::next_seq() {
+  Guard guard(seq_lock);
+  return next_message_seq;
+}
+
+/**
+ * Publishes a member list with the user added.
+ *
+ * @param user The User object to add to the room.
+ * @param live_from The sequence number of the first message to deliver to it.
+ */
+void Room::insert_member(User *user, uint64_t live_from) {
   Guard guard(lock);
-  members.insert(user);
+  MemberSnapshot current = std::atomic_load(&members);
+  const std::vector<User *> &users = current->users;
+  if (std::find(users.begin(), users.end(), user) != users.end()) {
+    return;
+  }
+
+  // broadcasts read live_from after loading a snapshot with the user;
+  // a ring is read from the first message numbered after it joined
+  user->live_from = live_from;
+  if (ring != nullptr) {
+    user->mqueue.attach_ring(ring, user->delivery_format(), live_from);
+  }
+  std::shared_ptr<MemberList> updated = std::make_shared<MemberList>();
+  updated->users = users;
+  updated->users.push_back(user);
+  std::copy(current->format_users, current->format_users + NUM_DELIVERY_FORMATS,
+            updated->format_users);
+  updated->format_users[user->delivery_format()]++;
+  publish(current, updated);
 }
 
 /**
- * Removes a user from the room.
+ * Removes a user from the room. Broadcasts may still reach the user
+ * through older snapshots, so it is retired with the snapshot it was
+ * removed from, which outlives them (see MemberList). Until then, it
+ * must not shut down a socket its session may close.
  *
- * @param user The User object to remove from the room.
+ * @param user The User object to remove from the room; the room
+ *             destroys it.
  */
 void Room::remove_member(User *user) {
-  Guard guard(lock);
-  members.erase(user);
+  user->mqueue.set_socket(-1);
+
+  MemberSnapshot previous;
+  {
+    Guard guard(lock);
+    previous = std::atomic_load(&members);
+    const std::vector<User *> &users = previous->users;
+    std::vector<User *>::const_iterator i = std::find(users.begin(), users.end(), user);
+    if (i == users.end()) {
+      delete user; // no broadcast can reach it
+      return;
+    }
+
+    std::shared_ptr<MemberList> updated = std::make_shared<MemberList>();
+    updated->users.reserve(users.size() - 1);
+    updated->users.insert(updated->users.end(), users.begin(), i);
+    updated->users.insert(updated->users.end(), i + 1, users.end());
+    std::copy(previous->format_users, previous->format_users + NUM_DELIVERY_FORMATS,
+              updated->format_users);
+    updated->format_users[user->delivery_format()]--;
+    publish(previous, updated);
+    previous->retired.push_back(user);
+  }
+  // destroys previous and the user right away, unless broadcasts still use it
+}
+
+/**
+ * Destroys a member list once no broadcast uses it, or any older one,
+ * along with the users retired with it. The chain of newer snapshots
+ * only referenced by this one is unlinked iteratively, so destroying
+ * a long chain doesn't recurse.
+ */
+Room::MemberList::~MemberList() {
+  for (User *user : retired) {
+    user->mqueue.detach_ring();
+    delete user;
+  }
+
+  std::shared_ptr<const MemberList> successor = std::move(next);
+  while (successor != nullptr && successor.use_count() == 1) {
+    std::shared_ptr<const MemberList> after = std::move(successor->next);
+    successor.reset();
+    successor = std::move(after);
+  }
+}
+
+/**
+ * Commits the messages logged since the previous commit. Messages
+ * logged while this runs schedule another commit.
+ *
+ * @param records Incremented by the number of records committed.
+ * @param bytes Incremented by the number of bytes committed.
+ */
+void Room::commit_log(unsigned long &records, unsigned long &bytes) {
+  log_scheduled.store(false);
+  log->commit(records, bytes);
+}
+
+/**
+ * Replaces the current member snapshot, after partitioning the new one
+ * for the FanoutPool's workers if necessary. The room's lock must be held.
+ */
+void Room::publish(const MemberSnapshot &current, const std::shared_ptr<MemberList> &updated) {
+  if (fanout != nullptr && fanout->has_workers()) {
+    unsigned num_workers = fanout->get_num_workers();
+    updated->partitions.resize(num_workers);
+    for (User *user : updated->users) {
+      updated->partitions[user->id % num_workers].push_back(user);
+    }
+  }
+  current->next = updated;
+  std::atomic_store(&members, MemberSnapshot(updated));
 }
 
 /**
  * Broadcasts a message to every user in the room.
  *
- * @param sender_username The username of the sender.
- * @param message_text The text of the message to broadcast.
+ * @param sender The user who sent the message.
+ * @param text The text of the message.
+ * @param text_len The length of the text.
+ */
+void Room::broadcast_message(const User *sender, const char *text, size_t text_len) {
+  Batch::Entry message = { text, text_len };
+  broadcast_batch(sender, &message, 1);
+}
+
+/**
+ * Broadcasts a batch of messages to every user in the room.
+ * Each message is encoded once for each format the members get,
+ * and the resulting Frames are shared by the queues of all members of
+ * the current snapshot, which is loaded once for the whole batch, and
+ * each member gets the batch with a single enqueue. Text members don't
+ * get messages too long for the text protocol. The messages are
+ * numbered, logged (if the room is logged) and kept for replay first,
+ * and members who joined after that are skipped. Only that and queueing
+ * the batch for delivery happen under seq_lock: it is encoded after,
+ * and delivered after the batches numbered before it (see
+ * drain_deliveries). In the ring delivery mode, delivering the batch
+ * publishes its Frames into the ring instead.
+ *
+ * @param sender The user who sent the messages.
+ * @param messages The messages.
+ * @param count The number of messages, at most Batch::MAX_MESSAGES.
+ */
+void Room::broadcast_batch(const User *sender, const Batch::Entry *messages, size_t count) {
+  uint64_t start = fanout != nullptr ? monotonic_nanos() : 0;
+  Delivery *delivery = Delivery::allocate(count);
+  MessageQueue::OverflowStats batch_overflow;
+  {
+    Guard guard(seq_lock);
+    uint64_t first_seq = log != nullptr ? log->append(sender->username, messages, count) : next_message_seq;
+    next_message_seq = first_seq + count;
+    for (size_t i = 0; i < count; i++) {
+      recent.append(first_seq + i, sender->username, messages[i].text, messages[i].len);
+    }
+    delivery->first_seq = first_seq;
+    delivery->count = count;
+    queue_delivery(delivery);
+  }
+  if (log != nullptr && !log_scheduled.exchange(true)) {
+    ref(); // dropped by the committer
+    committer->schedule(this);
+  }
+
+  delivery->start = start;
+  encode(delivery, sender, messages, count);
+  if (mark_encoded(delivery)) {
+    drain_deliveries(batch_overflow);
+  }
+  if (batch_overflow.any()) {
+    Guard guard(lock);
+    overflow.add(batch_overflow);
+  }
+}
+
+/**
+ * Encodes a message in one of the formats receivers get.
+ *
+ * @param format The format.
+ * @param seq The sequence number of the message.
+ * @param sender_id The id of the sender (for binary frames).
+ * @param sender The username of the sender.
+ * @param text The text of the message.
+ * @param text_len The length of the text.
+ * @return The Frame, or nullptr if the message is too long for the format.
+ */
+Frame *Room::encode_message(DeliveryFormat format, uint64_t seq, uint32_t sender_id,
+                            const std::string &sender, const char *text, size_t text_len) const {
+  switch (format) {
+  case DELIVERY_TEXT:
+    return Frame::encode_delivery(room_name, sender, text, text_len);
+  case DELIVERY_NUMBERED_TEXT:
+    return Frame::encode_numbered_delivery(room_name, seq, sender, text, text_len);
+  default:
+    return Frame::encode_binary_delivery(id, sender_id, seq, sender, text, text_len);
+  }
+}
+
+/**
+ * Encodes a batch queued for delivery for the members of the current
+ * snapshot, in each format they get; each Frame gets a reference for
+ * each member it is for (in the ring delivery mode, the ring takes
+ * over the Frames instead, see publish_to_ring).
+ * Members who join meanwhile were made members after the batch was
+ * numbered, so they skip it anyway.
+ *
+ * @param delivery The batch, numbered already.
+ * @param sender The user who sent the messages.
+ * @param messages The messages.
+ * @param count The number of messages, at most Batch::MAX_MESSAGES.
+ */
+void Room::encode(Delivery *delivery, const User *sender, const Batch::Entry *messages, size_t count) {
+  MemberSnapshot snapshot = std::atomic_load(&members);
+  uint64_t first_seq = delivery->first_seq;
+
+  delivery->snapshot = snapshot;
+  for (int i = 0; i < NUM_DELIVERY_FORMATS; i++) {
+    DeliveryFormat format = DeliveryFormat(i);
+    size_t num_users = snapshot->format_users[format];
+    if (num_users == 0) {
+      continue;
+    }
+    Frame **frames = delivery->frames_in(format);
+    size_t &num_frames = delivery->num_frames[format];
+    for (size_t j = 0; j < count; j++) {
+      Frame *frame = encode_message(format, first_seq + j, sender->id, sender->username,
+                                    messages[j].text, messages[j].len);
+      if (ring != nullptr) {
+        frames[num_frames++] = frame; // nullptr if too long to be delivered
+      } else if (frame != nullptr) { // else too long to be delivered
+        frame->ref(num_users);
+        frames[num_frames++] = frame;
+      }
+    }
+  }
+}
+
+/**
+ * Queues a batch for delivery, after the batches numbered before it,
+ * before it is encoded. seq_lock must be held, so the batches are
+ * queued in the order they were numbered.
+ *
+ * @param delivery The batch.
+ */
+void Room::queue_delivery(Delivery *delivery) {
+  delivery->room = this;
+  delivery->next = nullptr;
+  delivery->encoded = false;
+  Guard guard(delivery_lock);
+  if (deliveries_tail != nullptr) {
+    deliveries_tail->next = delivery;
+  } else {
+    deliveries_head = delivery;
+  }
+  deliveries_tail = delivery;
+  num_encoding++;
+}
+
+/**
+ * Marks a queued batch as encoded, so it may be delivered.
+ *
+ * @param delivery The batch.
+ * @return True if the next batch is encoded (this one, or one a
+ *         broadcast handed over with), and no broadcast is delivering
+ *         the room's batches, so the caller must do it (see
+ *         drain_deliveries).
+ */
+bool Room::mark_encoded(Delivery *delivery) {
+  Guard guard(delivery_lock);
+  delivery->encoded = true;
+  num_encoding--;
+  if (draining || !deliveries_head->encoded) {
+    return false; // delivered by whoever delivers the batch before it
+  }
+  draining = true;
+  return true;
+}
+
+/**
+ * Delivers the queued batches in order, until there are none left
+ * or the next one isn't encoded yet, including those other broadcasts
+ * queue meanwhile. Only one broadcast at a time does this, so a member
+ * never gets a batch before one numbered earlier; a batch that is
+ * still being encoded is delivered, with the ones after it, by the
+ * broadcast encoding it. So that a sender doesn't keep delivering
+ * the batches of busier ones, it hands over to a broadcast still
+ * encoding once it delivered DRAIN_BUDGET batches besides the first;
+ * that broadcast goes on once its batch is encoded (see mark_encoded).
+ *
+ * @param stats Counts the overflows of the members' queues.
+ */
+void Room::drain_deliveries(MessageQueue::OverflowStats &stats) {
+  for (unsigned delivered = 0; ; delivered++) {
+    Delivery *delivery;
+    {
+      Guard guard(delivery_lock);
+      delivery = deliveries_head;
+      if (delivery == nullptr || !delivery->encoded ||
+          (delivered > DRAIN_BUDGET && num_encoding > 0)) {
+        draining = false;
+        return;
+      }
+      deliveries_head = delivery->next;
+      if (deliveries_head == nullptr) {
+        deliveries_tail = nullptr;
+      }
+    }
+    fan_out(delivery, stats);
+  }
+}
+
+/**
+ * Enqueues a batch for the members of its snapshot, or hands it to the
+ * FanoutPool's workers if the room is large enough, or publishes it
+ * into the ring, and releases it once that is done. Only the broadcast
+ * draining the deliveries calls this.
+ *
+ * @param delivery The batch.
+ * @param stats Counts the overflows of the members' queues.
  */
-void Room::broadcast_message(const std::string &sender_username, const std::string &message_text) {
+void Room::fan_out(Delivery *delivery, MessageQueue::OverflowStats &stats) {
+  if (ring != nullptr) {
+    size_t num_users = publish_to_ring(*delivery, stats);
+    if (ring->has_waiters()) {
+      ring->wake_waiters();
+    }
+    if (fanout != nullptr) {
+      fanout->record(num_users, monotonic_nanos() - delivery->start, false);
+    }
+    delivery->release();
+    return;
+  }
+
+  size_t num_users = delivery->snapshot->users.size();
+
+  // Once a batch went to the workers, the following ones do, too,
+  // until the workers are done: else a later batch could overtake it.
+  bool parallel = fanout != nullptr && num_users > 0 &&
+    (fanout->is_parallel(num_users) || fanouts_pending.load() > 0);
+  if (!parallel) {
+    deliver(*delivery, delivery->snapshot->users, stats);
+    release_frames(*delivery);
+    if (fanout != nullptr) {
+      fanout->record(num_users, monotonic_nanos() - delivery->start, false);
+    }
+    delivery->release();
+    return;
+  }
+
+  // the delivery keeps the room and the snapshot's members alive
+  // until the last worker is done with it
+  ref();
+  fanouts_pending.fetch_add(1);
+  delivery->pending.store(fanout->get_num_workers());
+  fanout->dispatch(deliver_partition, delivery);
+}
+
+/**
+ * Enqueues a batch for members of the delivery's snapshot. Each member
+ * holds a reference to each Frame it gets; members who joined after the
+ * batch was numbered drop theirs.
+ *
+ * @param delivery The batch.
+ * @param users The members to deliver to: all, or a partition.
+ * @param stats Counts the overflows of the members' queues.
+ */
+void Room::deliver(const Delivery &delivery, const std::vector<User *> &users,
+                   MessageQueue::OverflowStats &stats) {
+  for (User *user : users) {
+    DeliveryFormat format = user->delivery_format();
+    Frame *const *frames = delivery.frames_in(format);
+    size_t num_frames = delivery.num_frames[format];
+    if (delivery.first_seq < user->live_from) {
+      // the batch was numbered before the user joined (and replayed
+      // to it, if it asked for that); a batch is numbered at once
+      for (size_t i = 0; i < num_frames; i++) {
+        frames[i]->unref();
+      }
+      continue;
+    }
+    user->mqueue.enqueue_batch(frames, num_frames, stats);
+  }
+}
+
+/**
+ * Delivers a batch to one partition of the members, on a worker of
+ * the FanoutPool. The worker finishing last releases the batch and
+ * records how long it took.
+ *
+ * @param arg The Delivery.
+ * @param partition The partition, the index of the worker.
+ */
+void Room::deliver_partition(void *arg, unsigned partition) {
+  Delivery *delivery = static_cast<Delivery *>(arg);
+  Room *room = delivery->room;
+  MessageQueue::OverflowStats stats;
+  deliver(*delivery, delivery->snapshot->partitions[partition], stats);
+  if (stats.any()) {
+    Guard guard(room->lock);
+    room->overflow.add(stats);
+  }
+  if (delivery->pending.fetch_sub(1) != 1) {
+    return;
+  }
+
+  release_frames(*delivery);
+  room->fanout->record(delivery->snapshot->users.size(), monotonic_nanos() - delivery->start, true);
+  delivery->release();
+  room->fanouts_pending.fetch_sub(1);
+  room->unref();
+}
+
+/**
+ * Drops the broadcast's own references to the Frames of a batch.
+ */
+void Room::release_frames(const Delivery &delivery) {
+  for (int format = 0; format < NUM_DELIVERY_FORMATS; format++) {
+    Frame *const *frames = delivery.frames_in(DeliveryFormat(format));
+    for (size_t i = 0; i < delivery.num_frames[format]; i++) {
+      frames[i]->unref();
+    }
+  }
+}
+
+/**
+ * Publishes an encoded batch into the ring, which takes over its
+ * Frames. If that reuses slots some member may not have read yet,
+ * each member's queue makes sure it has (see MessageQueue::make_room).
+ * Only the broadcast draining the deliveries calls this, so batches
+ * are published one at a time, in the order they were numbered.
+ *
+ * @param delivery The batch.
+ * @param stats Counts the overflows of members' queues.
+ * @return The number of members.
+ */
+size_t Room::publish_to_ring(const Delivery &delivery, MessageQueue::OverflowStats &stats) {
+  // every member of the snapshot has its cursor: insert_member attaches
+  // it first, and remove_member detaches it once no snapshot is in use;
+  // members who joined after the batch was encoded read from after it
+  MemberSnapshot snapshot = std::atomic_load(&members);
+  const std::vector<User *> &users = snapshot->users;
+  uint64_t first_seq = delivery.first_seq;
+  uint64_t last_seq = first_seq + delivery.count - 1;
+  if (ring->needs_gate(last_seq)) {
+    uint64_t evicted = last_seq - ring->get_capacity();
+    uint64_t gate = first_seq;
+    for (User *user : users) {
+      gate = std::min(gate, user->mqueue.make_room(evicted, stats));
+    }
+    ring->set_gate(gate);
+  }
+
+  for (size_t i = 0; i < delivery.count; i++) {
+    Frame *frames[NUM_DELIVERY_FORMATS];
+    for (int format = 0; format < NUM_DELIVERY_FORMATS; format++) {
+      // a format nobody got when the batch was encoded has no Frames
+      frames[format] = nullptr;
+      if (delivery.num_frames[format] > 0) {
+        frames[format] = delivery.frames_in(DeliveryFormat(format))[i];
+      }
+    }
+    ring->publish(first_seq + i, frames);
+  }
+  return users.size();
+}
+
+namespace {
+
+void print_overflow(std::ostream &out, const MessageQueue::OverflowStats &stats) {
+  out << stats.dropped_oldest << " dropped oldest, " << stats.dropped_newest << " dropped newest, "
+      << stats.spilled << " spilled, " << stats.disconnects << " disconnected\n";
+}
+
+}
+
+/**
+ * Prints the overflow counters of the room, and of each member whose
+ * queue overflowed, unless nothing overflowed at all.
+ *
+ * @param out The stream to print to.
+ */
+void Room::report_stats(std::ostream &out) {
   Guard guard(lock);
-  for (User *user : members) {
-    user->mqueue.enqueue(new Message(TAG_DELIVERY, room_name + ":" + sender_username + ":" + message_text));
+  if (!overflow.any()) {
+    return;
+  }
+
+  // members of the current snapshot can't be removed while we hold the lock
+  out << "stats: room " << room_name << ": ";
+  print_overflow(out, overflow);
+  MemberSnapshot snapshot = std::atomic_load(&members);
+  for (User *user : snapshot->users) {
+    MessageQueue::OverflowStats stats = user->mqueue.get_overflow_stats();
+    if (stats.any()) {
+      out << "stats:   user " << user->username << ": ";
+      print_overflow(out, stats);
+    }
   }
 }
@@ -2,32 +2,200 @@
 #define ROOM_H
 
 #include <string>
-#include <set>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
 #include <pthread.h>
+#include "message_queue.h"
+#include "binary_frame.h"
+#include "room_log.h"
+#include "replay_ring.h"
 
 struct User;
+class LogCommitter;
+class FrameRing;
+class FanoutPool;
 
 // A Room object is a representation of a chat room.
 // At a minimum, it should keep track of the User objects representing
 // receivers who have joined the room.
+//
+// The members are published as immutable snapshots: joins and leaves
+// copy the current member list and swap in the modified copy, while
+// broadcasts iterate over whatever snapshot was current when they
+// started, without holding the room's lock.
+//
+// Broadcasts either enqueue the messages for every member, or, in the
+// ring delivery mode, publish them once into the room's FrameRing,
+// which the members' queues read from. Either way, every member gets
+// the messages in the order of their numbers: batches are numbered and
+// queued for delivery in one step, then encoded, and delivered one at
+// a time in that order by whichever broadcast finds the room idle,
+// without holding up the numbering of the next ones, or joins. For
+// rooms large enough, the
+// enqueueing is left to the workers of a FanoutPool, which deliver to
+// partitions of the members in parallel.
 class Room {
 public:
-  Room(const std::string &room_name);
+  // Messages are logged if committer is given, and the last
+  // replay_size of them are kept in memory for resuming receivers.
+  // If ring_size is not 0, messages are delivered through a ring of
+  // at least that many slots (and at least Batch::MAX_MESSAGES).
+  // Broadcasts are timed by fanout, and delivered by its workers
+  // if it says so.
+  Room(const std::string &room_name, LogCommitter *committer = nullptr, size_t replay_size = 0,
+       size_t ring_size = 0, FanoutPool *fanout = nullptr);
   ~Room();
 
   std::string get_room_name() const { return room_name; }
 
+  // Identifies the room in binary frames
+  uint32_t get_id() const { return id; }
+
+  // Rooms are reference counted: the server's room directory holds
+  // one reference, and each user who joined the room holds another.
+  // A new Room has one reference.
+  void ref() { refs.fetch_add(1, std::memory_order_relaxed); }
+  void unref();
+
+  // Returns true if nobody but the directory has referenced the room
+  // for at least grace seconds. The caller must make sure no new
+  // references can be taken meanwhile.
+  bool is_idle(int grace) const;
+
   void add_member(User *user);
+
+  // A joining member gets at most this many messages replayed
+  static const uint64_t MAX_HISTORY = 100000;
+
+  // Add user to the room, and have its queue replay the messages from
+  // the one numbered first_seq on before the live ones, so it gets
+  // every message from there on exactly once. The replay is produced a
+  // chunk at a time as the user's queue is drained, from memory while
+  // the messages are still kept there, otherwise from the log (at most
+  // MAX_HISTORY old); if the room isn't logged, from the oldest one kept.
+  void add_member_since(User *user, uint64_t first_seq);
+
+  // The sequence number the next message sent to the room will get;
+  // the first one is 1 (unless the log has older ones)
+  uint64_t next_seq();
+
+  // Remove user from the room and take it over: it no longer touches
+  // its socket once this returns, and is destroyed once no broadcast
+  // can reach it anymore
   void remove_member(User *user);
 
-  void broadcast_message(const std::string &sender_username, const std::string &message_text);
+  // Deliver text (sent by sender) to all members
+  void broadcast_message(const User *sender, const char *text, size_t text_len);
+
+  // Deliver a batch of messages (sent by sender) to all members, in order
+  void broadcast_batch(const User *sender, const Batch::Entry *messages, size_t count);
+
+  // Commit the messages logged since the previous commit (called by
+  // the LogCommitter); the number of records and bytes committed are
+  // added to records and bytes
+  void commit_log(unsigned long &records, unsigned long &bytes);
+
+  // Print how often the members' queue overflow policy kicked in,
+  // for the room and each member (if it did at all)
+  void report_stats(std::ostream &out);
 
 private:
+  // An immutable list of members. Each snapshot keeps its successor
+  // alive, so while any broadcast still uses a snapshot, all newer
+  // ones are referenced, too: the users removed when a snapshot was
+  // replaced are retired with it, and destroyed along with it.
+  struct MemberList {
+    ~MemberList();
+
+    std::vector<User *> users;
+    size_t format_users[NUM_DELIVERY_FORMATS] = {}; // how many of them get each format
+
+    // with a FanoutPool's workers: the users by id modulo the number
+    // of workers, so a user is always in the same partition
+    std::vector<std::vector<User *>> partitions;
+    mutable std::shared_ptr<const MemberList> next;
+    mutable std::vector<User *> retired;
+  };
+  typedef std::shared_ptr<const MemberList> MemberSnapshot;
+
+  struct Delivery;
+  struct Replay;
+
+  void insert_member(User *user, uint64_t live_from);
+  void publish(const MemberSnapshot &current, const std::shared_ptr<MemberList> &updated);
+  size_t publish_to_ring(const Delivery &delivery, MessageQueue::OverflowStats &stats);
+  Frame *encode_message(DeliveryFormat format, uint64_t seq, uint32_t sender_id,
+                        const std::string &sender, const char *text, size_t text_len) const;
+  void encode(Delivery *delivery, const User *sender, const Batch::Entry *messages, size_t count);
+  void queue_delivery(Delivery *delivery);
+  bool mark_encoded(Delivery *delivery);
+  void drain_deliveries(MessageQueue::OverflowStats &stats);
+  void fan_out(Delivery *delivery, MessageQueue::OverflowStats &stats);
+  static void deliver(const Delivery &delivery, const std::vector<User *> &users,
+                      MessageQueue::OverflowStats &stats);
+  static void deliver_partition(void *arg, unsigned partition);
+  static void release_frames(const Delivery &delivery);
+  static size_t fill_replay(Frame **frames, size_t max, void *arg);
+  static void release_replay(void *arg);
+  static void replay_record(const RoomLog::Record &record, void *arg);
+
   std::string room_name;
+  const uint32_t id;
+  std::atomic<unsigned> refs;
+
+  // when the reference count last dropped to 1 (monotonic seconds)
+  std::atomic<long> idle_since;
+
+  // serializes joins and leaves, and protects overflow
   pthread_mutex_t lock;
 
-  typedef std::set<User *> UserSet;
-  UserSet members;
+  // overflows of members' queues caused by this room's broadcasts
+  MessageQueue::OverflowStats overflow;
+
+  // the current member list, only accessed with std::atomic_load/store
+  MemberSnapshot members;
+
+  // the room's log (nullptr if messages aren't logged), the committer
+  // which commits it, and whether a commit is scheduled already
+  RoomLog *log;
+  LogCommitter *committer;
+  std::atomic<bool> log_scheduled;
+
+  // numbers the messages (in the order they are logged, kept in
+  // recent, and queued for delivery); protects next_message_seq
+  // and recent
+  pthread_mutex_t seq_lock;
+  uint64_t next_message_seq;
+  ReplayRing recent;
+
+  // the ring messages are published into in the ring delivery mode,
+  // nullptr if they are enqueued for each member; only the broadcast
+  // draining the deliveries publishes
+  FrameRing *ring;
+
+  // the batches numbered but not handed to the members yet (encoded
+  // or not), in the order they were numbered, how many of them are
+  // still being encoded, and whether a broadcast is delivering them;
+  // protected by delivery_lock, which may be taken under seq_lock
+  pthread_mutex_t delivery_lock;
+  Delivery *deliveries_head;
+  Delivery *deliveries_tail;
+  size_t num_encoding;
+  bool draining;
+
+  // a broadcast delivering the batches hands over to one still
+  // encoding once it delivered this many besides the first
+  static const unsigned DRAIN_BUDGET = 8;
+
+  // times broadcasts and delivers those to large rooms (nullptr: none),
+  // and how many of this room's broadcasts its workers are delivering
+  // (only changed by the broadcast draining the deliveries, and by
+  // the worker finishing one)
+  FanoutPool *fanout;
+  std::atomic<unsigned> fanouts_pending;
 };
 
 #endif // ROOM_H
@@ -0,0 +1,172 @@
+#include <functional>
+#include "room.h"
+#include "room_directory.h"
+
+namespace {
+
+// Holds a read or write lock on a pthread_rwlock_t for the current scope
+class RWGuard {
+public:
+  RWGuard(pthread_rwlock_t &lock, bool write)
+    : lock(lock) {
+    if (write) {
+      pthread_rwlock_wrlock(&lock);
+    } else {
+      pthread_rwlock_rdlock(&lock);
+    }
+  }
+
+  ~RWGuard() {
+    pthread_rwlock_unlock(&lock);
+  }
+
+private:
+  RWGuard(const RWGuard &);
+  RWGuard &operator=(const RWGuard &);
+  pthread_rwlock_t &lock;
+};
+
+}
+
+/**
+ * Constructor for the RoomDirectory class.
+ */
+RoomDirectory::RoomDirectory()
+  : m_log_committer(nullptr)
+  , m_replay_size(0)
+  , m_ring_size(0)
+  , m_fanout(nullptr) {
+  for (unsigned i = 0; i < NUM_SHARDS; i++) {
+    pthread_rwlock_init(&m_shards[i].lock, nullptr);
+  }
+}
+
+/**
+ * Destructor for the RoomDirectory class.
+ * Drops the references to the rooms.
+ */
+RoomDirectory::~RoomDirectory() {
+  for (unsigned i = 0; i < NUM_SHARDS; i++) {
+    for (RoomMap::iterator j = m_shards[i].rooms.begin(); j != m_shards[i].rooms.end(); ++j) {
+      j->second->unref();
+    }
+    pthread_rwlock_destroy(&m_shards[i].lock);
+  }
+}
+
+/**
+ * Finds the room with the specified name.
+ *
+ * @param room_name The name of the room.
+ * @return A new reference to the Room object, or nullptr if it doesn't exist.
+ */
+Room *RoomDirectory::find(const std::string &room_name) {
+  Shard &shard = shard_for(room_name);
+  RWGuard guard(shard.lock, false);
+
+  RoomMap::iterator i = shard.rooms.find(room_name);
+  if (i == shard.rooms.end()) {
+    return nullptr;
+  }
+  i->second->ref();
+  return i->second;
+}
+
+/**
+ * Finds the room with the specified name, creating it if it doesn't exist.
+ *
+ * @param room_name The name of the room.
+ * @return A new reference to the Room object.
+ */
+Room *RoomDirectory::find_or_create(const std::string &room_name) {
+  Room *room = find(room_name);
+  if (room != nullptr) {
+    return room;
+  }
+
+  Shard &shard = shard_for(room_name);
+  RWGuard guard(shard.lock, true);
+
+  // another thread may have created it since we looked
+  Room *&slot = shard.rooms[room_name];
+  if (slot == nullptr) {
+    slot = new Room(room_name, m_log_committer, m_replay_size, m_ring_size, m_fanout);
+  }
+  slot->ref();
+  return slot;
+}
+
+/**
+ * Removes the rooms which have been idle for a while.
+ * Shards without idle rooms are only read-locked.
+ *
+ * @param grace How long (in seconds) a room must have been idle.
+ * @return The number of rooms removed.
+ */
+size_t RoomDirectory::reclaim(int grace) {
+  size_t removed = 0;
+  for (unsigned i = 0; i < NUM_SHARDS; i++) {
+    Shard &shard = m_shards[i];
+    bool any_idle = false;
+    {
+      RWGuard guard(shard.lock, false);
+      for (RoomMap::iterator j = shard.rooms.begin(); j != shard.rooms.end() && !any_idle; ++j) {
+        any_idle = j->second->is_idle(grace);
+      }
+    }
+    if (!any_idle) {
+      continue;
+    }
+
+    // nobody can take a new reference while we hold the write lock,
+    // so a room found idle stays unused until it is gone
+    RWGuard guard(shard.lock, true);
+    RoomMap::iterator j = shard.rooms.begin();
+    while (j != shard.rooms.end()) {
+      if (j->second->is_idle(grace)) {
+        j->second->unref();
+        j = shard.rooms.erase(j);
+        removed++;
+      } else {
+        ++j;
+      }
+    }
+  }
+  return removed;
+}
+
+/**
+ * Counts the rooms.
+ *
+ * @return The number of rooms in all shards.
+ */
+size_t RoomDirectory::size() {
+  size_t count = 0;
+  for (unsigned i = 0; i < NUM_SHARDS; i++) {
+    RWGuard guard(m_shards[i].lock, false);
+    count += m_shards[i].rooms.size();
+  }
+  return count;
+}
+
+/**
+ * Calls a function for every room.
+ *
+ * @param fn The function to call.
+ * @param arg The second argument passed to fn.
+ */
+void RoomDirectory::for_each(void (*fn)(Room *room, void *arg), void *arg) {
+  for (unsigned i = 0; i < NUM_SHARDS; i++) {
+    RWGuard guard(m_shards[i].lock, false);
+    for (RoomMap::iterator j = m_shards[i].rooms.begin(); j != m_shards[i].rooms.end(); ++j) {
+      fn(j->second, arg);
+    }
+  }
+}
+
+/**
+ * Returns the shard holding the room with the specified name.
+ */
+RoomDirectory::Shard &RoomDirectory::shard_for(const std::string &room_name) {
+  return m_shards[std::hash<std::string>()(room_name) % NUM_SHARDS];
+}
@@ -0,0 +1,84 @@
+#ifndef ROOM_DIRECTORY_H
+#define ROOM_DIRECTORY_H
+
+#include <string>
+#include <unordered_map>
+#include <pthread.h>
+class Room;
+class LogCommitter;
+class FanoutPool;
+
+// The server's rooms, indexed by name. Rooms are spread across a fixed
+// number of shards by the hash of their name, each shard being a hash
+// map with its own reader/writer lock. Looking up an existing room only
+// takes the read lock of its shard, so lookups never wait for each
+// other, and creating a room only blocks lookups within one shard.
+//
+// The directory holds a reference to each of its rooms.
+class RoomDirectory {
+public:
+  RoomDirectory();
+  ~RoomDirectory();
+
+  // Returns the room with the given name, or nullptr if there is none.
+  // The caller gets a new reference to the room, and must unref it.
+  Room *find(const std::string &room_name);
+
+  // Returns the room with the given name, creating it if necessary.
+  // The caller gets a new reference to the room, and must unref it.
+  Room *find_or_create(const std::string &room_name);
+
+  // Removes the rooms nobody has used for at least grace seconds
+  // (see Room::is_idle) and drops their references. Returns the
+  // number of rooms removed.
+  size_t reclaim(int grace);
+
+  // Have the messages of rooms created from now on logged, and
+  // committed by committer
+  void set_log_committer(LogCommitter *committer) { m_log_committer = committer; }
+
+  // Have rooms created from now on keep their last size messages
+  // in memory for replay
+  void set_replay_size(size_t size) { m_replay_size = size; }
+
+  // Have rooms created from now on deliver their messages through a
+  // ring of size slots (0: through the members' queues)
+  void set_ring_size(size_t size) { m_ring_size = size; }
+
+  // Have rooms created from now on time their broadcasts with fanout,
+  // and have its workers deliver them when the room is large
+  void set_fanout_pool(FanoutPool *fanout) { m_fanout = fanout; }
+
+  // Returns the number of rooms
+  size_t size();
+
+  // Calls fn(room, arg) for every room. The shard of the room is
+  // read-locked during the call, so fn must not create rooms.
+  void for_each(void (*fn)(Room *room, void *arg), void *arg);
+
+private:
+  // prohibit value semantics
+  RoomDirectory(const RoomDirectory &);
+  RoomDirectory &operator=(const RoomDirectory &);
+
+  static const unsigned NUM_SHARDS = 64;
+
+  typedef std::unordered_map<std::string, Room *> RoomMap;
+
+  // each shard on its own cache line(s), so that locking one
+  // doesn't slow down threads using its neighbours
+  struct alignas(64) Shard {
+    pthread_rwlock_t lock;
+    RoomMap rooms;
+  };
+
+  Shard &shard_for(const std::string &room_name);
+
+  Shard m_shards[NUM_SHARDS];
+  LogCommitter *m_log_committer;
+  size_t m_replay_size;
+  size_t m_ring_size;
+  FanoutPool *m_fanout;
+};
+
+#endif // ROOM_DIRECTORY_H
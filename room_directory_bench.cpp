@@ -0,0 +1,224 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <climits>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <unistd.h>
+#include <pthread.h>
+#include "guard.h"
+#include "room.h"
+#include "room_directory.h"
+
+// Measures how many room lookups many threads get done at once, the
+// way sessions look up the room of every join, leave and sendall:
+// each thread keeps finding a random room among many (creating it
+// the first time) and dropping the reference again. The sharded
+// RoomDirectory is compared with the single mutex-protected map the
+// server used before.
+
+namespace {
+
+// The server's rooms as they used to be kept: one map, one lock
+class GlobalRoomMap {
+public:
+  GlobalRoomMap() {
+    pthread_mutex_init(&m_lock, NULL);
+  }
+
+  ~GlobalRoomMap() {
+    for (auto &entry : m_rooms) {
+      entry.second->unref();
+    }
+    pthread_mutex_destroy(&m_lock);
+  }
+
+  Room *find_or_create(const std::string &room_name) {
+    Guard guard(m_lock);
+    Room *&room = m_rooms[room_name];
+    if (room == nullptr) {
+      room = new Room(room_name);
+    }
+    room->ref();
+    return room;
+  }
+
+private:
+  GlobalRoomMap(const GlobalRoomMap &);
+  GlobalRoomMap &operator=(const GlobalRoomMap &);
+
+  pthread_mutex_t m_lock;
+  std::map<std::string, Room *> m_rooms;
+};
+
+// What each thread of a run shares, and counts
+template <typename Directory>
+struct Run {
+  Directory *directory;
+  const std::vector<std::string> *room_names;
+  std::atomic<bool> stop;
+  std::atomic<unsigned long> lookups;
+};
+
+// The thread-local state of a run
+template <typename Directory>
+struct Worker {
+  Run<Directory> *run;
+  uint64_t random;
+  pthread_t thread;
+};
+
+/**
+ * Looks up random rooms until the run is stopped.
+ *
+ * @param arg The Worker.
+ * @return nullptr.
+ */
+template <typename Directory>
+void *look_up_rooms(void *arg) {
+  Worker<Directory> *worker = static_cast<Worker<Directory> *>(arg);
+  Run<Directory> *run = worker->run;
+  const std::vector<std::string> &names = *run->room_names;
+  uint64_t x = worker->random;
+  unsigned long lookups = 0;
+  while (!run->stop.load(std::memory_order_relaxed)) {
+    // xorshift64, cheap enough not to matter
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    Room *room = run->directory->find_or_create(names[x % names.size()]);
+    room->unref();
+    lookups++;
+  }
+  run->lookups.fetch_add(lookups);
+  return nullptr;
+}
+
+/**
+ * Runs num_threads threads looking up rooms in a directory.
+ *
+ * @param directory The directory.
+ * @param room_names The names of the rooms to look up.
+ * @param num_threads The number of threads.
+ * @param seconds How long to run.
+ * @return The number of lookups per second.
+ */
+template <typename Directory>
+double run_bench(Directory &directory, const std::vector<std::string> &room_names,
+                 int num_threads, int seconds) {
+  Run<Directory> run;
+  run.directory = &directory;
+  run.room_names = &room_names;
+  run.stop.store(false);
+  run.lookups.store(0);
+
+  std::vector<Worker<Directory>> workers(num_threads);
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < num_threads; i++) {
+    workers[i].run = &run;
+    workers[i].random = 0x9e3779b97f4a7c15ULL * (i + 1);
+    pthread_create(&workers[i].thread, NULL, look_up_rooms<Directory>, &workers[i]);
+  }
+  sleep(seconds);
+  run.stop.store(true);
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  return run.lookups.load() / elapsed;
+}
+
+void usage() {
+  std::cerr << "Usage: ./room_directory_bench [-t threads] [-r rooms] [-s seconds]\n"
+            << "  -t threads  number of threads looking up rooms (default: one per CPU)\n"
+            << "  -r rooms    number of rooms they look up (default: 1000)\n"
+            << "  -s seconds  how long each directory is measured (default: 2)\n";
+}
+
+/**
+ * Parses a decimal number given on the command line.
+ *
+ * @param text The text to parse.
+ * @param min The smallest value allowed.
+ * @param max The largest value allowed.
+ * @param value Set to the number, if it is valid.
+ * @return True if the number is valid.
+ */
+bool parse_number(const char *text, long min, long max, long &value) {
+  char *end;
+  errno = 0;
+  long parsed = strtol(text, &end, 10);
+  if (end == text || *end != '\0' || errno != 0 || parsed < min || parsed > max) {
+    return false;
+  }
+  value = parsed;
+  return true;
+}
+
+}
+
+int main(int argc, char **argv) {
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int num_threads = ncpus > 0 ? int(ncpus) : 1;
+  long num_rooms = 1000;
+  int seconds = 2;
+
+  int opt;
+  long value;
+  while ((opt = getopt(argc, argv, "t:r:s:")) != -1) {
+    switch (opt) {
+    case 't':
+      if (!parse_number(optarg, 1, 4096, value)) {
+        usage();
+        return 1;
+      }
+      num_threads = int(value);
+      break;
+    case 'r':
+      if (!parse_number(optarg, 1, LONG_MAX, num_rooms)) {
+        usage();
+        return 1;
+      }
+      break;
+    case 's':
+      if (!parse_number(optarg, 1, INT_MAX, value)) {
+        usage();
+        return 1;
+      }
+      seconds = int(value);
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (optind != argc) {
+    usage();
+    return 1;
+  }
+
+  std::vector<std::string> room_names;
+  for (long i = 0; i < num_rooms; i++) {
+    room_names.push_back("room" + std::to_string(i));
+  }
+
+  std::cout << num_threads << " threads, " << num_rooms << " rooms, " << seconds << " s each\n";
+  {
+    GlobalRoomMap rooms;
+    double rate = run_bench(rooms, room_names, num_threads, seconds);
+    std::cout << "one locked map:   " << (unsigned long) rate << " lookups/s\n";
+  }
+  {
+    RoomDirectory rooms;
+    double rate = run_bench(rooms, room_names, num_threads, seconds);
+    std::cout << "room directory:   " << (unsigned long) rate << " lookups/s\n";
+  }
+  return 0;
+}
@@ -0,0 +1,578 @@
+#include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "guard.h"
+#include "room_log.h"
+
+namespace {
+
+// Length of a record's header, up to and including the name length
+const size_t RECORD_HEADER = 17;
+
+// A segment file's name is its base sequence number in this many
+// digits, followed by one of these suffixes
+const size_t SEQ_DIGITS = 20;
+const char SEGMENT_SUFFIX[] = ".log";
+const char INDEX_SUFFIX[] = ".index";
+
+uint32_t get_le32(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return le32toh(v);
+}
+
+uint64_t get_le64(const char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return le64toh(v);
+}
+
+void put_le32(char *p, uint32_t v) {
+  v = htole32(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+void put_le64(char *p, uint64_t v) {
+  v = htole64(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+/**
+ * Computes the 32 bit FNV-1a hash of a block of bytes.
+ */
+uint32_t checksum(const char *data, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= uint8_t(data[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * Checks the record at the start of data, which has avail bytes.
+ *
+ * @return The length of the record, or 0 if it is incomplete or corrupt.
+ */
+size_t check_record(const char *data, size_t avail) {
+  if (avail < RECORD_HEADER) {
+    return 0;
+  }
+  size_t len = get_le32(data);
+  if (len < RECORD_HEADER || len > avail || uint8_t(data[16]) > len - RECORD_HEADER) {
+    return 0;
+  }
+  if (checksum(data + 8, len - 8) != get_le32(data + 4)) {
+    return 0;
+  }
+  return len;
+}
+
+/**
+ * Writes a buffer to a file at the specified offset, retrying
+ * after short writes and interruptions.
+ *
+ * @return True if the whole buffer was written.
+ */
+bool write_fully(int fd, const char *buf, size_t len, off_t off) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, off);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    buf += n;
+    len -= n;
+    off += n;
+  }
+  return true;
+}
+
+/**
+ * Makes the entries of a directory durable.
+ */
+void sync_dir(const std::string &dir) {
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+}
+
+/**
+ * Opens a room's log, recovering its state from the segments
+ * already in dir.
+ *
+ * @param dir The directory holding the room's segments.
+ */
+RoomLog::RoomLog(const std::string &dir)
+  : m_dir(dir)
+  , m_open(false)
+  , m_next_seq(1)
+  , m_fd(-1) {
+  pthread_mutex_init(&m_append_lock, NULL);
+  pthread_mutex_init(&m_segments_lock, NULL);
+  m_open = recover();
+  if (!m_open) {
+    std::cerr << "Error: could not open the log in " << m_dir << std::endl;
+  }
+}
+
+/**
+ * Destructor: commits whatever was appended last.
+ */
+RoomLog::~RoomLog() {
+  unsigned long records = 0;
+  unsigned long bytes = 0;
+  commit(records, bytes);
+  if (m_fd >= 0) {
+    close(m_fd);
+  }
+  pthread_mutex_destroy(&m_append_lock);
+  pthread_mutex_destroy(&m_segments_lock);
+}
+
+/**
+ * Appends messages to the buffer of records waiting to be committed.
+ *
+ * @param sender The username of the sender.
+ * @param messages The messages.
+ * @param count The number of messages.
+ * @return The sequence number of the first message.
+ */
+uint64_t RoomLog::append(const std::string &sender, const Batch::Entry *messages, size_t count) {
+  size_t name_len = std::min<size_t>(sender.length(), UINT8_MAX);
+
+  Guard guard(m_append_lock);
+  uint64_t first = m_next_seq;
+  for (size_t i = 0; i < count; i++) {
+    size_t len = RECORD_HEADER + name_len + messages[i].len;
+    size_t pos = m_pending.size();
+    m_pending.resize(pos + len);
+    char *p = &m_pending[pos];
+    put_le32(p, uint32_t(len));
+    put_le64(p + 8, m_next_seq++);
+    p[16] = char(name_len);
+    memcpy(p + RECORD_HEADER, sender.data(), name_len);
+    memcpy(p + RECORD_HEADER + name_len, messages[i].text, messages[i].len);
+    put_le32(p + 4, checksum(p + 8, len - 8));
+  }
+  return first;
+}
+
+/**
+ * Returns the sequence number the next message appended will get.
+ */
+uint64_t RoomLog::next_seq() {
+  Guard guard(m_append_lock);
+  return m_next_seq;
+}
+
+/**
+ * Writes the records appended since the previous commit to the last
+ * segment, starting a new segment first if it is full, and syncs it.
+ *
+ * @param records Incremented by the number of records committed.
+ * @param bytes Incremented by the number of bytes committed.
+ * @return True if successful, false if the records could not be written.
+ */
+bool RoomLog::commit(unsigned long &records, unsigned long &bytes) {
+  {
+    Guard guard(m_append_lock);
+    m_committing.swap(m_pending);
+  }
+  // only commit changes m_committing, readers hold m_append_lock
+  const std::string &chunk = m_committing;
+  if (chunk.empty()) {
+    return true;
+  }
+  if (!m_open) {
+    finish_commit();
+    return false;
+  }
+
+  // only commit changes the segment list, so it may read it unlocked
+  if (m_segments.back().size >= SEGMENT_SIZE) {
+    save_index(m_segments.back());
+    if (!start_segment(get_le64(chunk.data() + 8))) {
+      finish_commit();
+      return false;
+    }
+  }
+  const Segment &active = m_segments.back();
+  if (!write_fully(m_fd, chunk.data(), chunk.size(), off_t(active.size)) || fdatasync(m_fd) < 0) {
+    std::cerr << "Error: could not write the log in " << m_dir << ": " << strerror(errno) << std::endl;
+    finish_commit();
+    return false;
+  }
+
+  // index the new records
+  std::vector<IndexEntry> entries;
+  uint64_t last_indexed = active.index.empty() ? 0 : active.index.back().offset;
+  size_t count = 0;
+  for (size_t pos = 0; pos < chunk.size(); pos += get_le32(chunk.data() + pos)) {
+    uint64_t offset = active.size + pos;
+    if ((active.index.empty() && entries.empty()) || offset - last_indexed >= INDEX_INTERVAL) {
+      IndexEntry entry = { get_le64(chunk.data() + pos + 8), offset };
+      entries.push_back(entry);
+      last_indexed = offset;
+    }
+    count++;
+  }
+
+  {
+    Guard guard(m_segments_lock);
+    Segment &segment = m_segments.back();
+    segment.size += chunk.size();
+    segment.index.insert(segment.index.end(), entries.begin(), entries.end());
+  }
+  records += count;
+  bytes += chunk.size();
+  finish_commit();
+  return true;
+}
+
+/**
+ * Drops the records commit took, which are either committed or lost
+ * now, letting the next records reuse their buffer.
+ */
+void RoomLog::finish_commit() {
+  Guard guard(m_append_lock);
+  m_committing.clear();
+  if (m_pending.empty()) {
+    m_pending.swap(m_committing);
+  }
+}
+
+/**
+ * Finishes reading the log up to its end: visits the records from
+ * the one numbered first on which are not committed yet.
+ *
+ * @param first The sequence number of the first record to visit.
+ * @param visit Called for each record.
+ * @param arg Passed to visit.
+ * @return False, without calling visit, if records from first on have
+ *         been committed meanwhile and must be read by read first.
+ */
+bool RoomLog::read_uncommitted(uint64_t first, void (*visit)(const Record &record, void *arg), void *arg) {
+  Guard guard(m_append_lock);
+  const std::string *chunks[2] = { &m_committing, &m_pending };
+  uint64_t oldest = m_next_seq;
+  for (const std::string *chunk : chunks) {
+    if (!chunk->empty()) {
+      oldest = get_le64(chunk->data() + 8);
+      break;
+    }
+  }
+  if (first < oldest) {
+    return false;
+  }
+
+  for (const std::string *chunk : chunks) {
+    const char *data = chunk->data();
+    for (size_t pos = 0; pos < chunk->size(); pos += get_le32(data + pos)) {
+      Record record;
+      record.seq = get_le64(data + pos + 8);
+      if (record.seq >= first) {
+        record.name_len = uint8_t(data[pos + 16]);
+        record.name = data + pos + RECORD_HEADER;
+        record.text = record.name + record.name_len;
+        record.text_len = get_le32(data + pos) - RECORD_HEADER - record.name_len;
+        visit(record, arg);
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * Reads committed records, starting with the one numbered first.
+ * Each segment is mapped while its records are visited, and its
+ * sparse index tells where to start looking for the first record.
+ *
+ * @param first The sequence number of the first record to visit.
+ * @param max The maximum number of records to visit.
+ * @param visit Called for each record.
+ * @param arg Passed to visit.
+ * @return The number of records visited.
+ */
+size_t RoomLog::read(uint64_t first, size_t max, void (*visit)(const Record &record, void *arg), void *arg) {
+  size_t visited = 0;
+  uint64_t next = first;
+  while (visited < max && m_open) {
+    uint64_t base_seq;
+    size_t size;
+    uint64_t start = 0;
+    uint64_t following = 0; // base of the next segment, 0 if none
+    {
+      Guard guard(m_segments_lock);
+      size_t i = 0;
+      while (i + 1 < m_segments.size() && m_segments[i + 1].base_seq <= next) {
+        i++;
+      }
+      const Segment &segment = m_segments[i];
+      base_seq = segment.base_seq;
+      size = segment.size;
+      for (const IndexEntry &entry : segment.index) {
+        if (entry.seq > next) {
+          break;
+        }
+        start = entry.offset;
+      }
+      if (i + 1 < m_segments.size()) {
+        following = m_segments[i + 1].base_seq;
+      }
+    }
+
+    if (size > start) {
+      int fd = open(segment_path(base_seq, SEGMENT_SUFFIX).c_str(), O_RDONLY);
+      void *map = fd < 0 ? MAP_FAILED : mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+      if (fd >= 0) {
+        close(fd);
+      }
+      if (map == MAP_FAILED) {
+        std::cerr << "Error: could not map the log in " << m_dir << std::endl;
+        break;
+      }
+
+      const char *data = static_cast<const char *>(map);
+      size_t pos = start;
+      while (pos < size && visited < max) {
+        size_t len = check_record(data + pos, size - pos);
+        if (len == 0) {
+          break;
+        }
+        Record record;
+        record.seq = get_le64(data + pos + 8);
+        if (record.seq >= next) {
+          record.name_len = uint8_t(data[pos + 16]);
+          record.name = data + pos + RECORD_HEADER;
+          record.text = record.name + record.name_len;
+          record.text_len = len - RECORD_HEADER - record.name_len;
+          visit(record, arg);
+          visited++;
+          next = record.seq + 1;
+        }
+        pos += len;
+      }
+      munmap(map, size);
+    }
+
+    if (following == 0) {
+      break;
+    }
+    next = std::max(next, following);
+  }
+  return visited;
+}
+
+/**
+ * Returns the path of a segment's file with the specified suffix.
+ */
+std::string RoomLog::segment_path(uint64_t base_seq, const char *suffix) const {
+  char name[SEQ_DIGITS + 16];
+  snprintf(name, sizeof(name), "%020llu%s", static_cast<unsigned long long>(base_seq), suffix);
+  return m_dir + "/" + name;
+}
+
+/**
+ * Finds the segments in the log's directory, loads or rebuilds their
+ * indexes, and opens the last one for appending.
+ *
+ * @return True if successful.
+ */
+bool RoomLog::recover() {
+  if (mkdir(m_dir.c_str(), 0755) < 0 && errno != EEXIST) {
+    return false;
+  }
+
+  DIR *dir = opendir(m_dir.c_str());
+  if (dir == nullptr) {
+    return false;
+  }
+  std::vector<uint64_t> bases;
+  while (struct dirent *entry = readdir(dir)) {
+    const char *name = entry->d_name;
+    if (strlen(name) == SEQ_DIGITS + strlen(SEGMENT_SUFFIX) &&
+        strcmp(name + SEQ_DIGITS, SEGMENT_SUFFIX) == 0) {
+      bases.push_back(strtoull(name, nullptr, 10));
+    }
+  }
+  closedir(dir);
+  std::sort(bases.begin(), bases.end());
+
+  if (bases.empty()) {
+    return start_segment(1);
+  }
+
+  uint64_t last_seq = 0;
+  for (size_t i = 0; i < bases.size(); i++) {
+    Segment segment;
+    segment.base_seq = bases[i];
+    segment.size = 0;
+    bool last = i + 1 == bases.size();
+    if (last || !load_index(segment)) {
+      // the last segment's index is never saved, it grows with
+      // the segment; and its end may be torn
+      if (!scan_segment(segment, last_seq)) {
+        return false;
+      }
+      if (!last) {
+        save_index(segment);
+      }
+    }
+    m_segments.push_back(segment);
+  }
+  m_next_seq = std::max(m_segments.back().base_seq, last_seq + 1);
+
+  m_fd = open(segment_path(m_segments.back().base_seq, SEGMENT_SUFFIX).c_str(), O_RDWR);
+  return m_fd >= 0;
+}
+
+/**
+ * Reads a segment through mmap, building its index. Incomplete or
+ * corrupt records at the end are truncated.
+ *
+ * @param segment The segment, whose size and index are set.
+ * @param last_seq Set to the sequence number of the last record, if any.
+ * @return True if successful.
+ */
+bool RoomLog::scan_segment(Segment &segment, uint64_t &last_seq) {
+  int fd = open(segment_path(segment.base_seq, SEGMENT_SUFFIX).c_str(), O_RDWR);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return false;
+  }
+
+  size_t size = size_t(st.st_size);
+  size_t pos = 0;
+  if (size > 0) {
+    void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    const char *data = static_cast<const char *>(map);
+    while (size_t len = check_record(data + pos, size - pos)) {
+      if (segment.index.empty() || pos - segment.index.back().offset >= INDEX_INTERVAL) {
+        IndexEntry entry = { get_le64(data + pos + 8), pos };
+        segment.index.push_back(entry);
+      }
+      last_seq = get_le64(data + pos + 8);
+      pos += len;
+    }
+    munmap(map, size);
+  }
+
+  if (pos < size) {
+    std::cerr << "Warning: truncating " << (size - pos) << " bytes of incomplete records in "
+              << segment_path(segment.base_seq, SEGMENT_SUFFIX) << std::endl;
+    if (ftruncate(fd, off_t(pos)) < 0) {
+      close(fd);
+      return false;
+    }
+  }
+  close(fd);
+  segment.size = pos;
+  return true;
+}
+
+/**
+ * Loads the saved index of a full segment.
+ *
+ * @param segment The segment, whose size and index are set.
+ * @return True if successful, false if the index must be rebuilt.
+ */
+bool RoomLog::load_index(Segment &segment) {
+  struct stat st;
+  if (stat(segment_path(segment.base_seq, SEGMENT_SUFFIX).c_str(), &st) < 0) {
+    return false;
+  }
+  int fd = open(segment_path(segment.base_seq, INDEX_SUFFIX).c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  std::vector<char> buf(64 * 1024);
+  std::string data;
+  ssize_t n;
+  while ((n = ::read(fd, buf.data(), buf.size())) > 0) {
+    data.append(buf.data(), n);
+  }
+  close(fd);
+  if (n < 0 || data.size() % 16 != 0) {
+    return false;
+  }
+
+  for (size_t pos = 0; pos < data.size(); pos += 16) {
+    IndexEntry entry = { get_le64(&data[pos]), get_le64(&data[pos + 8]) };
+    segment.index.push_back(entry);
+  }
+  segment.size = size_t(st.st_size);
+  return true;
+}
+
+/**
+ * Saves the index of a segment, which must not grow anymore. The index
+ * isn't synced: if it gets lost, it is rebuilt from the segment.
+ */
+void RoomLog::save_index(const Segment &segment) {
+  std::string data(segment.index.size() * 16, '\0');
+  for (size_t i = 0; i < segment.index.size(); i++) {
+    put_le64(&data[i * 16], segment.index[i].seq);
+    put_le64(&data[i * 16 + 8], segment.index[i].offset);
+  }
+
+  std::string path = segment_path(segment.base_seq, INDEX_SUFFIX);
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || !write_fully(fd, data.data(), data.size(), 0)) {
+    std::cerr << "Error: could not write " << path << std::endl;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+/**
+ * Creates a new, empty segment and makes it the one commits append to.
+ *
+ * @param base_seq The sequence number of the segment's first record.
+ * @return True if successful.
+ */
+bool RoomLog::start_segment(uint64_t base_seq) {
+  int fd = open(segment_path(base_seq, SEGMENT_SUFFIX).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::cerr << "Error: could not create a segment in " << m_dir << std::endl;
+    return false;
+  }
+  sync_dir(m_dir);
+
+  if (m_fd >= 0) {
+    close(m_fd);
+  }
+  m_fd = fd;
+
+  Segment segment;
+  segment.base_seq = base_seq;
+  segment.size = 0;
+  Guard guard(m_segments_lock);
+  m_segments.push_back(segment);
+  return true;
+}
@@ -0,0 +1,128 @@
+#ifndef ROOM_LOG_H
+#define ROOM_LOG_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <pthread.h>
+#include "binary_frame.h"
+
+// A RoomLog is the durable, append-only record of the messages sent
+// to a room. Each message gets the next of the room's sequence
+// numbers, starting at 1.
+//
+// Appending only copies the message into a buffer in memory, so a
+// broadcast never waits for the disk. The buffered records are written
+// out and synced by commit, which the LogCommitter calls for every
+// room with new records once per commit interval: one write and one
+// fdatasync cover all messages appended meanwhile (group commit).
+//
+// The log is a directory of segment files, each named after the
+// sequence number of its first record. Once a segment has grown past
+// SEGMENT_SIZE, the next commit starts a new one. For every segment,
+// a sparse index maps the sequence number of a record about every
+// INDEX_INTERVAL bytes to its offset, so a read finds where to start
+// without scanning the whole segment; the index of a full segment is
+// saved next to it. Reads go through mmap.
+//
+// A record is (all fields little-endian):
+//
+//   offset  size
+//        0     4  length of the record, header included
+//        4     4  checksum (FNV-1a) of the rest of the record
+//        8     8  sequence number
+//       16     1  length of the sender's username
+//       17        username, then the text
+//
+// When a log is opened, the records at the end of its last segment
+// which weren't written completely are truncated.
+class RoomLog {
+public:
+  static const size_t SEGMENT_SIZE = 16 * 1024 * 1024;
+  static const size_t INDEX_INTERVAL = 4096;
+
+  // A record read from the log; name and text point into the mapped
+  // segment, so they are only valid during the visit
+  struct Record {
+    uint64_t seq;
+    const char *name;
+    size_t name_len;
+    const char *text;
+    size_t text_len;
+  };
+
+  // Open the log in dir, creating it if necessary; is_open
+  // tells whether that worked
+  RoomLog(const std::string &dir);
+  ~RoomLog();
+
+  bool is_open() const { return m_open; }
+
+  // Append messages from sender, which get consecutive sequence
+  // numbers; returns the first one. Doesn't perform any I/O.
+  uint64_t append(const std::string &sender, const Batch::Entry *messages, size_t count);
+
+  // Write the records appended since the previous commit to the
+  // segment and sync it; the number of records and bytes written are
+  // added to records and bytes. Returns false if that failed. Only
+  // one thread may commit at a time.
+  bool commit(unsigned long &records, unsigned long &bytes);
+
+  // The sequence number the next message will get
+  uint64_t next_seq();
+
+  // Call visit(record, arg) for up to max committed records, starting
+  // with the one numbered first (or the oldest one, if that is gone);
+  // returns the number of records visited
+  size_t read(uint64_t first, size_t max, void (*visit)(const Record &record, void *arg), void *arg);
+
+  // Once read has visited the committed records, visit the ones from
+  // first on which are still waiting to be committed. Returns false
+  // if records from first on were committed meanwhile, so read must
+  // be called again.
+  bool read_uncommitted(uint64_t first, void (*visit)(const Record &record, void *arg), void *arg);
+
+private:
+  // prohibit value semantics
+  RoomLog(const RoomLog &);
+  RoomLog &operator=(const RoomLog &);
+
+  struct IndexEntry {
+    uint64_t seq;
+    uint64_t offset;
+  };
+
+  struct Segment {
+    uint64_t base_seq;          // sequence number of its first record
+    size_t size;                // bytes committed
+    std::vector<IndexEntry> index;
+  };
+
+  std::string segment_path(uint64_t base_seq, const char *suffix) const;
+  bool recover();
+  bool scan_segment(Segment &segment, uint64_t &last_seq);
+  bool load_index(Segment &segment);
+  void save_index(const Segment &segment);
+  bool start_segment(uint64_t base_seq);
+  void finish_commit();
+
+  std::string m_dir;
+  bool m_open;
+
+  // protects the records appended but not committed yet: those
+  // commit is writing (m_committing), and the newer ones
+  pthread_mutex_t m_append_lock;
+  std::string m_committing;
+  std::string m_pending;
+  uint64_t m_next_seq;
+
+  // the file of the last segment, which commits append to
+  int m_fd;
+
+  // protects the segment list; the records in a segment's first
+  // size bytes are committed and never change
+  pthread_mutex_t m_segments_lock;
+  std::vector<Segment> m_segments;
+};
+
+#endif // ROOM_LOG_H
@@ -2,14 +2,179 @@
 #include <string>
 #include <sstream>
 #include <stdexcept>
+#include <poll.h>
 #include "csapp.h"
 #include "message.h"
 #include "connection.h"
 #include "client_util.h"
 
+namespace {
+
+// Maximum number of pipelined requests not acknowledged yet
+const unsigned long PIPELINE_WINDOW = 256;
+
+// The state of a pipelining sender
+struct Pipeline {
+  bool enabled = false;
+  unsigned long sent = 0;  // requests sent since pipelining started
+  unsigned long acked = 0; // requests acknowledged by the server
+};
+
+/**
+ * Handles an ack or error for pipelined requests.
+ *
+ * @param pipeline The pipelining state.
+ * @param reply A message received from the server.
+ * @return True if it was handled, false for any other message.
+ */
+bool handle_pipelined_reply(Pipeline &pipeline, const Message &reply) {
+  if (reply.tag == TAG_ACK) {
+    pipeline.acked = std::stoul(reply.data);
+    return true;
+  }
+  if (reply.tag == TAG_ERR) {
+    std::cerr << reply.data << std::endl; // "seq:error message"
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Receives the reply to a request. A pipelining sender first gets the
+ * acks and errors for its earlier requests, which are handled here.
+ *
+ * @param conn The connection to the server.
+ * @param pipeline The pipelining state.
+ * @param reply The reply.
+ * @return True if successful, false if nothing could be received.
+ */
+bool receive_reply(Connection &conn, Pipeline &pipeline, Message &reply) {
+  while (conn.receive(reply)) {
+    if (!pipeline.enabled || !handle_pipelined_reply(pipeline, reply)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Waits until a pipelining sender may have another request in flight.
+ *
+ * @param conn The connection to the server.
+ * @param pipeline The pipelining state.
+ * @return True if successful, false if the server could not be read.
+ */
+bool wait_for_window(Connection &conn, Pipeline &pipeline) {
+  while (pipeline.sent - pipeline.acked >= PIPELINE_WINDOW) {
+    Message reply;
+    if (!conn.receive(reply)) {
+      return false;
+    }
+    handle_pipelined_reply(pipeline, reply);
+  }
+  return true;
+}
+
+/**
+ * Sends a request other than quit and handles its reply; a pipelining
+ * sender doesn't wait for it, but for room in its window.
+ *
+ * @param conn The connection to the server.
+ * @param pipeline The pipelining state.
+ * @param msg The request.
+ * @param input What the user entered, for error messages.
+ * @return False if the server could not be read.
+ */
+bool send_request(Connection &conn, Pipeline &pipeline, const Message &msg, const std::string &input) {
+  if (pipeline.enabled && !wait_for_window(conn, pipeline)) {
+    std::cerr << "Message Receive Failure: ACK" << std::endl;
+    return false;
+  }
+
+  // Sending a Message
+  if (!conn.send(msg)) {
+    std::cerr << "Message Send Failure: SENDALL" << std::endl;
+    if (conn.get_last_result() == Connection::INVALID_MSG) { // message too long
+      std::cerr << "Message is too long" << std::endl;
+    }
+    return true;
+  }
+
+  // a pipelining sender doesn't wait for the reply
+  if (pipeline.enabled) {
+    pipeline.sent++;
+    return true;
+  }
+
+  Message received_msg = Message();
+  if (!conn.receive(received_msg)){
+    std::cerr << "Message Receive Failure: SENDALL " << input << std::endl;
+    return true;
+  }
+  if (received_msg.tag == TAG_ERR) {
+    std::cerr << received_msg.data << std::endl;
+  }
+  return true;
+}
+
+/**
+ * Checks whether more input can be read without blocking.
+ */
+bool input_pending() {
+  if (std::cin.rdbuf()->in_avail() > 0) {
+    return true;
+  }
+  struct pollfd pfd;
+  pfd.fd = STDIN_FILENO;
+  pfd.events = POLLIN;
+  return poll(&pfd, 1, 0) > 0;
+}
+
+/**
+ * Sends the messages collected into a batch: a single one is sent
+ * with sendall, more with sendbatch.
+ *
+ * @return False if the server could not be read.
+ */
+bool flush_batch(Connection &conn, Pipeline &pipeline, std::string &batch,
+                 size_t &batch_count, const std::string &last_input) {
+  if (batch_count == 0) {
+    return true;
+  }
+  Message msg = batch_count == 1 ? Message(TAG_SENDALL, batch.substr(2))
+                                 : Message(TAG_SENDBATCH, batch);
+  batch.clear();
+  batch_count = 0;
+  return send_request(conn, pipeline, msg, last_input);
+}
+
+void usage() {
+  std::cerr << "Usage: ./sender [-b] [-p] [server_address] [port] [username]\n"
+            << "  -b  use the binary protocol; messages read from a pipe\n"
+            << "      are sent in batches\n"
+            << "  -p  pipeline requests instead of waiting for each reply\n";
+}
+
+}
+
 int main(int argc, char **argv) {
-  if (argc != 4) {
-    std::cerr << "Usage: ./sender [server_address] [port] [username]\n";
+  Pipeline pipeline;
+  bool want_pipeline = false;
+  bool want_binary = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "bp")) != -1) {
+    if (opt == 'p') {
+      want_pipeline = true;
+    } else if (opt == 'b') {
+      want_binary = true;
+    } else {
+      usage();
+      return 1;
+    }
+  }
+
+  if (argc - optind != 3) {
+    usage();
     return 1;
   }
 
@@ -17,9 +182,18 @@ int main(int argc, char **argv) {
   int server_port;
   std::string username;
 
-  server_hostname = argv[1];
-  server_port = std::stoi(argv[2]);
-  username = argv[3];
+  server_hostname = argv[optind];
+  server_port = std::stoi(argv[optind + 1]);
+  username = argv[optind + 2];
+
+  // Lines arriving in bursts on a pipe go out as batches, made of
+  // whatever is buffered already
+  bool batching = want_binary && !isatty(STDIN_FILENO);
+  if (batching) {
+    std::ios::sync_with_stdio(false); // so in_avail knows what is buffered
+  }
+  std::string batch;
+  size_t batch_count = 0;
 
   // Connect to server
   Connection conn;
@@ -32,7 +206,7 @@ int main(int argc, char **argv) {
   }
 
   /* Start of: Send rlogin message */ 
-  Message slogin_msg = Message(TAG_SLOGIN, username);
+  Message slogin_msg = Message(TAG_SLOGIN, want_binary ? username + ":binary" : username);
   if (!conn.send(slogin_msg)) {
     std::cerr << "Message Send Failure: SLOGIN" << std::endl;
     return 2;
@@ -48,13 +222,47 @@ int main(int argc, char **argv) {
     std::cerr << slogin_msg_receive.data << std::endl; // output error message
     return 2;
   }
+  conn.set_binary(want_binary);
   /* End of: Send rlogin message */ 
 
+  // Ask the server not to reply to every request; servers which
+  // don't support it reply with an error, and we do without
+  if (want_pipeline) {
+    Message reply;
+    if (!conn.send(Message(TAG_PIPELINE, "")) || !conn.receive(reply)) {
+      std::cerr << "Message Failure: PIPELINE" << std::endl;
+      return 2;
+    }
+    pipeline.enabled = reply.tag == TAG_OK;
+  }
+
   while (true) {
     std::string input;
-    std::getline(std::cin, input);
+    if (!std::getline(std::cin, input)) {
+      input = "/quit"; // end of input
+    }
     Message msg = Message();
 
+    if (batching && input[0] != '/') {
+      std::string text = input.substr(0, BinaryHeader::MAX_PAYLOAD - 2);
+      if (!Batch::append(batch, text.data(), text.length())) {
+        if (!flush_batch(conn, pipeline, batch, batch_count, input)) {
+          return 2;
+        }
+        Batch::append(batch, text.data(), text.length());
+      }
+      batch_count++;
+      if (batch_count == Batch::MAX_MESSAGES || !input_pending()) {
+        if (!flush_batch(conn, pipeline, batch, batch_count, input)) {
+          return 2;
+        }
+      }
+      continue;
+    }
+    if (!flush_batch(conn, pipeline, batch, batch_count, input)) {
+      return 2;
+    }
+
     // Command Check
     if (input.substr(0, 6) == "/join ") {
       msg.tag = TAG_JOIN;
@@ -72,7 +280,7 @@ int main(int argc, char **argv) {
         return 2;
       }
       Message quit_msg = Message();
-      if (!conn.receive(quit_msg)) {
+      if (!receive_reply(conn, pipeline, quit_msg)) {
         std::cerr << "Message Receive Failure: QUIT" << std::endl;
         return 2;
       }
@@ -83,31 +291,15 @@ int main(int argc, char **argv) {
       return 0;
     } else if (input[0] != '/') { // Input is a delievery 
       msg.tag = TAG_SENDALL;
-      msg.data = input.substr(0, Message::MAX_LEN);
+      msg.data = input.substr(0, conn.is_binary() ? BinaryHeader::MAX_PAYLOAD : Message::MAX_LEN);
     } else {
       std::cerr << "Invalid commands: " << input << std::endl;
       continue;
     }
 
-    // Sending a Message
-    if (!conn.send(msg)) {
-      std::cerr << "Message Send Failure: SENDALL" << std::endl;
-      if (conn.get_last_result() == Connection::INVALID_MSG) { // message too long
-        std::cerr << "Message is too long" << std::endl;
-      }
-      continue;
-    }
-
-    Message received_msg = Message();
-    if (!conn.receive(received_msg)){
-      std::cerr << "Message Receive Failure: SENDALL " << input << std::endl;
-      continue;
+    if (!send_request(conn, pipeline, msg, input)) {
+      return 2;
     }
-    if (received_msg.tag == TAG_ERR) {
-      std::cerr << received_msg.data << std::endl;
-      continue;
-    }
-
   }
 
   conn.close();
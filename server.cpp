@@ -1,4 +1,5 @@
 #include <pthread.h>
+#include <poll.h>
 #include <iostream>
 #include <sstream>
 #include <memory>
@@ -6,11 +7,22 @@
 #include <vector>
 #include <cctype>
 #include <cassert>
+#include <cstdint>
+#include <algorithm>
 #include "message.h"
+#include "frame.h"
 #include "connection.h"
 #include "user.h"
 #include "room.h"
 #include "guard.h"
+#include "session.h"
+#include "event_loop.h"
+#include "uring_loop.h"
+#include "thread_pool.h"
+#include "session_scheduler.h"
+#include "block_pool.h"
+#include "log_committer.h"
+#include "fanout_pool.h"
 #include "server.h"
 
 ////////////////////////////////////////////////////////////////////////
@@ -24,115 +36,108 @@ struct ClientData {
   ~ClientData() { delete connection; }
 };
 
-////////////////////////////////////////////////////////////////////////
-// Client thread functions
-////////////////////////////////////////////////////////////////////////
+namespace {
 
+// Maximum number of deliveries a receiver thread writes with one writev
+const size_t MAX_DELIVERY_BATCH = 64;
 
 /**
- * Checks the validity of a room name.
- * A valid room name:
- * - is at least one character in length
- * - contains only letters (a-z or A-Z) or digits (0-9)
- * - is less than 255 characters
+ * Sends a reply in the protocol the client selected.
  *
- * @param roomName The room name to check for validity.
- * @return True if the room name is valid, false otherwise.
+ * @param clientConnection The Connection object for the client.
+ * @param session The client's Session, which encodes the reply.
+ * @param reply The reply.
+ * @return True if the reply was sent.
  */
-bool is_valid_room_username(const std::string &roomName) {
-  if (roomName.empty() || roomName.length()+1 > Message::MAX_LEN) {
-    return false; // Room name must not be empty
+bool send_reply(Connection *clientConnection, Session &session, const InlineMessage &reply) {
+  char encoded[Session::MAX_REPLY_SIZE];
+  size_t len = session.encode_reply(reply, encoded);
+  return len > 0 && clientConnection->send(encoded, len);
+}
+
+/**
+ * Waits until messages are queued for a receiver, or the receiver
+ * hangs up. The socket is watched along with the queue's eventfd,
+ * since a thread blocked on the queue alone would never notice a
+ * receiver disconnecting from a room nobody sends to.
+ *
+ * @param clientConnection The Connection object for the receiver client.
+ * @param queue The receiver's message queue.
+ * @return True if messages are available, false if the receiver is gone.
+ */
+bool wait_for_deliveries(Connection *clientConnection, MessageQueue &queue) {
+  int queue_fd = queue.get_notify_fd();
+  if (queue_fd < 0) {
+    return false;
   }
 
-  // Check if the room name contains only letters (a-z or A-Z) or digits (0-9)
-  for (char c : roomName) {
-    if (!std::isalnum(c)) {
-      return false; // Room name contains an invalid character
+  while (queue.arm_notify()) {
+    struct pollfd fds[2];
+    fds[0].fd = clientConnection->get_fd();
+    fds[0].events = POLLIN | POLLRDHUP;
+    fds[1].fd = queue_fd;
+    fds[1].events = POLLIN;
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+
+    if (fds[0].revents & (POLLHUP | POLLRDHUP | POLLERR)) {
+      return false;
+    }
+    if (fds[0].revents & POLLIN) {
+      // receivers don't send anything once they have joined a room,
+      // so whatever they do send is discarded
+      char buf[256];
+      ssize_t n = recv(fds[0].fd, buf, sizeof(buf), MSG_DONTWAIT);
+      if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        return false;
+      }
+    }
+    if (fds[1].revents & POLLIN) {
+      uint64_t count;
+      if (read(queue_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        return false;
+      }
     }
   }
+  return true;
+}
 
-  return true; // Room name is valid
 }
 
+////////////////////////////////////////////////////////////////////////
+// Client thread functions
+////////////////////////////////////////////////////////////////////////
+
 
 /**
  * Handles the communication with a sender client.
  *
  * @param clientConnection The Connection object for the sender client.
- * @param server The Server object managing the connections.
- * @param user The User object representing the sender.
+ * @param session The Session of the logged in sender.
  */
-void chat_with_sender(Connection *clientConnection, Server *server, User *user) {
+void chat_with_sender(Connection *clientConnection, Session &session) {
 
-  while (true) {
-    Message receivedMessage;
+  while (session.get_state() == Session::SENDER) {
+    MessageView receivedMessage;
     if (!clientConnection->receive(receivedMessage)) {
       // Handle error and terminate the thread
-      clientConnection->send(Message(TAG_ERR, "Error receiving message"));
+      send_reply(clientConnection, session, InlineMessage(TAG_ERR, "Error receiving message"));
       break;
     }
 
-    // Process received message from sender
-    std::string roomName = "";
-
-    if (receivedMessage.data.length() + 1 > receivedMessage.MAX_LEN) {
-      clientConnection->send(Message(TAG_ERR, "Message is too long"));
-    }
-
-    if (receivedMessage.tag == TAG_ERR) {
-      std::cerr << receivedMessage.data << std::endl;
-      return;
-    }
-
-    else if (receivedMessage.tag == TAG_JOIN) {
-      roomName = receivedMessage.data;
-      if (is_valid_room_username(roomName)) {
-        if (user->room_number.empty()) { // Assuming user already joined a room, first remove the user from the current room
-          Room *alreadyJoinedRoom = server->find_or_create_room(user->room_number);
-          alreadyJoinedRoom->remove_member(user);
-        }
-
-        Room *joinedRoom = server->find_or_create_room(roomName);
-        joinedRoom->add_member(user);
-        user->room_number = roomName;
-        clientConnection->send(Message(TAG_OK, "joined room"));
-      } else {
-        clientConnection->send(Message(TAG_ERR, "Invalid Room number"));
-      }
-    }
-
-    else if (receivedMessage.tag == TAG_SENDALL) {
-      if (!((user->room_number).empty())) { // Assuming the user is already joined a room
-        Room * joinedRoom = server->find_or_create_room(user->room_number);
-        std::string messageText = receivedMessage.data;
-        joinedRoom->broadcast_message(user->username, messageText);
-
-        clientConnection->send(Message(TAG_OK, "sent"));
-      } else {
-        clientConnection->send(Message(TAG_ERR, "Not joined any room"));
-      }
-
-    }
-    
-    else if (receivedMessage.tag == TAG_LEAVE) {
-      if (!(user->room_number.empty())) { // Assuming the user is already joined a room
-        roomName = user->room_number;
-        Room *joinedRoom = server->find_or_create_room(roomName);
-        joinedRoom->remove_member(user);
-        user->room_number = "";
-        clientConnection->send(Message(TAG_OK, "Left the room"));
-      } else {
-        clientConnection->send(Message(TAG_ERR, "Not in a room"));
-      }
-    }
-
-    else if (receivedMessage.tag == TAG_QUIT) {
-      clientConnection->send(Message(TAG_OK, "Bye"));
-      return;
+    InlineMessage reply;
+    if (session.handle(receivedMessage, reply)) {
+      send_reply(clientConnection, session, reply);
     }
 
-    else {
-      clientConnection->send(Message(TAG_ERR, "Invalid tag"));
+    // requests of a pipelining sender are acknowledged
+    // once there are no more to handle without blocking
+    if (!clientConnection->has_buffered_message() && session.take_ack(reply)) {
+      send_reply(clientConnection, session, reply);
     }
   }
 }
@@ -142,48 +147,55 @@ void chat_with_sender(Connection *clientConnection, Server *server, User *user)
  * Handles the communication with a receiver client.
  *
  * @param clientConnection The Connection object for the receiver client.
- * @param server The Server object managing the connections.
- * @param user The User object representing the receiver.
+ * @param session The Session of the logged in receiver.
  */
-void chat_with_receiver(Connection *clientConnection, Server *server, User *user) {
-  Message receivedMessage = Message();
-  Room *joinedRoom = nullptr;
+void chat_with_receiver(Connection *clientConnection, Session &session) {
+  MessageView receivedMessage;
 
   if (!clientConnection->receive(receivedMessage)) {
     // Handle error and terminate the thread
-    clientConnection->send(Message(TAG_ERR, "Error receiving message"));
+    send_reply(clientConnection, session, InlineMessage(TAG_ERR, "Error receiving message"));
     return;
   }
 
   // Joining a room
-  if (receivedMessage.tag == TAG_JOIN) {
-    std::string roomName = receivedMessage.data;
-    if (is_valid_room_username(roomName)) {
-      if (user->room_number.empty()) { // Assuming user already joined a room, first remove the user from the current room
-        Room *alreadyJoinedRoom = server->find_or_create_room(user->room_number);
-        alreadyJoinedRoom->remove_member(user);
+  InlineMessage reply;
+  if (session.handle(receivedMessage, reply)) {
+    send_reply(clientConnection, session, reply);
+  }
+  if (session.get_state() != Session::RECEIVER) {
+    return;
+  }
+
+  User *user = session.get_user();
+  user->mqueue.set_socket(clientConnection->get_fd());
+  Frame *frames[MAX_DELIVERY_BATCH];
+  while (true) {
+    // Take everything that is waiting (up to a limit) off the user's
+    // message queue, and write it out with a single system call
+    size_t count = 0;
+    while (count < MAX_DELIVERY_BATCH) {
+      Frame *frame = user->mqueue.try_dequeue();
+      if (frame == nullptr) {
+        break;
+      }
+      frames[count++] = frame;
+    }
+    if (count == 0) {
+      if (user->mqueue.is_disconnected() || !wait_for_deliveries(clientConnection, user->mqueue)) {
+        return; // disconnected for falling behind, or hung up
       }
+      continue;
+    }
 
-      joinedRoom = server->find_or_create_room(roomName);
-      joinedRoom->add_member(user);
-      user->room_number = roomName;
-      clientConnection->send(Message(TAG_OK, "joined room"));
-    } else {
-      clientConnection->send(Message(TAG_ERR, "Invalid Room number"));
+    bool sent = clientConnection->send(frames, count);
+    for (size_t i = 0; i < count; i++) {
+      frames[i]->unref();
     }
-  } else {
-    clientConnection->send(Message(TAG_ERR, "Tag Error"));
-  }
-  
-  while (true) {
-    // Dequeue the next message from the user's message queue
-    Message *broadcastedMsg = user->mqueue.dequeue();
-    if (broadcastedMsg != nullptr) {
-      clientConnection->send(*broadcastedMsg);
-      delete(broadcastedMsg);
+    if (!sent) {
+      return;
     }
   }
-  joinedRoom->remove_member(user);
 }
 
 namespace {
@@ -201,35 +213,33 @@ void *worker(void *arg) {
   ClientData *clientData = static_cast<ClientData *>(arg);
   Connection *clientConnection = clientData->connection;
   Server *server = clientData->server;
+  Session session(server);
 
   // Error Catching during login
-  Message loginMessage;
-  if (!clientConnection->receive(loginMessage) || 
-      (loginMessage.tag != TAG_SLOGIN && loginMessage.tag != TAG_RLOGIN)) {
+  MessageView loginMessage;
+  if (!clientConnection->receive(loginMessage)) {
     // Handle error and terminate the thread
-    clientConnection->send(Message(TAG_ERR, "Login Message Receive Error"));
+    clientConnection->send(InlineMessage(TAG_ERR, "Login Message Receive Error"));
+    delete clientData;
     return nullptr;
   }
 
-  if (!is_valid_room_username(loginMessage.data)) {
-    clientConnection->send(Message(TAG_ERR, "Invalid username"));
-    return nullptr;
+  InlineMessage reply;
+  if (session.handle(loginMessage, reply)) {
+    send_reply(clientConnection, session, reply);
   }
+  clientConnection->set_binary(session.is_binary());
 
   // Depending on the login type, call the appropriate chat function
-  User *user = new User(loginMessage.data);
-  if (loginMessage.tag == TAG_SLOGIN) {
-    clientConnection->send(Message(TAG_OK, "Logged in as a sender: " + user->username));
-    chat_with_sender(clientConnection, server, user);
-  } else if (loginMessage.tag == TAG_RLOGIN) {
-    clientConnection->send(Message(TAG_OK, "Logged in as a receiver: " + user->username));
-    chat_with_receiver(clientConnection, server, user);
-  } else {
-    clientConnection->send(Message(TAG_ERR, "Invalid tag for login"));
-    return nullptr;
+  if (session.get_state() == Session::SENDER) {
+    chat_with_sender(clientConnection, session);
+  } else if (session.get_state() == Session::RECEIVER_JOIN) {
+    chat_with_receiver(clientConnection, session);
   }
 
-
+  // the user must have left its room before the socket is closed
+  session.close();
+  delete clientData;
   return nullptr;
 
 }
@@ -244,84 +254,373 @@ void *worker(void *arg) {
  * Initializes the server with the specified port and initializes the mutex.
  *
  * @param port The port number to bind the server socket.
+ * @param options How client connections should be handled.
  */
-Server::Server(int port)
+Server::Server(int port, const ServerOptions &options)
   : m_port(port)
-  , m_ssock(-1) {
-  pthread_mutex_init(&m_lock, nullptr);
+  , m_ssock(-1)
+  , m_reclaimed_rooms(0)
+  , m_live_sessions(0)
+  , m_live_users(0)
+  , m_options(options)
+  , m_next_loop(0)
+  , m_pool(nullptr)
+  , m_scheduler(nullptr)
+  , m_log_committer(nullptr)
+  , m_fanout(nullptr) {
 }
 
 /**
  * Destructor for the Server class.
- * Destroys the mutex.
  */
 Server::~Server() {
-  pthread_mutex_destroy(&m_lock);
+}
+
+namespace {
+/**
+ * Prints the statistics of one room (RoomDirectory::for_each callback).
+ */
+void report_room_stats(Room *room, void *out) {
+  room->report_stats(*static_cast<std::ostream *>(out));
+}
+
+/**
+ * Opens a listening socket on port with SO_REUSEPORT set, so several
+ * sockets can be bound to the same port.
+ *
+ * @param port The port number to listen on.
+ * @return The socket, or -1 on failure.
+ */
+int open_reuseport_listenfd(int port) {
+  struct addrinfo hints, *listp, *p;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+  if (getaddrinfo(NULL, std::to_string(port).c_str(), &hints, &listp) != 0) {
+    return -1;
+  }
+
+  int listenfd = -1;
+  for (p = listp; p; p = p->ai_next) {
+    listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (listenfd < 0) {
+      continue;
+    }
+
+    int optval = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) == 0 &&
+        bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
+      break;
+    }
+    close(listenfd);
+    listenfd = -1;
+  }
+  freeaddrinfo(listp);
+
+  if (listenfd >= 0 && ::listen(listenfd, LISTENQ) < 0) {
+    close(listenfd);
+    return -1;
+  }
+  return listenfd;
+}
 }
 
 /**
  * Starts listening for client connections on the server socket.
- * Uses open_listenfd to create the server socket.
+ * Uses open_listenfd to create the server socket, or opens one
+ * SO_REUSEPORT socket per acceptor if there are several.
  *
  * @return True if successful, false otherwise.
  */
 bool Server::listen() {
-  m_ssock = open_listenfd(std::to_string(m_port).c_str());
+  for (int i = 0; i < m_options.num_acceptors; i++) {
+    int fd;
+    if (m_options.num_acceptors == 1) {
+      fd = open_listenfd(std::to_string(m_port).c_str());
+    } else {
+      fd = open_reuseport_listenfd(m_port);
+    }
 
-  if (m_ssock < 0) {
-    std::cerr << "Error: Failed to create server socket\n";
-    return false;
+    if (fd < 0) {
+      std::cerr << "Error: Failed to create server socket\n";
+      return false;
+    }
+
+    Acceptor *acceptor = new Acceptor();
+    acceptor->server = this;
+    acceptor->index = i;
+    acceptor->fd = fd;
+    acceptor->accepts = 0;
+    acceptor->last_reported = 0;
+    m_acceptors.push_back(acceptor);
   }
 
+  m_ssock = m_acceptors[0]->fd;
   return true;
 }
 
-
 /**
- * Handles client connection requests.
- * Accepts client connections and spawns a new thread for each client.
+ * Handles client connection requests, using the mode selected
+ * by the server options. The current thread serves as the first
+ * acceptor, the others get their own threads.
  */
 void Server::handle_client_requests() {
+  clock_gettime(CLOCK_MONOTONIC, &m_last_report);
+  m_rooms.set_replay_size(m_options.replay_size);
+  m_rooms.set_ring_size(m_options.ring_size);
+  if (!m_options.log_dir.empty()) {
+    m_log_committer = new LogCommitter(m_options.log_dir);
+    if (!m_log_committer->start()) {
+      return;
+    }
+    m_rooms.set_log_committer(m_log_committer);
+  }
+  if (m_options.fanout_threshold > 0 || m_options.stats_interval > 0) {
+    // without parallel fan-out, the pool only times the broadcasts
+    m_fanout = new FanoutPool(m_options.fanout_threshold, m_options.fanout_workers);
+    if (!m_fanout->start()) {
+      return;
+    }
+    m_rooms.set_fanout_pool(m_fanout);
+  }
+  if (m_options.stats_interval > 0) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, run_stats_reporter, this) != 0) {
+      std::cerr << "Pthread Creation Error" << std::endl;
+      return;
+    }
+    pthread_detach(tid);
+  }
+
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, run_room_reaper, this) != 0) {
+    std::cerr << "Pthread Creation Error" << std::endl;
+    return;
+  }
+  pthread_detach(tid);
+
+  if (m_options.mode == ServerOptions::MODE_URING) {
+    if (UringLoop::is_supported()) {
+      handle_uring_loops();
+      return;
+    }
+    std::cerr << "io_uring is not supported, falling back to epoll" << std::endl;
+    m_options.mode = ServerOptions::MODE_EPOLL;
+  }
+
+  if (m_options.mode == ServerOptions::MODE_EPOLL && !start_event_loops()) {
+    return;
+  }
+  if (m_options.mode == ServerOptions::MODE_POOL && !start_pool()) {
+    return;
+  }
+
+  for (size_t i = 1; i < m_acceptors.size(); i++) {
+    if (pthread_create(&m_acceptors[i]->thread, NULL, run_acceptor, m_acceptors[i]) != 0) {
+      std::cerr << "Pthread Creation Error" << std::endl;
+      return;
+    }
+  }
+  accept_connections(m_acceptors[0]);
+}
+
+/**
+ * Thread function printing statistics periodically.
+ *
+ * @param arg The Server object.
+ * @return nullptr.
+ */
+void *Server::run_stats_reporter(void *arg) {
+  Server *server = static_cast<Server *>(arg);
   while (true) {
-    int client_fd = Accept(m_ssock, nullptr, nullptr);
+    sleep(server->m_options.stats_interval);
+    server->report_stats(std::cerr);
+  }
+  return nullptr;
+}
+
+/**
+ * Thread function periodically removing the rooms which have been
+ * unused for longer than the grace period.
+ *
+ * @param arg The Server object.
+ * @return nullptr.
+ */
+void *Server::run_room_reaper(void *arg) {
+  Server *server = static_cast<Server *>(arg);
+  int grace = server->m_options.room_grace;
+  while (true) {
+    sleep(std::max(1, grace / 4));
+    size_t removed = server->m_rooms.reclaim(grace);
+    server->m_reclaimed_rooms.fetch_add(removed, std::memory_order_relaxed);
+  }
+  return nullptr;
+}
+
+void *Server::run_acceptor(void *arg) {
+  Acceptor *acceptor = static_cast<Acceptor *>(arg);
+  acceptor->server->accept_connections(acceptor);
+  return nullptr;
+}
+
+/**
+ * Accepts client connections from one listening socket and hands
+ * each of them over to the selected mode.
+ *
+ * @param acceptor The listening socket to accept from.
+ */
+void Server::accept_connections(Acceptor *acceptor) {
+  while (true) {
+    int client_fd = Accept(acceptor->fd, nullptr, nullptr);
     if (client_fd < 0) {
       std::cerr << "Client connection accept error" << std::endl;
       return;
     }
 
-    // Create a new Connection object for the client
-    Connection *client_connection = new Connection(client_fd);
+    acceptor->accepts.fetch_add(1, std::memory_order_relaxed);
+    dispatch(client_fd);
+  }
+}
 
-    ClientData *clientdata = new ClientData{client_connection, this};
+/**
+ * Hands over an accepted client connection: spawns a new thread for it
+ * in MODE_THREADED, or passes it to an event loop or the scheduler.
+ *
+ * @param client_fd The client socket.
+ */
+void Server::dispatch(int client_fd) {
+  if (m_options.mode == ServerOptions::MODE_EPOLL) {
+    unsigned next = m_next_loop.fetch_add(1, std::memory_order_relaxed);
+    m_loops[next % m_loops.size()]->add_connection(client_fd);
+    return;
+  }
 
-    pthread_t tid;
-    if (pthread_create(&tid, NULL, worker, clientdata) != 0) {
-      std::cerr << "Pthread Creation Error" << std::endl;
-      return;
+  if (m_options.mode == ServerOptions::MODE_POOL) {
+    m_scheduler->add_connection(client_fd);
+    return;
+  }
+
+  // Create a new Connection object for the client
+  Connection *client_connection = new Connection(client_fd);
+
+  ClientData *clientdata = new ClientData{client_connection, this};
+
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, worker, clientdata) != 0) {
+    std::cerr << "Pthread Creation Error" << std::endl;
+    delete clientdata;
+  }
+}
+
+/**
+ * Starts the event loop threads, which accepted client connections
+ * are handed over to in round-robin order.
+ *
+ * @return True if successful, false otherwise.
+ */
+bool Server::start_event_loops() {
+  for (int i = 0; i < m_options.num_threads; i++) {
+    EventLoop *loop = new EventLoop(this);
+    if (!loop->start()) {
+      delete loop;
+      return false;
+    }
+    m_loops.push_back(loop);
+  }
+  return true;
+}
+
+/**
+ * Starts the io_uring loop threads, which accept client connections
+ * themselves, and waits for them. Loop i accepts from listening
+ * socket i (modulo the number of acceptors); there is at least one
+ * loop per socket, so that none is left without an accepter.
+ */
+void Server::handle_uring_loops() {
+  int num_loops = std::max(m_options.num_threads, int(m_acceptors.size()));
+  for (int i = 0; i < num_loops; i++) {
+    Acceptor *acceptor = m_acceptors[i % m_acceptors.size()];
+    UringLoop *loop = new UringLoop(this, acceptor->fd, &acceptor->accepts);
+    if (!loop->start()) {
+      delete loop;
+      break;
+    }
+    m_uring_loops.push_back(loop);
+  }
+
+  for (UringLoop *loop : m_uring_loops) {
+    loop->join();
+  }
+}
+
+/**
+ * Starts the worker pool and the session scheduler, which accepted
+ * client connections are handed over to.
+ *
+ * @return True if successful, false otherwise.
+ */
+bool Server::start_pool() {
+  m_pool = new ThreadPool(m_options.num_threads, m_options.pin_threads);
+  m_scheduler = new SessionScheduler(this, m_pool);
+  return m_pool->start() && m_scheduler->start();
+}
+
+/**
+ * Prints the statistics gathered since the previous call.
+ *
+ * @param out The stream to print to.
+ */
+void Server::report_stats(std::ostream &out) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = (now.tv_sec - m_last_report.tv_sec) + (now.tv_nsec - m_last_report.tv_nsec) / 1e9;
+  m_last_report = now;
+
+  for (Acceptor *acceptor : m_acceptors) {
+    unsigned long accepts = acceptor->accepts.load(std::memory_order_relaxed);
+    out << "stats: acceptor " << acceptor->index << ": " << accepts << " accepts, "
+        << (accepts - acceptor->last_reported) / elapsed << "/s\n";
+    acceptor->last_reported = accepts;
+  }
+
+  out << "stats: live: " << m_live_sessions.load(std::memory_order_relaxed) << " sessions, "
+      << m_live_users.load(std::memory_order_relaxed) << " users, "
+      << m_rooms.size() << " rooms (" << m_reclaimed_rooms.load(std::memory_order_relaxed)
+      << " reclaimed)\n";
+
+  for (const BlockPool::ClassStats &pool : BlockPool::get_stats()) {
+    if (pool.allocs == 0 && pool.resident == 0) {
+      continue;
     }
+    out << "stats: pool: " << pool.block_size << " byte blocks: " << pool.allocs << " allocs, "
+        << (pool.allocs ? 100.0 * pool.hits / pool.allocs : 0.0) << "% cache hits, "
+        << pool.resident / 1024 << " KiB resident, " << pool.free / 1024 << " KiB free\n";
+  }
+
+  if (m_log_committer != nullptr) {
+    LogCommitter::Stats log = m_log_committer->get_stats();
+    out << "stats: log: " << log.records << " records, " << log.bytes / 1024 << " KiB committed, "
+        << log.syncs << " syncs in " << log.rounds << " group commits\n";
+  }
+
+  if (m_fanout != nullptr) {
+    m_fanout->report(out);
   }
+
+  m_rooms.for_each(report_room_stats, &out);
+  out.flush();
 }
 
 /**
  * Finds or creates a Room object with the specified room name.
  * If the room already exists, returns a pointer to the existing Room.
  * If the room doesn't exist, creates a new Room and returns a pointer to it.
+ * The caller must unref the Room once it no longer needs it.
  *
  * @param room_name The name of the room.
- * @return A pointer to the Room object.
+ * @return A new reference to the Room object.
  */
 Room *Server::find_or_create_room(const std::string &room_name) {
-  Guard guard(m_lock);
-
-  // Check if the room already exists
-  auto it = m_rooms.find(room_name);
-  if (it != m_rooms.end()) {
-    return it->second;
-  }
-
-  // Create a new room if it doesn't exist
-  Room *newRoomPtr = new Room(room_name);
-  m_rooms[room_name] = std::move(newRoomPtr);
-
-  return newRoomPtr;
+  return m_rooms.find_or_create(room_name);
 }
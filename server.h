@@ -1,14 +1,87 @@
 #ifndef SERVER_H
 #define SERVER_H
 
-#include <map>
 #include <string>
+#include <vector>
+#include <atomic>
+#include <ostream>
 #include <pthread.h>
+#include <time.h>
+#include "message_queue.h"
+#include "room_directory.h"
 class Room;
+class EventLoop;
+class UringLoop;
+class ThreadPool;
+class SessionScheduler;
+class LogCommitter;
+class FanoutPool;
+
+// Run-time configuration of the server, set from the command line
+struct ServerOptions {
+  // How client connections are serviced
+  enum Mode {
+    MODE_THREADED, // one thread per client, blocking I/O
+    MODE_EPOLL,    // a fixed number of epoll event loop threads
+    MODE_URING,    // a fixed number of io_uring loop threads
+    MODE_POOL,     // sessions run as tasks on a work-stealing thread pool
+  };
+
+  Mode mode = MODE_EPOLL;
+
+  // Number of event loop threads (MODE_EPOLL and MODE_URING),
+  // or of worker threads (MODE_POOL)
+  int num_threads = 1;
+
+  // Pin each worker thread to a CPU (MODE_POOL)
+  bool pin_threads = false;
+
+  // Number of listening sockets, each bound with SO_REUSEPORT and
+  // served by its own acceptor thread (by its own io_uring loops
+  // in MODE_URING, which starts at least one loop per socket), so
+  // the kernel spreads connections across them
+  int num_acceptors = 1;
+
+  // Print statistics to stderr every this many seconds (0: never)
+  int stats_interval = 0;
+
+  // Maximum number of messages waiting in a receiver's queue (0: no
+  // limit), what happens to messages beyond that, whether that was
+  // given rather than the default, and where spill files are created
+  // (MessageQueue::SPILL)
+  size_t queue_limit = 0;
+  MessageQueue::OverflowPolicy overflow_policy = MessageQueue::DROP_OLDEST;
+  bool overflow_policy_set = false;
+  std::string spill_dir = "/tmp";
+
+  // Rooms left without members or senders for this many seconds
+  // are removed (and recreated if anybody joins them again)
+  int room_grace = 60;
+
+  // Log every room's messages to files in this directory (empty: no logs)
+  std::string log_dir;
+
+  // Keep this many of every room's last messages in memory, for
+  // receivers resuming after a reconnect
+  size_t replay_size = 1024;
+
+  // Deliver every room's messages through a ring of this many slots,
+  // which the receivers read from, rather than through their queues
+  // (0: queues). A receiver lagging a whole ring behind gets the
+  // messages it didn't read moved to its queue; only if an overflow
+  // policy was set, it is dropped by DISCONNECT, and loses the oldest
+  // messages with any other one.
+  size_t ring_size = 0;
+
+  // Broadcasts to rooms of at least this many receivers (0: none)
+  // are delivered by fanout_workers threads in parallel
+  size_t fanout_threshold = 0;
+  unsigned fanout_workers = 4;
+};
 
 class Server {
 public:
-  Server(int port);
+  Server(int port, const ServerOptions &options = ServerOptions());
   ~Server();
 
   bool listen();
@@ -17,19 +90,60 @@ public:
 
   Room *find_or_create_room(const std::string &room_name);
 
+  const ServerOptions &get_options() const { return m_options; }
+
+  // Print statistics gathered since the previous call
+  void report_stats(std::ostream &out);
+
+  // Sessions call these as they are created and destroyed, and as
+  // their users are, so the statistics can show how many are alive
+  void count_sessions(int delta) { m_live_sessions.fetch_add(delta, std::memory_order_relaxed); }
+  void count_users(int delta) { m_live_users.fetch_add(delta, std::memory_order_relaxed); }
+
 private:
   // prohibit value semantics
   Server(const Server &);
   Server &operator=(const Server &);
 
-  typedef std::map<std::string, Room *> RoomMap;
+  // A listening socket, and the thread accepting connections from it
+  struct Acceptor {
+    Server *server;
+    int index;
+    int fd;
+    pthread_t thread;
+    std::atomic<unsigned long> accepts;
+    unsigned long last_reported;
+  };
+
+  static void *run_stats_reporter(void *arg);
+  static void *run_room_reaper(void *arg);
+  static void *run_acceptor(void *arg);
+  void accept_connections(Acceptor *acceptor);
+  void dispatch(int client_fd);
+
+  bool start_event_loops();
+  bool start_pool();
+  void handle_uring_loops();
 
   // These member variables are sufficient for implementing
   // the server operations
   int m_port;
   int m_ssock;
-  RoomMap m_rooms;
-  pthread_mutex_t m_lock;
+  RoomDirectory m_rooms;
+  std::atomic<unsigned long> m_reclaimed_rooms;
+  std::atomic<long> m_live_sessions;
+  std::atomic<long> m_live_users;
+
+  ServerOptions m_options;
+  std::vector<Acceptor *> m_acceptors;
+  std::atomic<unsigned> m_next_loop;
+  struct timespec m_last_report;
+  std::vector<EventLoop *> m_loops;
+  std::vector<UringLoop *> m_uring_loops;
+  ThreadPool *m_pool;
+  SessionScheduler *m_scheduler;
+  LogCommitter *m_log_committer;
+  FanoutPool *m_fanout;
 };
 
 #endif // SERVER_H
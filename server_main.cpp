@@ -1,25 +1,204 @@
 #include <iostream>
+#include <string>
 #include <csignal>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <unistd.h>
 #include "server.h"
 
 // If you implement the Server class as described by its
 // TODO comments, you should not need to make any changes
 // to this main function.
 
+namespace {
+
+void usage() {
+  std::cerr << "Usage: server_main [-m threaded|epoll|uring|pool] [-t threads] [-p]\n"
+            << "                   [-a acceptors] [-s seconds] [-q limit]\n"
+            << "                   [-o drop-oldest|drop-newest|disconnect|spill] [-d dir]\n"
+            << "                   [-g seconds] [-l dir] [-r count] [-c slots]\n"
+            << "                   [-f members] [-w workers] <port>\n"
+            << "  -m mode     how clients are serviced (default: epoll);\n"
+            << "              uring falls back to epoll if io_uring is unavailable\n"
+            << "  -t threads  number of event loop or pool worker threads\n"
+            << "              (default: one per CPU)\n"
+            << "  -p          pin pool worker threads to CPUs\n"
+            << "  -a n        accept on n SO_REUSEPORT sockets, each with its\n"
+            << "              own acceptor thread (default: 1)\n"
+            << "  -s seconds  print statistics to stderr at this interval\n"
+            << "  -q limit    maximum number of messages queued for a receiver\n"
+            << "              (default: no limit)\n"
+            << "  -o policy   what happens to messages for a receiver whose queue\n"
+            << "              is full, or lags a whole ring behind (default:\n"
+            << "              drop-oldest for a full queue; a ring's messages are kept)\n"
+            << "  -d dir      directory for the spill policy's files (default: /tmp)\n"
+            << "  -g seconds  remove rooms nobody has used for this long (default: 60)\n"
+            << "  -l dir      log the messages of every room to files in dir\n"
+            << "  -r count    keep the last count messages of every room in memory for\n"
+            << "              resuming receivers (default: 1024)\n"
+            << "  -c slots    deliver every room's messages through a ring of this\n"
+            << "              many slots, rather than through receivers' queues\n"
+            << "  -f members  deliver broadcasts to rooms of at least this many\n"
+            << "              receivers from several threads in parallel\n"
+            << "  -w workers  number of threads delivering those (default: 4)\n";
+}
+
+/**
+ * Parses a decimal number given on the command line.
+ *
+ * @param text The text to parse.
+ * @param min The smallest value allowed.
+ * @param max The largest value allowed.
+ * @param value Receives the number.
+ * @return True if text is a number from min to max, false otherwise.
+ */
+bool parse_number(const char *text, long min, long max, long &value) {
+  char *end;
+  errno = 0;
+  long parsed = strtol(text, &end, 10);
+  if (end == text || *end != '\0' || errno != 0 || parsed < min || parsed > max) {
+    return false;
+  }
+  value = parsed;
+  return true;
+}
+
+}
+
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    std::cerr << "Usage: server_main <port>\n";
+  ServerOptions options;
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  options.num_threads = ncpus > 0 ? int(ncpus) : 1;
+
+  int opt;
+  long value;
+  while ((opt = getopt(argc, argv, "m:t:pa:s:q:o:d:g:l:r:c:f:w:")) != -1) {
+    switch (opt) {
+    case 'm':
+      if (std::string(optarg) == "threaded") {
+        options.mode = ServerOptions::MODE_THREADED;
+      } else if (std::string(optarg) == "epoll") {
+        options.mode = ServerOptions::MODE_EPOLL;
+      } else if (std::string(optarg) == "uring") {
+        options.mode = ServerOptions::MODE_URING;
+      } else if (std::string(optarg) == "pool") {
+        options.mode = ServerOptions::MODE_POOL;
+      } else {
+        usage();
+        return 1;
+      }
+      break;
+    case 't':
+      if (!parse_number(optarg, 1, INT_MAX, value)) {
+        usage();
+        return 1;
+      }
+      options.num_threads = int(value);
+      break;
+    case 'p':
+      options.pin_threads = true;
+      break;
+    case 'a':
+      if (!parse_number(optarg, 1, INT_MAX, value)) {
+        usage();
+        return 1;
+      }
+      options.num_acceptors = int(value);
+      break;
+    case 's':
+      if (!parse_number(optarg, 0, INT_MAX, value)) {
+        usage();
+        return 1;
+      }
+      options.stats_interval = int(value);
+      break;
+    case 'q':
+      if (!parse_number(optarg, 0, LONG_MAX, value)) {
+        usage();
+        return 1;
+      }
+      options.queue_limit = size_t(value);
+      break;
+    case 'o':
+      if (std::string(optarg) == "drop-oldest") {
+        options.overflow_policy = MessageQueue::DROP_OLDEST;
+      } else if (std::string(optarg) == "drop-newest") {
+        options.overflow_policy = MessageQueue::DROP_NEWEST;
+      } else if (std::string(optarg) == "disconnect") {
+        options.overflow_policy = MessageQueue::DISCONNECT;
+      } else if (std::string(optarg) == "spill") {
+        options.overflow_policy = MessageQueue::SPILL;
+      } else {
+        usage();
+        return 1;
+      }
+      options.overflow_policy_set = true;
+      break;
+    case 'd':
+      options.spill_dir = optarg;
+      break;
+    case 'g':
+      if (!parse_number(optarg, 0, INT_MAX, value)) {
+        usage();
+        return 1;
+      }
+      options.room_grace = int(value);
+      break;
+    case 'l':
+      options.log_dir = optarg;
+      break;
+    case 'r':
+      if (!parse_number(optarg, 0, LONG_MAX, value)) {
+        usage();
+        return 1;
+      }
+      options.replay_size = size_t(value);
+      break;
+    case 'c':
+      if (!parse_number(optarg, 0, LONG_MAX, value)) {
+        usage();
+        return 1;
+      }
+      options.ring_size = size_t(value);
+      break;
+    case 'f':
+      if (!parse_number(optarg, 0, LONG_MAX, value)) {
+        usage();
+        return 1;
+      }
+      options.fanout_threshold = size_t(value);
+      break;
+    case 'w':
+      if (!parse_number(optarg, 1, INT_MAX, value)) {
+        usage();
+        return 1;
+      }
+      options.fanout_workers = unsigned(value);
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  if (argc - optind != 1) {
+    usage();
     return 1;
   }
 
-  int port = std::stoi(argv[1]);
+  if (!parse_number(argv[optind], 1, 65535, value)) {
+    usage();
+    return 1;
+  }
+  int port = int(value);
 
   // ignore SIGPIPE: when the server sends data to the receive client,
   // it may find that the connection has been terminated (e.g., if the
   // receive client exited)
   signal(SIGPIPE, SIG_IGN);
 
-  Server server(port);
+  Server server(port, options);
   if (!server.listen()) {
     std::cerr << "Could not listen on port " << port << "\n";
     return 1;
@@ -0,0 +1,517 @@
+#include <iostream>
+#include <cctype>
+#include <cstdlib>
+#include <atomic>
+#include "message.h"
+#include "binary_frame.h"
+#include "user.h"
+#include "room.h"
+#include "server.h"
+#include "session.h"
+
+/**
+ * Checks the validity of a room name.
+ * A valid room name:
+ * - is at least one character in length
+ * - contains only letters (a-z or A-Z) or digits (0-9)
+ * - is less than 255 characters
+ *
+ * @param roomName The room name to check for validity.
+ * @return True if the room name is valid, false otherwise.
+ */
+bool is_valid_room_username(const std::string &roomName) {
+  if (roomName.empty() || roomName.length()+1 > Message::MAX_LEN) {
+    return false; // Room name must not be empty
+  }
+
+  // Check if the room name contains only letters (a-z or A-Z) or digits (0-9)
+  for (char c : roomName) {
+    if (!std::isalnum(c)) {
+      return false; // Room name contains an invalid character
+    }
+  }
+
+  return true; // Room name is valid
+}
+
+namespace {
+
+// Appended to the username in a login request to select the binary protocol
+const char BINARY_SUFFIX[] = ":binary";
+const size_t BINARY_SUFFIX_LEN = sizeof(BINARY_SUFFIX) - 1;
+
+// the id of the next user to log in
+std::atomic<uint32_t> next_user_id(1);
+
+/**
+ * Parses the history a receiver asks for after the room name in its
+ * join request: "last:N" (the last N messages) or "since:S" (the
+ * messages from the one numbered S on).
+ *
+ * @param spec The request's data after the room name and ':'.
+ * @param since Set to true for "since:S".
+ * @param count Set to N or S.
+ * @return True if spec is valid.
+ */
+bool parse_history(const std::string &spec, bool &since, uint64_t &count) {
+  size_t colon = spec.find(':');
+  if (colon == std::string::npos || colon + 1 == spec.length()) {
+    return false;
+  }
+  std::string kind = spec.substr(0, colon);
+  if (kind != "last" && kind != "since") {
+    return false;
+  }
+  for (size_t i = colon + 1; i < spec.length(); i++) {
+    if (!std::isdigit(static_cast<unsigned char>(spec[i]))) {
+      return false;
+    }
+  }
+  since = kind == "since";
+  count = std::strtoull(spec.c_str() + colon + 1, nullptr, 10);
+  return true;
+}
+
+}
+
+/**
+ * Constructor for the Session class.
+ *
+ * @param server The Server object managing the connections.
+ */
+Session::Session(Server *server)
+  : m_server(server)
+  , m_user(nullptr)
+  , m_state(LOGIN)
+  , m_binary(false)
+  , m_binary_replies(false)
+  , m_pipelined(false)
+  , m_seq(0)
+  , m_acked(0) {
+  m_server->count_sessions(1);
+}
+
+/**
+ * Destructor for the Session class.
+ * Ends the session if it is still active.
+ */
+Session::~Session() {
+  close();
+  m_server->count_sessions(-1);
+}
+
+/**
+ * Processes one request received from the client.
+ *
+ * @param request The message received from the client.
+ * @param reply The reply to send back to the client.
+ * @return True if reply should be sent, false if there is nothing to send.
+ */
+bool Session::handle(const MessageView &request, InlineMessage &reply) {
+  if (m_state == SENDER && m_pipelined) {
+    return handle_pipelined(request, reply);
+  }
+  return handle_request(request, reply);
+}
+
+/**
+ * Finds the next request in the data received from the client, which
+ * is a line or a binary frame, depending on the protocol the client
+ * selected. A binary frame announcing too long a payload ends the
+ * session, as the rest of the data can't be made sense of.
+ *
+ * @param buf The data received, but not processed yet.
+ * @param avail The length of the data.
+ * @param eof True if the client won't send any more data.
+ * @param request The request found, parsed in place.
+ * @return The length of the request, or 0 if there is no complete one.
+ */
+size_t Session::next_request(const char *buf, size_t avail, bool eof, MessageView &request) {
+  if (!m_binary) {
+    size_t len = Message::line_length(buf, avail, eof);
+    if (len > 0) {
+      request.parse(buf, len);
+    }
+    return len;
+  }
+
+  size_t len = BinaryHeader::frame_length(buf, avail);
+  if (len == BinaryHeader::INVALID) {
+    std::cerr << "Error: binary frame too long" << std::endl;
+    close();
+    return 0;
+  }
+  if (len > 0) {
+    BinaryHeader::parse(buf, request);
+  }
+  return len;
+}
+
+/**
+ * Encodes a reply in the protocol the client selected. The reply to
+ * the login is a text line even if the client selected the binary
+ * protocol; binary replies carry the ids of the user and its room.
+ *
+ * @param reply The reply.
+ * @param out Where to encode it, with room for MAX_REPLY_SIZE bytes.
+ * @return The length of the encoded reply, 0 if it is invalid.
+ */
+size_t Session::encode_reply(const InlineMessage &reply, char *out) {
+  static_assert(MAX_REPLY_SIZE >= BinaryHeader::SIZE + InlineMessage::CAPACITY &&
+                MAX_REPLY_SIZE >= Message::MAX_LEN, "MAX_REPLY_SIZE is too small");
+  bool binary = m_binary_replies;
+  m_binary_replies = m_binary;
+  if (!reply.is_valid()) {
+    return 0;
+  }
+  if (!binary) {
+    return reply.encode(out);
+  }
+
+  BinaryHeader header(reply.tag(), reply.data_length());
+  if (m_user != nullptr) {
+    header.user_id = m_user->id;
+    header.room_id = m_user->room != nullptr ? m_user->room->get_id() : 0;
+  }
+  header.encode(out);
+  memcpy(out + BinaryHeader::SIZE, reply.data(), reply.data_length());
+  return BinaryHeader::SIZE + reply.data_length();
+}
+
+/**
+ * Appends a reply, encoded like encode_reply does, to out.
+ */
+void Session::append_reply(const InlineMessage &reply, std::string &out) {
+  char encoded[MAX_REPLY_SIZE];
+  out.append(encoded, encode_reply(reply, encoded));
+}
+
+/**
+ * Returns an acknowledgment of the pipelined requests handled since
+ * the previous one, if there are any. Transports call this whenever
+ * they have handled all requests received so far, so a sender gets
+ * one ack per batch of requests rather than one per request.
+ *
+ * @param ack The acknowledgment to send to the client.
+ * @return True if ack was filled in and should be sent.
+ */
+bool Session::take_ack(InlineMessage &ack) {
+  if (!m_pipelined || m_seq == m_acked || m_state != SENDER) {
+    return false;
+  }
+  ack = InlineMessage(TAG_ACK, std::to_string(m_seq));
+  m_acked = m_seq;
+  return true;
+}
+
+/**
+ * Processes one request of a sender which pipelines its requests.
+ * Requests are numbered in the order they are received, starting
+ * at 1. Successful requests are not replied to, but acknowledged by
+ * take_ack, and errors are replied to as "err:seq:text".
+ */
+bool Session::handle_pipelined(const MessageView &request, InlineMessage &reply) {
+  m_seq++;
+  bool has_reply = handle_request(request, reply);
+  if (!has_reply || m_state != SENDER) {
+    return has_reply; // quit's reply acknowledges everything
+  }
+  if (reply.tag() == TAG_OK) {
+    return false;
+  }
+  reply = InlineMessage(TAG_ERR, std::to_string(m_seq) + ":" + reply.data_string());
+  return true;
+}
+
+/**
+ * Processes one request, replying to it as the protocol requires.
+ */
+bool Session::handle_request(const MessageView &request, InlineMessage &reply) {
+  switch (m_state) {
+  case LOGIN:
+    return handle_login(request, reply);
+  case SENDER:
+    return handle_sender(request, reply);
+  case RECEIVER_JOIN:
+    return handle_receiver_join(request, reply);
+  default:
+    // receivers don't send anything once they have joined a room
+    return false;
+  }
+}
+
+/**
+ * Ends the session. The user leaves the room it has joined,
+ * and is destroyed (by the room, if it was a receiver there).
+ */
+void Session::close() {
+  if (m_user != nullptr) {
+    leave_room();
+    delete m_user;
+    m_user = nullptr;
+    m_server->count_users(-1);
+  }
+  m_state = CLOSED;
+}
+
+/**
+ * Handles the login request, which determines whether the client
+ * is a sender or a receiver.
+ */
+bool Session::handle_login(const MessageView &request, InlineMessage &reply) {
+  if (request.tag_id() != TAG_SLOGIN && request.tag_id() != TAG_RLOGIN) {
+    reply = InlineMessage(TAG_ERR, "Login Message Receive Error");
+    m_state = CLOSED;
+    return true;
+  }
+
+  std::string username = request.data_string();
+  bool binary = username.length() > BINARY_SUFFIX_LEN &&
+    username.compare(username.length() - BINARY_SUFFIX_LEN, BINARY_SUFFIX_LEN, BINARY_SUFFIX) == 0;
+  if (binary) {
+    username.resize(username.length() - BINARY_SUFFIX_LEN);
+  }
+  if (!is_valid_room_username(username)) {
+    reply = InlineMessage(TAG_ERR, "Invalid username");
+    m_state = CLOSED;
+    return true;
+  }
+
+  m_user = new User(username, next_user_id.fetch_add(1, std::memory_order_relaxed));
+  m_user->binary = binary;
+  m_binary = binary;
+  m_server->count_users(1);
+  const ServerOptions &options = m_server->get_options();
+  m_user->mqueue.set_limit(options.queue_limit, options.overflow_policy, options.spill_dir);
+  m_user->mqueue.set_ring_overrun(options.overflow_policy_set);
+  if (request.tag_id() == TAG_SLOGIN) {
+    reply = InlineMessage(TAG_OK, "Logged in as a sender: " + m_user->username);
+    m_state = SENDER;
+  } else {
+    reply = InlineMessage(TAG_OK, "Logged in as a receiver: " + m_user->username);
+    m_state = RECEIVER_JOIN;
+  }
+  return true;
+}
+
+// The handlers of sender requests, indexed by tag
+const Session::Handler Session::SENDER_HANDLERS[NUM_TAGS + 1] = {
+  &Session::handle_sender_err,   // TAG_ERR
+  &Session::handle_invalid_tag,  // TAG_OK
+  &Session::handle_invalid_tag,  // TAG_SLOGIN
+  &Session::handle_invalid_tag,  // TAG_RLOGIN
+  &Session::handle_sender_join,  // TAG_JOIN
+  &Session::handle_sender_leave, // TAG_LEAVE
+  &Session::handle_sendall,      // TAG_SENDALL
+  &Session::handle_invalid_tag,  // TAG_SENDUSER
+  &Session::handle_quit,         // TAG_QUIT
+  &Session::handle_invalid_tag,  // TAG_DELIVERY
+  &Session::handle_invalid_tag,  // TAG_EMPTY
+  &Session::handle_pipeline,     // TAG_PIPELINE
+  &Session::handle_invalid_tag,  // TAG_ACK
+  &Session::handle_sendbatch,    // TAG_SENDBATCH
+  &Session::handle_invalid_tag,  // TAG_UNKNOWN
+};
+
+/**
+ * Handles a request from a sender client, by calling the handler
+ * for its tag.
+ */
+bool Session::handle_sender(const MessageView &request, InlineMessage &reply) {
+  static_assert(sizeof(SENDER_HANDLERS) / sizeof(SENDER_HANDLERS[0]) == NUM_TAGS + 1,
+                "every tag needs a handler");
+  return (this->*SENDER_HANDLERS[request.tag_id()])(request, reply);
+}
+
+/**
+ * Handles an error reported by a sender client: the session ends.
+ */
+bool Session::handle_sender_err(const MessageView &request, InlineMessage &) {
+  std::cerr << request.data_string() << std::endl;
+  close();
+  return false;
+}
+
+/**
+ * Handles a sender's request to join a room.
+ */
+bool Session::handle_sender_join(const MessageView &request, InlineMessage &reply) {
+  std::string room_name = request.data_string();
+  if (is_valid_room_username(room_name)) {
+    // senders are not members of the room, they only need to
+    // remember which room their messages go to
+    leave_room();
+    m_user->room = m_server->find_or_create_room(room_name);
+    reply = InlineMessage(TAG_OK, "joined room");
+  } else {
+    reply = InlineMessage(TAG_ERR, "Invalid Room number");
+  }
+  return true;
+}
+
+/**
+ * Handles a sender's message to the room it has joined.
+ */
+bool Session::handle_sendall(const MessageView &request, InlineMessage &reply) {
+  if (m_user->room != nullptr) {
+    m_user->room->broadcast_message(m_user, request.data, request.data_len);
+    reply = InlineMessage(TAG_OK, "sent");
+  } else {
+    reply = InlineMessage(TAG_ERR, "Not joined any room");
+  }
+  return true;
+}
+
+/**
+ * Handles a batch of messages a sender sends to the room it has
+ * joined, which are broadcast together and replied to once.
+ */
+bool Session::handle_sendbatch(const MessageView &request, InlineMessage &reply) {
+  if (!m_binary) {
+    reply = InlineMessage(TAG_ERR, "Batches need the binary protocol");
+    return true;
+  }
+  if (m_user->room == nullptr) {
+    reply = InlineMessage(TAG_ERR, "Not joined any room");
+    return true;
+  }
+
+  Batch::Entry messages[Batch::MAX_MESSAGES];
+  size_t count = Batch::split(request.data, request.data_len, messages);
+  if (count == 0) {
+    reply = InlineMessage(TAG_ERR, "Invalid batch");
+    return true;
+  }
+  m_user->room->broadcast_batch(m_user, messages, count);
+  reply = InlineMessage(TAG_OK, "sent");
+  return true;
+}
+
+/**
+ * Handles a sender's request to leave its room.
+ */
+bool Session::handle_sender_leave(const MessageView &, InlineMessage &reply) {
+  if (m_user->room != nullptr) {
+    leave_room();
+    reply = InlineMessage(TAG_OK, "Left the room");
+  } else {
+    reply = InlineMessage(TAG_ERR, "Not in a room");
+  }
+  return true;
+}
+
+/**
+ * Handles a sender's request to end the session.
+ */
+bool Session::handle_quit(const MessageView &, InlineMessage &reply) {
+  reply = InlineMessage(TAG_OK, "Bye");
+  close();
+  return true;
+}
+
+/**
+ * Handles a sender's request to switch to pipelined mode.
+ */
+bool Session::handle_pipeline(const MessageView &, InlineMessage &reply) {
+  if (m_pipelined) {
+    reply = InlineMessage(TAG_ERR, "Already pipelined");
+    return true;
+  }
+  m_pipelined = true;
+  m_seq = 0;
+  m_acked = 0;
+  reply = InlineMessage(TAG_OK, "pipelined");
+  return true;
+}
+
+/**
+ * Handles a request with a tag senders may not use.
+ */
+bool Session::handle_invalid_tag(const MessageView &, InlineMessage &reply) {
+  reply = InlineMessage(TAG_ERR, "Invalid tag");
+  return true;
+}
+
+/**
+ * Handles the join request a receiver client sends after logging in.
+ */
+bool Session::handle_receiver_join(const MessageView &request, InlineMessage &reply) {
+  if (request.tag_id() != TAG_JOIN) {
+    reply = InlineMessage(TAG_ERR, "Tag Error");
+    close();
+    return true;
+  }
+
+  // "room:last:N" or "room:since:S" replays the room's history first
+  std::string room_name = request.data_string();
+  bool history = false;
+  bool since = false;
+  uint64_t count = 0;
+  size_t colon = room_name.find(':');
+  if (colon != std::string::npos) {
+    history = true;
+    if (!parse_history(room_name.substr(colon + 1), since, count)) {
+      reply = InlineMessage(TAG_ERR, "Invalid history");
+      close();
+      return true;
+    }
+    room_name.resize(colon);
+  }
+
+  if (!is_valid_room_username(room_name)) {
+    reply = InlineMessage(TAG_ERR, "Invalid Room number");
+    close();
+  } else {
+    join_room(room_name, history, since, count);
+    reply = InlineMessage(TAG_OK, "joined room");
+    m_state = RECEIVER;
+  }
+  return true;
+}
+
+/**
+ * Adds the (receiver) user to the named room, replaying the room's
+ * history to it first if asked to.
+ *
+ * @param room_name The room to join.
+ * @param history Whether to replay history.
+ * @param since True to replay the messages from the one numbered
+ *              count on, false to replay the last count messages.
+ * @param count See since.
+ */
+void Session::join_room(const std::string &room_name, bool history, bool since, uint64_t count) {
+  leave_room();
+  Room *room = m_server->find_or_create_room(room_name);
+  m_user->room = room;
+  m_user->numbered = history; // so it can resume after the last one it got
+  if (!history) {
+    room->add_member(m_user);
+    return;
+  }
+
+  uint64_t first_seq = count;
+  if (!since) {
+    uint64_t end = room->next_seq();
+    first_seq = end > count ? end - count : 1;
+  }
+  room->add_member_since(m_user, first_seq);
+}
+
+/**
+ * Removes the user from the room it has joined, if any, and drops
+ * its reference to the room. A receiver's user is handed over to the
+ * room, which destroys it once no broadcast can reach it anymore, so
+ * the session is left without one; it no longer touches the socket.
+ */
+void Session::leave_room() {
+  Room *room = m_user->room;
+  if (room == nullptr) {
+    return;
+  }
+  m_user->room = nullptr;
+  if (m_state == RECEIVER) {
+    room->remove_member(m_user);
+    m_user = nullptr;
+  }
+  room->unref();
+}
@@ -0,0 +1,103 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+class Server;
+struct User;
+struct InlineMessage;
+struct MessageView;
+
+bool is_valid_room_username(const std::string &name);
+
+// A Session holds the protocol state of a single client connection.
+// It does not perform any I/O itself: the caller feeds it each request
+// received from the client and transmits the reply it produces. This
+// allows the same protocol logic to be driven either by a dedicated
+// thread doing blocking I/O, or by an event loop.
+class Session {
+public:
+  enum State {
+    LOGIN,         // waiting for slogin or rlogin
+    SENDER,        // logged in as a sender
+    RECEIVER_JOIN, // logged in as a receiver, waiting for join
+    RECEIVER,      // receiver has joined a room, messages are delivered
+    CLOSED,        // session is over, connection should be closed
+  };
+
+  Session(Server *server);
+  ~Session();
+
+  // Room for any reply encoded by encode_reply
+  static const size_t MAX_REPLY_SIZE = 16 + 254; // BinaryHeader::SIZE + InlineMessage::CAPACITY
+
+  State get_state() const { return m_state; }
+  User *get_user() const { return m_user; }
+
+  // Whether the client selected the binary protocol at login
+  bool is_binary() const { return m_binary; }
+
+  // Find the next request in the data received from the client;
+  // returns its length, or 0 if there is no complete request yet
+  size_t next_request(const char *buf, size_t avail, bool eof, MessageView &request);
+
+  // Process one request from the client. Returns true if reply
+  // was filled in and should be sent back to the client.
+  bool handle(const MessageView &request, InlineMessage &reply);
+
+  // Encode a reply (or ack) in the client's protocol, into out or
+  // at the end of out; encode_reply returns the encoded length
+  size_t encode_reply(const InlineMessage &reply, char *out);
+  void append_reply(const InlineMessage &reply, std::string &out);
+
+  // Fill in an acknowledgment of the requests a pipelining sender
+  // sent since the last one; returns false if there is nothing to
+  // acknowledge. Call it after handling all requests received so far.
+  bool take_ack(InlineMessage &ack);
+
+  // End the session: the user leaves its room (if any) and is destroyed.
+  void close();
+
+private:
+  // prohibit value semantics
+  Session(const Session &);
+  Session &operator=(const Session &);
+
+  typedef bool (Session::*Handler)(const MessageView &request, InlineMessage &reply);
+  static const Handler SENDER_HANDLERS[];
+
+  bool handle_request(const MessageView &request, InlineMessage &reply);
+  bool handle_pipelined(const MessageView &request, InlineMessage &reply);
+  bool handle_login(const MessageView &request, InlineMessage &reply);
+  bool handle_sender(const MessageView &request, InlineMessage &reply);
+  bool handle_sender_err(const MessageView &request, InlineMessage &reply);
+  bool handle_sender_join(const MessageView &request, InlineMessage &reply);
+  bool handle_sendall(const MessageView &request, InlineMessage &reply);
+  bool handle_sendbatch(const MessageView &request, InlineMessage &reply);
+  bool handle_sender_leave(const MessageView &request, InlineMessage &reply);
+  bool handle_quit(const MessageView &request, InlineMessage &reply);
+  bool handle_pipeline(const MessageView &request, InlineMessage &reply);
+  bool handle_invalid_tag(const MessageView &request, InlineMessage &reply);
+  bool handle_receiver_join(const MessageView &request, InlineMessage &reply);
+
+  void join_room(const std::string &room_name, bool history, bool since, uint64_t count);
+  void leave_room();
+
+  Server *m_server;
+  User *m_user;
+  State m_state;
+
+  // m_binary: requests are binary frames (from the one after the
+  // login on); m_binary_replies: so are replies (after the login's)
+  bool m_binary;
+  bool m_binary_replies;
+
+  // a pipelining sender gets acks instead of replies to its requests:
+  // m_seq requests were handled, up to m_acked were acknowledged
+  bool m_pipelined;
+  unsigned long m_seq;
+  unsigned long m_acked;
+};
+
+#endif // SESSION_H
@@ -0,0 +1,432 @@
+#include <iostream>
+#include <string>
+#include <atomic>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "message.h"
+#include "frame.h"
+#include "user.h"
+#include "session.h"
+#include "guard.h"
+#include "thread_pool.h"
+#include "session_scheduler.h"
+
+namespace {
+
+// Stop draining a receiver's queue once this much output is pending,
+// the rest is picked up once the socket becomes writable again
+const size_t OUTPUT_HIGH_WATER = 64 * 1024;
+
+// Maximum number of reads performed each time a task runs, so a single
+// busy client can't hog a worker
+const int MAX_READS_PER_RUN = 16;
+
+const int MAX_EVENTS = 256;
+
+// Value of a client's wakeup count once its task is finished:
+// large enough that scheduling it never sees a count of zero again
+const unsigned WAKEUPS_RETIRED = 1u << 30;
+
+bool set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+}
+
+// Per-connection state. Only the client's task accesses it,
+// except for the wakeup count.
+struct SessionScheduler::Client {
+  SessionScheduler *scheduler;
+  int fd;
+  Session session;
+  std::string in;       // received bytes not yet parsed into requests
+  std::string out;      // encoded messages not yet written
+  size_t out_pos;       // how much of out has already been written
+  int queue_fd;         // receiver's queue eventfd, once registered
+  bool queue_backlog;   // deliver stopped before the queue was empty
+  bool hangup;          // the peer closed its end: retire once output is sent
+
+  // number of times the client was scheduled since its task last
+  // went idle; the task is submitted to the pool when it goes from 0 to 1
+  std::atomic<unsigned> wakeups;
+
+  Client(SessionScheduler *scheduler, int fd, Server *server)
+    : scheduler(scheduler)
+    , fd(fd)
+    , session(server)
+    , out_pos(0)
+    , queue_fd(-1)
+    , queue_backlog(false)
+    , hangup(false)
+    , wakeups(0) {
+  }
+
+  ~Client() {
+    // leave the room first, so nothing can shut down the socket
+    // (queue overflow) once its descriptor was closed
+    session.close();
+    close(fd);
+  }
+
+  size_t pending_output() const { return out.size() - out_pos; }
+};
+
+/**
+ * Constructor for the SessionScheduler class.
+ *
+ * @param server The Server object managing the connections.
+ * @param pool The ThreadPool the client tasks run on.
+ */
+SessionScheduler::SessionScheduler(Server *server, ThreadPool *pool)
+  : m_server(server)
+  , m_pool(pool)
+  , m_epfd(-1)
+  , m_wakefd(-1) {
+  pthread_mutex_init(&m_lock, nullptr);
+}
+
+/**
+ * Destructor for the SessionScheduler class.
+ */
+SessionScheduler::~SessionScheduler() {
+  if (m_wakefd >= 0) {
+    close(m_wakefd);
+  }
+  if (m_epfd >= 0) {
+    close(m_epfd);
+  }
+  pthread_mutex_destroy(&m_lock);
+}
+
+/**
+ * Creates the epoll instance and starts the reactor thread.
+ *
+ * @return True if successful, false otherwise.
+ */
+bool SessionScheduler::start() {
+  m_epfd = epoll_create1(EPOLL_CLOEXEC);
+  m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_epfd < 0 || m_wakefd < 0) {
+    std::cerr << "Error: could not create reactor: " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr; // the wakeup eventfd is the only watch without a client
+  if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_wakefd, &ev) < 0) {
+    std::cerr << "Error: epoll_ctl: " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  if (pthread_create(&m_thread, nullptr, run, this) != 0) {
+    std::cerr << "Pthread Creation Error" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Registers a newly accepted client socket. Its task is scheduled
+ * once the client has sent something.
+ *
+ * @param fd The client socket.
+ */
+void SessionScheduler::add_connection(int fd) {
+  if (!set_nonblocking(fd)) {
+    close(fd);
+    return;
+  }
+
+  Client *client = new Client(this, fd, m_server);
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+  ev.data.ptr = client;
+  if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    std::cerr << "Error: epoll_ctl: " << strerror(errno) << std::endl;
+    delete client;
+  }
+}
+
+void *SessionScheduler::run(void *arg) {
+  static_cast<SessionScheduler *>(arg)->loop();
+  return nullptr;
+}
+
+/**
+ * Reactor loop: schedules the task of every client with a ready
+ * file descriptor, and destroys retired clients.
+ */
+void SessionScheduler::loop() {
+  struct epoll_event events[MAX_EVENTS];
+
+  while (true) {
+    int n = epoll_wait(m_epfd, events, MAX_EVENTS, -1);
+    if (n < 0 && errno != EINTR) {
+      std::cerr << "Error: epoll_wait: " << strerror(errno) << std::endl;
+      return;
+    }
+
+    for (int i = 0; i < n; i++) {
+      Client *client = static_cast<Client *>(events[i].data.ptr);
+      if (client == nullptr) {
+        uint64_t count;
+        ssize_t rc = read(m_wakefd, &count, sizeof(count));
+        (void) rc;
+      } else {
+        schedule(client);
+      }
+    }
+
+    // A client is retired only after its descriptors were removed from
+    // epoll, so no later batch of events can refer to it, and the events
+    // of the batch above have all been handled by now.
+    std::vector<Client *> retired;
+    {
+      Guard guard(m_lock);
+      retired.swap(m_retired);
+    }
+    for (Client *client : retired) {
+      delete client; // destroying the session removes the user from its room
+    }
+  }
+}
+
+/**
+ * Pool task servicing one client. Runs again if the client was
+ * scheduled while the task was running.
+ */
+void SessionScheduler::run_task(void *arg) {
+  Client *client = static_cast<Client *>(arg);
+  SessionScheduler *self = client->scheduler;
+
+  while (true) {
+    unsigned seen = client->wakeups.load();
+    if (!self->service(client)) {
+      self->retire(client);
+      return;
+    }
+    if (client->wakeups.compare_exchange_strong(seen, 0)) {
+      return;
+    }
+  }
+}
+
+/**
+ * Makes sure the client's task runs (again).
+ */
+void SessionScheduler::schedule(Client *client) {
+  if (client->wakeups.fetch_add(1) == 0) {
+    m_pool->submit(run_task, client);
+  }
+}
+
+/**
+ * Does all the work a client has pending without blocking, and
+ * re-arms its file descriptors.
+ *
+ * @return False if the client should be closed, true otherwise.
+ */
+bool SessionScheduler::service(Client *client) {
+  if (!client->hangup && !read_requests(client)) {
+    return false;
+  }
+
+  if (!client->hangup && client->session.get_state() == Session::RECEIVER && client->queue_fd < 0) {
+    MessageQueue &queue = client->session.get_user()->mqueue;
+    queue.set_socket(client->fd);
+    int fd = queue.get_notify_fd();
+    struct epoll_event ev;
+    ev.events = EPOLLONESHOT; // armed by rearm
+    ev.data.ptr = client;
+    if (fd >= 0 && epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+      client->queue_fd = fd;
+    }
+  }
+
+  // the replies to the last requests of a client which closed its
+  // end are still sent before the client is retired
+  deliver(client);
+  if (!flush(client)) {
+    return false;
+  }
+
+  bool ending = client->hangup || client->session.get_state() == Session::CLOSED;
+  if (ending && client->pending_output() == 0) {
+    return false;
+  }
+  return rearm(client);
+}
+
+/**
+ * Reads whatever the client has sent and processes every complete
+ * request line. At EOF, the client is marked as hung up.
+ *
+ * @return False if the connection failed, true otherwise.
+ */
+bool SessionScheduler::read_requests(Client *client) {
+  bool open = true;
+  bool eof = false;
+  char buf[4096];
+
+  for (int i = 0; i < MAX_READS_PER_RUN; i++) {
+    ssize_t n = read(client->fd, buf, sizeof(buf));
+    if (n > 0) {
+      client->in.append(buf, n);
+      if (static_cast<size_t>(n) < sizeof(buf)) {
+        break;
+      }
+    } else if (n == 0) {
+      eof = true;
+      break;
+    } else if (errno == EINTR) {
+      continue;
+    } else {
+      open = (errno == EAGAIN || errno == EWOULDBLOCK);
+      break;
+    }
+  }
+
+  size_t pos = 0;
+  while (client->session.get_state() != Session::CLOSED) {
+    MessageView request;
+    size_t len = client->session.next_request(client->in.data() + pos, client->in.size() - pos,
+                                              eof || !open, request);
+    if (len == 0) {
+      break;
+    }
+
+    InlineMessage reply;
+    if (client->session.handle(request, reply)) {
+      client->session.append_reply(reply, client->out);
+    }
+    pos += len;
+  }
+
+  // requests of a pipelining sender are acknowledged once per read
+  InlineMessage ack;
+  if (client->session.take_ack(ack)) {
+    client->session.append_reply(ack, client->out);
+  }
+  client->in.erase(0, pos);
+
+  if (eof) {
+    client->hangup = true;
+    client->queue_backlog = false;
+  }
+  return open;
+}
+
+/**
+ * Moves messages from a receiver's queue into its output buffer,
+ * until the queue is empty or enough output is pending.
+ */
+void SessionScheduler::deliver(Client *client) {
+  if (client->queue_fd < 0 || client->hangup) {
+    return;
+  }
+
+  // reset the eventfd before draining, it is signaled again
+  // once the queue was found empty and notification re-armed
+  uint64_t count;
+  ssize_t rc = read(client->queue_fd, &count, sizeof(count));
+  (void) rc;
+
+  User *user = client->session.get_user();
+  client->queue_backlog = true;
+  while (client->pending_output() < OUTPUT_HIGH_WATER) {
+    Frame *frame = user->mqueue.try_dequeue();
+    if (frame == nullptr) {
+      // have the next enqueue signal the eventfd, unless one raced us
+      if (user->mqueue.arm_notify()) {
+        client->queue_backlog = false;
+        break;
+      }
+      continue;
+    }
+    client->out.append(frame->data(), frame->size());
+    frame->unref();
+  }
+}
+
+/**
+ * Writes as much pending output as the socket accepts.
+ *
+ * @return False if writing failed, true otherwise.
+ */
+bool SessionScheduler::flush(Client *client) {
+  while (client->pending_output() > 0) {
+    ssize_t n = write(client->fd, client->out.data() + client->out_pos, client->pending_output());
+    if (n > 0) {
+      client->out_pos += n;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else {
+      return false;
+    }
+  }
+
+  if (client->pending_output() == 0) {
+    client->out.clear();
+    client->out_pos = 0;
+  }
+  return true;
+}
+
+/**
+ * Re-arms the client's one-shot registrations. The queue eventfd is only
+ * armed while there is room for more output; otherwise the task runs
+ * again once the socket is writable. Once the client hung up, only
+ * the socket's writability is waited for.
+ *
+ * @return False if epoll_ctl failed, true otherwise.
+ */
+bool SessionScheduler::rearm(Client *client) {
+  // with deliveries still queued, wait for the socket to take more
+  bool backlogged = client->pending_output() > 0 || client->queue_backlog;
+
+  struct epoll_event ev;
+  ev.events = (client->hangup ? 0 : EPOLLIN | EPOLLRDHUP) | EPOLLONESHOT | (backlogged ? EPOLLOUT : 0);
+  ev.data.ptr = client;
+  if (epoll_ctl(m_epfd, EPOLL_CTL_MOD, client->fd, &ev) < 0) {
+    return false;
+  }
+
+  if (client->queue_fd >= 0 && !client->hangup && client->pending_output() < OUTPUT_HIGH_WATER) {
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_MOD, client->queue_fd, &ev) < 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Called by a client's task once it is finished: unregisters the
+ * client and hands it to the reactor thread to be destroyed.
+ */
+void SessionScheduler::retire(Client *client) {
+  epoll_ctl(m_epfd, EPOLL_CTL_DEL, client->fd, nullptr);
+  if (client->queue_fd >= 0) {
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, client->queue_fd, nullptr);
+  }
+
+  // any further schedule() call sees a non-zero count and does nothing
+  client->wakeups.store(WAKEUPS_RETIRED);
+
+  {
+    Guard guard(m_lock);
+    m_retired.push_back(client);
+  }
+  uint64_t one = 1;
+  ssize_t rc = write(m_wakefd, &one, sizeof(one));
+  (void) rc;
+}
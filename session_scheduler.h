@@ -0,0 +1,60 @@
+#ifndef SESSION_SCHEDULER_H
+#define SESSION_SCHEDULER_H
+
+#include <vector>
+#include <pthread.h>
+class Server;
+class ThreadPool;
+
+// A SessionScheduler runs client sessions as resumable tasks on a
+// ThreadPool, instead of dedicating a thread to each client.
+//
+// A task services its client until it would block (no complete request
+// left to process, no deliveries left in the receiver's queue, or the
+// socket not accepting more output), then re-arms its file descriptors
+// and returns. A reactor thread waits for those descriptors with epoll
+// (in one-shot mode) and schedules the task again once one of them is
+// ready. At most one instance of a client's task runs at any time.
+class SessionScheduler {
+public:
+  SessionScheduler(Server *server, ThreadPool *pool);
+  ~SessionScheduler();
+
+  // Create the epoll instance and start the reactor thread
+  bool start();
+
+  // Hand over a newly accepted client socket. May be called from any thread.
+  void add_connection(int fd);
+
+private:
+  // prohibit value semantics
+  SessionScheduler(const SessionScheduler &);
+  SessionScheduler &operator=(const SessionScheduler &);
+
+  struct Client;
+
+  static void *run(void *arg);
+  void loop();
+
+  static void run_task(void *arg);
+  void schedule(Client *client);
+  bool service(Client *client);
+  bool read_requests(Client *client);
+  void deliver(Client *client);
+  bool flush(Client *client);
+  bool rearm(Client *client);
+  void retire(Client *client);
+
+  Server *m_server;
+  ThreadPool *m_pool;
+  int m_epfd;
+  int m_wakefd; // eventfd signaled when a client is retired
+  pthread_t m_thread;
+
+  pthread_mutex_t m_lock; // protects m_retired
+  // clients whose tasks are finished, destroyed by the reactor thread
+  // once it can no longer be handling events for them
+  std::vector<Client *> m_retired;
+};
+
+#endif // SESSION_SCHEDULER_H
@@ -0,0 +1,165 @@
+#include <iostream>
+#include <cstring>
+#include <sched.h>
+#include <unistd.h>
+#include "guard.h"
+#include "thread_pool.h"
+
+namespace {
+
+// worker running on the current thread, if any
+thread_local void *t_current_worker = nullptr;
+
+}
+
+/**
+ * Constructor for the ThreadPool class.
+ *
+ * @param num_threads The number of worker threads.
+ * @param pin Whether each worker should be pinned to a CPU.
+ */
+ThreadPool::ThreadPool(int num_threads, bool pin)
+  : m_num_threads(num_threads)
+  , m_pin(pin)
+  , m_next(0)
+  , m_queued(0)
+  , m_sleepers(0) {
+  pthread_mutex_init(&m_idle_lock, nullptr);
+  pthread_cond_init(&m_idle_cond, nullptr);
+}
+
+/**
+ * Destructor for the ThreadPool class.
+ * The workers run for the lifetime of the server, so this only
+ * releases the synchronization objects.
+ */
+ThreadPool::~ThreadPool() {
+  pthread_cond_destroy(&m_idle_cond);
+  pthread_mutex_destroy(&m_idle_lock);
+}
+
+/**
+ * Creates the worker threads.
+ *
+ * @return True if successful, false otherwise.
+ */
+bool ThreadPool::start() {
+  for (int i = 0; i < m_num_threads; i++) {
+    Worker *worker = new Worker();
+    worker->pool = this;
+    worker->index = i;
+    pthread_mutex_init(&worker->lock, nullptr);
+    m_workers.push_back(worker);
+  }
+
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  for (Worker *worker : m_workers) {
+    if (pthread_create(&worker->thread, nullptr, run, worker) != 0) {
+      std::cerr << "Pthread Creation Error" << std::endl;
+      return false;
+    }
+
+    if (m_pin && ncpus > 0) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(worker->index % ncpus, &cpus);
+      int rc = pthread_setaffinity_np(worker->thread, sizeof(cpus), &cpus);
+      if (rc != 0) {
+        std::cerr << "Warning: could not pin worker " << worker->index
+                  << ": " << strerror(rc) << std::endl;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * Submits a task to the pool.
+ *
+ * @param fn The function to run.
+ * @param arg The argument passed to fn.
+ */
+void ThreadPool::submit(TaskFn fn, void *arg) {
+  Worker *target = static_cast<Worker *>(t_current_worker);
+  if (target == nullptr || target->pool != this) {
+    target = m_workers[m_next.fetch_add(1, std::memory_order_relaxed) % m_workers.size()];
+  }
+
+  {
+    Guard guard(target->lock);
+    target->tasks.push_back(Task{fn, arg});
+  }
+
+  m_queued.fetch_add(1);
+  if (m_sleepers.load() > 0) {
+    Guard guard(m_idle_lock);
+    pthread_cond_signal(&m_idle_cond);
+  }
+}
+
+void *ThreadPool::run(void *arg) {
+  Worker *self = static_cast<Worker *>(arg);
+  t_current_worker = self;
+  self->pool->work(self);
+  return nullptr;
+}
+
+/**
+ * Worker loop: runs local tasks, steals when there are none,
+ * and sleeps when there is nothing to steal either.
+ */
+void ThreadPool::work(Worker *self) {
+  while (true) {
+    Task task;
+    if (pop_local(self, task) || steal(self, task)) {
+      task.fn(task.arg);
+    } else {
+      wait_for_work();
+    }
+  }
+}
+
+/**
+ * Takes the oldest task from the worker's own deque.
+ */
+bool ThreadPool::pop_local(Worker *self, Task &task) {
+  Guard guard(self->lock);
+  if (self->tasks.empty()) {
+    return false;
+  }
+  task = self->tasks.front();
+  self->tasks.pop_front();
+  m_queued.fetch_sub(1);
+  return true;
+}
+
+/**
+ * Takes the newest task from the deque of another worker, so the
+ * victim keeps the tasks it would run next.
+ */
+bool ThreadPool::steal(Worker *self, Task &task) {
+  size_t n = m_workers.size();
+  for (size_t i = 1; i < n; i++) {
+    Worker *victim = m_workers[(self->index + i) % n];
+    Guard guard(victim->lock);
+    if (!victim->tasks.empty()) {
+      task = victim->tasks.back();
+      victim->tasks.pop_back();
+      m_queued.fetch_sub(1);
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Sleeps until a task is submitted anywhere in the pool.
+ */
+void ThreadPool::wait_for_work() {
+  Guard guard(m_idle_lock);
+  m_sleepers.fetch_add(1);
+  while (m_queued.load() == 0) {
+    pthread_cond_wait(&m_idle_cond, &m_idle_lock);
+  }
+  m_sleepers.fetch_sub(1);
+}
@@ -0,0 +1,64 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <pthread.h>
+
+// A fixed-size pool of worker threads. Every worker has its own deque
+// of tasks: tasks submitted from a worker go to its own deque, other
+// tasks are spread over the workers round-robin. A worker runs the
+// tasks of its own deque in order, and when that is empty it steals
+// from the other workers before going to sleep.
+class ThreadPool {
+public:
+  typedef void (*TaskFn)(void *arg);
+
+  // num_threads workers are created; if pin is true, worker i is
+  // pinned to CPU i (modulo the number of CPUs)
+  ThreadPool(int num_threads, bool pin);
+  ~ThreadPool();
+
+  // Start the worker threads
+  bool start();
+
+  // Run fn(arg) on one of the workers. May be called from any thread.
+  void submit(TaskFn fn, void *arg);
+
+private:
+  // prohibit value semantics
+  ThreadPool(const ThreadPool &);
+  ThreadPool &operator=(const ThreadPool &);
+
+  struct Task {
+    TaskFn fn;
+    void *arg;
+  };
+
+  struct Worker {
+    ThreadPool *pool;
+    int index;
+    pthread_t thread;
+    pthread_mutex_t lock; // protects tasks
+    std::deque<Task> tasks;
+  };
+
+  static void *run(void *arg);
+  void work(Worker *self);
+  bool pop_local(Worker *self, Task &task);
+  bool steal(Worker *self, Task &task);
+  void wait_for_work();
+
+  int m_num_threads;
+  bool m_pin;
+  std::vector<Worker *> m_workers;
+  std::atomic<unsigned> m_next;   // round-robin target of external submits
+  std::atomic<int> m_queued;      // tasks waiting in any deque
+  std::atomic<int> m_sleepers;    // workers waiting for work
+
+  pthread_mutex_t m_idle_lock;
+  pthread_cond_t m_idle_cond;
+};
+
+#endif // THREAD_POOL_H
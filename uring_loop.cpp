@@ -0,0 +1,722 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "message.h"
+#include "frame.h"
+#include "user.h"
+#include "session.h"
+#include "uring_loop.h"
+
+namespace {
+
+const unsigned SQ_ENTRIES = 1024;
+const unsigned CQ_ENTRIES = 8192;
+
+// Provided buffers used by the multishot recvs of all clients of a loop
+const unsigned BUF_GROUP = 0;
+const unsigned BUF_COUNT = 512; // must be a power of 2
+const unsigned BUF_SIZE = 4096;
+
+// Stop draining a receiver's queue once this much output is pending,
+// the rest is sent once the current send completes
+const size_t OUTPUT_HIGH_WATER = 64 * 1024;
+
+const uintptr_t OP_MASK = 7;
+
+// Every ring, the probe's included, is set up with these flags. Only
+// the loop thread submits, so the ring is a single issuer; it is
+// created disabled, and the loop thread enables it, which makes that
+// thread the issuer. IORING_SETUP_SINGLE_ISSUER appeared in the same
+// release (6.0) as multishot recv, so accepting it tells us multishot
+// recv is available.
+const unsigned SETUP_FLAGS = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_R_DISABLED;
+
+int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return int(syscall(__NR_io_uring_setup, entries, p));
+}
+
+int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return int(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return int(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+template<typename T>
+T load_acquire(const T *p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+template<typename T>
+void store_release(T *p, T v) {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+}
+
+// The mapped submission and completion queues of an io_uring instance,
+// along with its ring of provided receive buffers
+struct UringLoop::Ring {
+  int fd;
+
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned sq_entries;
+  unsigned sq_local_tail; // tail including sqes not yet published
+  unsigned to_submit;
+  struct io_uring_sqe *sqes;
+
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ptr;
+  size_t sq_size;
+  void *cq_ptr;
+  size_t cq_size;
+  size_t sqes_size;
+
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_size;
+  char *bufs;
+  unsigned short buf_tail;
+
+  Ring()
+    : fd(-1), sqes(static_cast<io_uring_sqe *>(MAP_FAILED)), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED)
+    , buf_ring(static_cast<io_uring_buf_ring *>(MAP_FAILED)), bufs(static_cast<char *>(MAP_FAILED)) {
+  }
+
+  ~Ring() {
+    if (bufs != MAP_FAILED) munmap(bufs, size_t(BUF_COUNT) * BUF_SIZE);
+    if (buf_ring != MAP_FAILED) munmap(buf_ring, buf_ring_size);
+    if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+    if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+    if (fd >= 0) close(fd);
+  }
+
+  bool init(unsigned setup_flags);
+  bool init_buffers();
+  bool enable();
+  void add_buffer(unsigned bid);
+  int submit(unsigned wait_nr);
+};
+
+/**
+ * Creates the io_uring instance and maps its queues.
+ *
+ * @param setup_flags Extra IORING_SETUP_* flags.
+ * @return True if successful, false otherwise.
+ */
+bool UringLoop::Ring::init(unsigned setup_flags) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE | setup_flags;
+  p.cq_entries = CQ_ENTRIES;
+
+  fd = sys_io_uring_setup(SQ_ENTRIES, &p);
+  if (fd < 0) {
+    return false;
+  }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+    return false;
+  }
+
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (cq_size > sq_size) {
+    sq_size = cq_size;
+  }
+  cq_size = sq_size;
+  sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq_ptr == MAP_FAILED) {
+    return false;
+  }
+  cq_ptr = sq_ptr;
+
+  sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = static_cast<io_uring_sqe *>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+  if (sqes == MAP_FAILED) {
+    return false;
+  }
+
+  char *sq = static_cast<char *>(sq_ptr);
+  sq_head = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+  sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+  sq_mask = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+  sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+  sq_entries = p.sq_entries;
+  sq_local_tail = *sq_tail;
+  to_submit = 0;
+
+  char *cq = static_cast<char *>(cq_ptr);
+  cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+  cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+  cq_mask = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+  cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+
+  return true;
+}
+
+/**
+ * Registers the ring of provided buffers used by multishot recvs,
+ * and hands every buffer to the kernel.
+ *
+ * @return True if successful, false otherwise.
+ */
+bool UringLoop::Ring::init_buffers() {
+  buf_ring_size = BUF_COUNT * sizeof(struct io_uring_buf);
+  buf_ring = static_cast<io_uring_buf_ring *>(mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE,
+                                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  bufs = static_cast<char *>(mmap(nullptr, size_t(BUF_COUNT) * BUF_SIZE, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (buf_ring == MAP_FAILED || bufs == MAP_FAILED) {
+    return false;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = reinterpret_cast<uintptr_t>(buf_ring);
+  reg.ring_entries = BUF_COUNT;
+  reg.bgid = BUF_GROUP;
+  if (sys_io_uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    return false;
+  }
+
+  buf_tail = 0;
+  for (unsigned bid = 0; bid < BUF_COUNT; bid++) {
+    add_buffer(bid);
+  }
+  return true;
+}
+
+/**
+ * Enables a ring set up disabled, making the calling thread its
+ * only issuer.
+ *
+ * @return True if successful, false otherwise.
+ */
+bool UringLoop::Ring::enable() {
+  return sys_io_uring_register(fd, IORING_REGISTER_ENABLE_RINGS, nullptr, 0) == 0;
+}
+
+/**
+ * Gives a provided buffer (back) to the kernel.
+ */
+void UringLoop::Ring::add_buffer(unsigned bid) {
+  // buf_ring->bufs can't be used from C++: the empty struct the header
+  // places in front of the flexible array has a size of 1 in C++
+  struct io_uring_buf *ring = reinterpret_cast<io_uring_buf *>(buf_ring);
+  struct io_uring_buf *buf = &ring[buf_tail & (BUF_COUNT - 1)];
+  buf->addr = reinterpret_cast<uintptr_t>(bufs + size_t(bid) * BUF_SIZE);
+  buf->len = BUF_SIZE;
+  buf->bid = bid;
+  buf_tail++;
+  store_release(&buf_ring->tail, buf_tail);
+}
+
+/**
+ * Publishes the queued sqes to the kernel and waits for completions.
+ *
+ * @param wait_nr Number of completions to wait for.
+ * @return The io_uring_enter result, or -errno on failure.
+ */
+int UringLoop::Ring::submit(unsigned wait_nr) {
+  store_release(sq_tail, sq_local_tail);
+  int rc = sys_io_uring_enter(fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+  if (rc < 0) {
+    return -errno;
+  }
+  to_submit -= (unsigned(rc) < to_submit) ? unsigned(rc) : to_submit;
+  return rc;
+}
+
+// Per-connection state
+struct UringLoop::Client {
+  int fd;
+  Session session;
+  std::string in;        // partial request line carried over between recvs
+  std::string out;       // output waiting for the in-flight send to finish
+  std::string sending;   // output owned by the in-flight send
+  int queue_fd;          // receiver's queue eventfd, once joined
+  uint64_t queue_count;  // target of the eventfd read
+  int refs;              // operations in flight
+  bool recv_armed;
+  bool send_inflight;
+  bool queue_armed;
+  bool hangup;           // the peer closed its end: close once output is sent
+  bool closing;
+
+  Client(int fd, Server *server)
+    : fd(fd)
+    , session(server)
+    , queue_fd(-1)
+    , queue_count(0)
+    , refs(0)
+    , recv_armed(false)
+    , send_inflight(false)
+    , queue_armed(false)
+    , hangup(false)
+    , closing(false) {
+  }
+
+  ~Client() {
+    // leave the room first, so nothing can shut down the socket
+    // (queue overflow) once its descriptor was closed
+    session.close();
+    close(fd);
+  }
+};
+
+/**
+ * Constructor for the UringLoop class.
+ *
+ * @param server The Server object managing the connections.
+ * @param listen_fd The listening socket to accept connections from.
+ * @param accepts Counter of accepted connections.
+ */
+UringLoop::UringLoop(Server *server, int listen_fd, std::atomic<unsigned long> *accepts)
+  : m_server(server)
+  , m_listen_fd(listen_fd)
+  , m_accepts(accepts)
+  , m_ring(new Ring()) {
+}
+
+/**
+ * Destructor for the UringLoop class.
+ */
+UringLoop::~UringLoop() {
+  delete m_ring;
+}
+
+/**
+ * Checks whether the kernel supports the io_uring features used by the loop.
+ *
+ * @return True if io_uring can be used, false otherwise.
+ */
+bool UringLoop::is_supported() {
+  Ring probe;
+  return probe.init(SETUP_FLAGS) && probe.init_buffers() && probe.enable();
+}
+
+/**
+ * Sets up the ring and starts the loop thread.
+ *
+ * @return True if successful, false otherwise.
+ */
+bool UringLoop::start() {
+  if (!m_ring->init(SETUP_FLAGS) || !m_ring->init_buffers()) {
+    std::cerr << "Error: could not set up io_uring: " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  if (pthread_create(&m_thread, nullptr, run, this) != 0) {
+    std::cerr << "Pthread Creation Error" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Waits for the loop thread to exit.
+ */
+void UringLoop::join() {
+  pthread_join(m_thread, nullptr);
+}
+
+void *UringLoop::run(void *arg) {
+  static_cast<UringLoop *>(arg)->loop();
+  return nullptr;
+}
+
+/**
+ * Main loop: submits queued operations, waits for completions
+ * and dispatches them.
+ */
+void UringLoop::loop() {
+  if (!m_ring->enable()) {
+    std::cerr << "Error: could not enable io_uring: " << strerror(errno) << std::endl;
+    return;
+  }
+  arm_accept();
+
+  while (true) {
+    int rc = m_ring->submit(1);
+    if (rc < 0 && rc != -EINTR && rc != -EBUSY) {
+      std::cerr << "Error: io_uring_enter: " << strerror(-rc) << std::endl;
+      return;
+    }
+
+    unsigned head = *m_ring->cq_head;
+    unsigned tail = load_acquire(m_ring->cq_tail);
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &m_ring->cqes[head & *m_ring->cq_mask];
+      Client *client = reinterpret_cast<Client *>(uintptr_t(cqe->user_data) & ~OP_MASK);
+      Op op = Op(cqe->user_data & OP_MASK);
+
+      switch (op) {
+      case OP_ACCEPT:
+        on_accept(cqe->res, cqe->flags);
+        break;
+      case OP_RECV:
+        on_recv(client, cqe->res, cqe->flags);
+        break;
+      case OP_SEND:
+        on_send(client, cqe->res);
+        break;
+      case OP_QUEUE_READ:
+        on_queue_read(client, cqe->res);
+        break;
+      case OP_CANCEL:
+        break;
+      }
+
+      if (client != nullptr && client->closing && client->refs == 0) {
+        release(client);
+      }
+    }
+    store_release(m_ring->cq_head, head);
+  }
+}
+
+/**
+ * Returns a zeroed sqe for an operation on behalf of client,
+ * submitting the queued ones first if the submission queue is full.
+ */
+io_uring_sqe *UringLoop::get_sqe(Client *client, Op op) {
+  Ring *r = m_ring;
+  while (r->sq_local_tail - load_acquire(r->sq_head) >= r->sq_entries) {
+    r->submit(0);
+  }
+
+  unsigned idx = r->sq_local_tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = reinterpret_cast<uintptr_t>(client) | uintptr_t(op);
+  r->sq_array[idx] = idx;
+  r->sq_local_tail++;
+  r->to_submit++;
+
+  if (client != nullptr && op != OP_CANCEL) {
+    client->refs++;
+  }
+  return sqe;
+}
+
+/**
+ * Submits a multishot accept on the listening socket.
+ */
+void UringLoop::arm_accept() {
+  struct io_uring_sqe *sqe = get_sqe(nullptr, OP_ACCEPT);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = m_listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+/**
+ * Submits a multishot recv which reads into provided buffers.
+ */
+void UringLoop::arm_recv(Client *client) {
+  struct io_uring_sqe *sqe = get_sqe(client, OP_RECV);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = client->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUF_GROUP;
+  client->recv_armed = true;
+}
+
+/**
+ * Submits a read of the receiver's queue eventfd, which completes
+ * once messages are waiting to be delivered.
+ */
+void UringLoop::arm_queue_read(Client *client) {
+  struct io_uring_sqe *sqe = get_sqe(client, OP_QUEUE_READ);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = client->queue_fd;
+  sqe->addr = reinterpret_cast<uintptr_t>(&client->queue_count);
+  sqe->len = sizeof(client->queue_count);
+  sqe->off = uint64_t(-1);
+  client->queue_armed = true;
+}
+
+/**
+ * Sends the pending output, unless a send is already in flight. For a
+ * receiver, the send is linked with the next read of its queue eventfd.
+ */
+void UringLoop::flush(Client *client) {
+  if (client->closing || client->send_inflight) {
+    return;
+  }
+
+  bool watch_queue = client->queue_fd >= 0 && !client->queue_armed && !client->hangup;
+
+  if (!client->out.empty()) {
+    client->sending.swap(client->out);
+    client->out.clear();
+
+    struct io_uring_sqe *sqe = get_sqe(client, OP_SEND);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = client->fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(client->sending.data());
+    sqe->len = unsigned(client->sending.size());
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    if (watch_queue) {
+      sqe->flags = IOSQE_IO_LINK;
+    }
+    client->send_inflight = true;
+  }
+
+  if (watch_queue) {
+    arm_queue_read(client);
+  }
+}
+
+/**
+ * Cancels a client's pending operation of the given kind.
+ */
+void UringLoop::cancel(Client *client, Op op) {
+  struct io_uring_sqe *sqe = get_sqe(nullptr, OP_CANCEL);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = reinterpret_cast<uintptr_t>(client) | uintptr_t(op);
+}
+
+/**
+ * Handles a connection accepted by the multishot accept.
+ */
+void UringLoop::on_accept(int res, uint32_t flags) {
+  if (!(flags & IORING_CQE_F_MORE)) {
+    arm_accept();
+  }
+
+  if (res < 0) {
+    std::cerr << "Client connection accept error: " << strerror(-res) << std::endl;
+    return;
+  }
+
+  m_accepts->fetch_add(1, std::memory_order_relaxed);
+  Client *client = new Client(res, m_server);
+  arm_recv(client);
+}
+
+/**
+ * Handles data (or EOF) received by a client's multishot recv.
+ */
+void UringLoop::on_recv(Client *client, int res, uint32_t flags) {
+  if (!(flags & IORING_CQE_F_MORE)) {
+    client->recv_armed = false;
+    client->refs--;
+  }
+
+  if (flags & IORING_CQE_F_BUFFER) {
+    unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    if (res > 0 && !client->closing) {
+      process_input(client, m_ring->bufs + size_t(bid) * BUF_SIZE, size_t(res), false);
+    }
+    recycle_buffer(bid);
+  }
+
+  if (client->closing) {
+    return;
+  }
+
+  if (res == 0) {
+    // the replies to the last requests may still have to be sent:
+    // the client is closed once they were (see on_send)
+    process_input(client, "", 0, true);
+    client->hangup = true;
+    flush(client);
+    if (!client->send_inflight) {
+      close_client(client);
+    }
+    return;
+  } else if (res < 0 && res != -ENOBUFS) {
+    close_client(client);
+    return;
+  }
+
+  if (!client->recv_armed) {
+    // ran out of provided buffers, or the kernel ended the multishot
+    arm_recv(client);
+  }
+
+  if (client->session.get_state() == Session::RECEIVER && client->queue_fd < 0) {
+    MessageQueue &queue = client->session.get_user()->mqueue;
+    client->queue_fd = queue.get_notify_fd();
+    queue.set_socket(client->fd);
+    // messages enqueued before the eventfd existed didn't signal it
+    deliver(client);
+  }
+  flush(client);
+
+  if (client->session.get_state() == Session::CLOSED && !client->send_inflight) {
+    close_client(client);
+  }
+}
+
+/**
+ * Handles completion of a send.
+ */
+void UringLoop::on_send(Client *client, int res) {
+  client->refs--;
+  client->send_inflight = false;
+
+  if (client->closing) {
+    return;
+  }
+  if (res < 0) {
+    close_client(client);
+    return;
+  }
+
+  if (size_t(res) < client->sending.size()) {
+    // short send: whatever wasn't sent goes before any newer output
+    client->out.insert(0, client->sending, size_t(res), std::string::npos);
+  }
+  client->sending.clear();
+
+  bool ending = client->hangup || client->session.get_state() == Session::CLOSED;
+  if (ending && client->out.empty()) {
+    close_client(client);
+    return;
+  }
+
+  if (!client->hangup) {
+    deliver(client);
+  }
+  flush(client);
+}
+
+/**
+ * Handles completion of the read of a receiver's queue eventfd.
+ */
+void UringLoop::on_queue_read(Client *client, int res) {
+  client->refs--;
+  client->queue_armed = false;
+
+  if (client->closing || client->hangup) {
+    return;
+  }
+  if (res < 0 && res != -ECANCELED) {
+    close_client(client);
+    return;
+  }
+
+  // -ECANCELED means the send it was linked to came up short,
+  // in which case flush re-arms the read
+  deliver(client);
+  flush(client);
+}
+
+/**
+ * Splits received data into request lines and processes them. Complete
+ * lines are parsed straight out of the provided buffer, only a trailing
+ * partial line is copied.
+ */
+void UringLoop::process_input(Client *client, const char *data, size_t len, bool eof) {
+  const char *buf = data;
+  size_t avail = len;
+  if (!client->in.empty()) {
+    client->in.append(data, len);
+    buf = client->in.data();
+    avail = client->in.size();
+  }
+
+  size_t pos = 0;
+  while (client->session.get_state() != Session::CLOSED) {
+    MessageView request;
+    size_t request_len = client->session.next_request(buf + pos, avail - pos, eof, request);
+    if (request_len == 0) {
+      break;
+    }
+    process_request(client, request);
+    pos += request_len;
+  }
+
+  // requests of a pipelining sender are acknowledged once per read
+  InlineMessage ack;
+  if (client->session.take_ack(ack)) {
+    client->session.append_reply(ack, client->out);
+  }
+
+  if (buf == data) {
+    client->in.assign(data + pos, avail - pos);
+  } else {
+    client->in.erase(0, pos);
+  }
+}
+
+/**
+ * Passes one request to the client's session and queues its reply.
+ */
+void UringLoop::process_request(Client *client, const MessageView &request) {
+  InlineMessage reply;
+  if (client->session.handle(request, reply)) {
+    client->session.append_reply(reply, client->out);
+  }
+}
+
+/**
+ * Moves messages from a receiver's queue into its output buffer,
+ * until the queue is empty or enough output is pending.
+ */
+void UringLoop::deliver(Client *client) {
+  if (client->queue_fd < 0) {
+    return;
+  }
+
+  User *user = client->session.get_user();
+  while (client->out.size() < OUTPUT_HIGH_WATER) {
+    Frame *frame = user->mqueue.try_dequeue();
+    if (frame == nullptr) {
+      // have the next enqueue signal the eventfd, unless one raced us
+      if (user->mqueue.arm_notify()) {
+        break;
+      }
+      continue;
+    }
+    client->out.append(frame->data(), frame->size());
+    frame->unref();
+  }
+}
+
+/**
+ * Returns a provided buffer to the kernel once its data was consumed.
+ */
+void UringLoop::recycle_buffer(unsigned bid) {
+  m_ring->add_buffer(bid);
+}
+
+/**
+ * Starts closing a client: its pending operations are cancelled, and it
+ * is released once all of them have completed.
+ */
+void UringLoop::close_client(Client *client) {
+  if (client->closing) {
+    return;
+  }
+  client->closing = true;
+
+  if (client->recv_armed) {
+    cancel(client, OP_RECV);
+  }
+  if (client->queue_armed) {
+    cancel(client, OP_QUEUE_READ);
+  }
+  shutdown(client->fd, SHUT_RDWR);
+}
+
+/**
+ * Destroys a closed client once no operation refers to it anymore.
+ */
+void UringLoop::release(Client *client) {
+  delete client; // destroying the session removes the user from its room
+}
@@ -0,0 +1,87 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include <cstdint>
+#include <atomic>
+#include <pthread.h>
+class Server;
+struct MessageView;
+struct io_uring_sqe;
+
+// A UringLoop services client connections from a single thread using
+// io_uring instead of readiness notifications:
+//
+// - connections are accepted with a multishot accept on the shared
+//   listening socket, so each loop accepts its own clients
+// - each client has a multishot recv that reads into buffers provided
+//   to the kernel up front, which are parsed in place into requests
+// - a receiver's pending deliveries are sent with a single send linked
+//   to a read of its queue's eventfd, so the loop learns about new
+//   messages only once the previous batch was written
+//
+// Submissions are batched, so each loop iteration costs one
+// io_uring_enter call regardless of how many clients were serviced.
+class UringLoop {
+public:
+  // Accepted connections are counted in *accepts
+  UringLoop(Server *server, int listen_fd, std::atomic<unsigned long> *accepts);
+  ~UringLoop();
+
+  // Returns true if the running kernel supports everything the
+  // loop needs (multishot accept and recv, provided buffer rings)
+  static bool is_supported();
+
+  // Set up the ring and start the loop thread
+  bool start();
+
+  // Wait for the loop thread to exit
+  void join();
+
+private:
+  // prohibit value semantics
+  UringLoop(const UringLoop &);
+  UringLoop &operator=(const UringLoop &);
+
+  struct Ring;
+  struct Client;
+
+  // operation kinds, stored in the low bits of the sqe user data
+  enum Op {
+    OP_ACCEPT,
+    OP_RECV,
+    OP_SEND,
+    OP_QUEUE_READ,
+    OP_CANCEL,
+  };
+
+  static void *run(void *arg);
+  void loop();
+
+  io_uring_sqe *get_sqe(Client *client, Op op);
+
+  void arm_accept();
+  void arm_recv(Client *client);
+  void arm_queue_read(Client *client);
+  void flush(Client *client);
+  void cancel(Client *client, Op op);
+
+  void on_accept(int res, uint32_t flags);
+  void on_recv(Client *client, int res, uint32_t flags);
+  void on_send(Client *client, int res);
+  void on_queue_read(Client *client, int res);
+
+  void process_input(Client *client, const char *data, size_t len, bool eof);
+  void process_request(Client *client, const MessageView &request);
+  void deliver(Client *client);
+  void recycle_buffer(unsigned bid);
+  void close_client(Client *client);
+  void release(Client *client);
+
+  Server *m_server;
+  int m_listen_fd;
+  std::atomic<unsigned long> *m_accepts;
+  Ring *m_ring;
+  pthread_t m_thread;
+};
+
+#endif // URING_LOOP_H
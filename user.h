@@ -2,16 +2,41 @@
 #define USER_H
 
 #include <string>
+#include <cstdint>
 #include "message_queue.h"
+class Room;
 
 struct User {
   std::string username;
-  std::string room_number = "";
+
+  // identifies the user in binary frames
+  uint32_t id;
+
+  // whether the user speaks the binary protocol, so deliveries
+  // must be binary frames
+  bool binary = false;
+
+  // whether text deliveries carry the messages' sequence numbers,
+  // as they do for receivers which joined with history
+  bool numbered = false;
+
+  // the room the user has joined, if any; the user holds a
+  // reference to it, so it remains valid until the user leaves
+  Room *room = nullptr;
+
+  // the room's messages numbered below this (see RoomLog) are not
+  // delivered to the user: they were sent before it joined, or
+  // replayed when it joined
+  uint64_t live_from = 0;
 
   // queue of pending messages awaiting delivery
   MessageQueue mqueue;
 
-  User(const std::string &username) : username(username) { }
+  User(const std::string &username, uint32_t id) : username(username), id(id) { }
+
+  DeliveryFormat delivery_format() const {
+    return binary ? DELIVERY_BINARY : numbered ? DELIVERY_NUMBERED_TEXT : DELIVERY_TEXT;
+  }
 };
 
 #endif // USER_H